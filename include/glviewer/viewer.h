@@ -102,6 +102,9 @@ private :
 	
 	// Scene and render information
 	nori::Scene* m_scene; 
+	std::vector<nori::Instance*> m_instances; // Instances which can be moved (Tab selects, arrows and page up/down move)
+	size_t m_selectedInstance;
+	bool m_geometryChanged; // Whether instances were moved since the last render
 	viewer::Camera* m_camera;
 	nori::BlockGenerator* m_blockGenerator;
 	nori::ImageBlock* m_image;
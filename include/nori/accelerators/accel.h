@@ -34,6 +34,9 @@ struct Intersection;
 */
 class Accel {
 public:
+	/// Maximum number of rays traced together by \ref rayIntersectPacket()
+	static const int MAX_PACKET_SIZE = 16;
+
 	/**
 	* \brief Register a scene object for inclusion in the acceleration
 	* data structure
@@ -45,6 +48,16 @@ public:
 	/// Build the acceleration data structure (currently a no-op)
 	virtual void build();
 
+	/**
+	* \brief Update the acceleration data structure after the registered
+	* shapes were moved or deformed
+	*
+	* The shapes must already have recomputed their bounding boxes, and the
+	* number of shapes and primitives must not have changed. This default
+	* implementation only recomputes the scene bounding box.
+	*/
+	virtual void refit();
+
 	/// Return an axis-aligned box that bounds the scene
 	virtual const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
@@ -69,6 +82,60 @@ public:
 	*/
 	virtual bool rayIntersect(const Ray3f& ray, Intersection& its, bool shadowRay) const;
 
+	/**
+	* \brief Check whether anything blocks the ray segment
+	*
+	* This is the query used for shadow rays: it stops at the first
+	* intersection found and does not compute any intersection details.
+	* The default implementation calls \ref rayIntersect() with
+	* <tt>shadowRay = true</tt>.
+	*
+	* \return \c true if an intersection was found
+	*/
+	virtual bool rayOccluded(const Ray3f &ray) const;
+
+	/**
+	* \brief Intersect a packet of rays against the scene
+	*
+	* Meant for coherent rays, such as the camera rays of neighbouring
+	* pixels, which can share most of their traversal. The default
+	* implementation traces the rays one by one.
+	*
+	* \param count
+	*    Number of rays in the packet (at most \ref MAX_PACKET_SIZE)
+	* \param rays
+	*    The rays of the packet
+	* \param its
+	*    Intersection records, filled in for every ray that hit something
+	* \param hit
+	*    Receives whether each ray hit something
+	*/
+	virtual void rayIntersectPacket(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const;
+
+	/**
+	* \brief Intersect a batch of independent rays against the scene
+	*
+	* Unlike \ref rayIntersectPacket(), the rays need not be coherent
+	* (e.g. diffuse bounces), and there can be any number of them. This
+	* lets the acceleration data structure overlap the memory accesses of
+	* several rays. The default implementation traces the rays one by one.
+	*
+	* \param count
+	*    Number of rays in the batch
+	* \param rays
+	*    The rays of the batch
+	* \param its
+	*    Intersection records, filled in for every ray that hit something
+	* \param hit
+	*    Receives whether each ray hit something
+	*/
+	virtual void rayIntersectBatch(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const;
+
+	/// Return a summary of statistics gathered while tracing rays (empty if there are none)
+	virtual std::string getStatistics() const { return std::string(); }
+
 protected:
 
 	std::vector<Shape*> m_shapes;   ///< Objects
@@ -16,9 +16,16 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include <nori/shapes/shape.h>
 #include <nori/shapes/mesh.h>
 #include <nori/accelerators/accel.h>
+#include <nori/core/mmap.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
+class NodeAllocator;
+
 /**
 * \brief Bounding Volume Hierarchy for fast ray intersection queries
 *
@@ -37,17 +44,101 @@ NORI_NAMESPACE_BEGIN
 * \author Wenzel Jakob
 */
 class BVH : public Accel {
-	friend class BVHBuildTask;
+	friend class BVHBuilder;
+	friend class SBVHBuilder;
+	friend class LBVHBuilder;
+	friend class NodeAllocator;
+	friend class BVHAnalyzer;
 public:
+	/// Available tree construction algorithms
+	enum class EBuilder {
+		ESAH,             ///< Binned SAH builder (default)
+		ESpatialSplits,   ///< SAH builder with spatial splits (SBVH)
+		ELinear,          ///< Morton code builder (LBVH)
+		EHierarchical     ///< Morton code builder with SAH upper levels (HLBVH)
+	};
+
+	/// Maximum number of rays traversed in round-robin by \ref rayIntersectBatch()
+	static const int MAX_INTERLEAVE = 16;
+
 	/// Create a new and empty BVH
 	BVH() { m_shapeOffset.push_back(0u); }
 
+	/**
+	* \brief Create a new and empty BVH configured by the scene properties
+	*
+	* Recognized properties:
+	*  - \c precomputeTriangles: copy the triangles into a contiguous array
+	*    in leaf order after the build (uses more memory, but avoids the
+	*    per-primitive index/shape lookups during traversal)
+	*  - \c bvhBuilder: tree construction algorithm, one of
+	*     - \c sah: binned SAH builder (default)
+	*     - \c sbvh: spatial split BVH, which reduces node overlap for
+	*       large or long and thin triangles
+	*     - \c lbvh: linear BVH over primitives sorted by Morton codes,
+	*       builds much faster but traces slower (e.g. for previews)
+	*     - \c hlbvh: like \c lbvh, but the upper levels are built with
+	*       the SAH, which recovers most of the trace performance
+	*  - \c spatialSplits: same as <tt>bvhBuilder = sbvh</tt>
+	*  - \c bvhBinCount: number of bins per axis used by the SAH builder to
+	*    evaluate split planes (default: 16)
+	*  - \c spatialSplitBudget: maximum number of references duplicated
+	*    by spatial splits, relative to the primitive count (default: 0.3)
+	*  - \c spatialSplitAlpha: only try spatial splits when the children of
+	*    the best object split overlap by more than this fraction of the
+	*    scene's surface area (default: 1e-5)
+	*  - \c bvhCache: directory in which built trees are cached, keyed by a
+	*    hash of the geometry and of the above build parameters. On a cache
+	*    hit, the tree is memory-mapped from disk instead of being rebuilt
+	*    (default: empty, i.e. no caching)
+	*  - \c refitThreshold: \ref refit() rebuilds the tree from scratch once
+	*    its SAH cost exceeds the cost at build time by this factor
+	*    (default: 1.5)
+	*  - \c bvhLazy: only build the top levels of the tree up front, and
+	*    build each subtree the first time a ray enters it (default: false).
+	*    This saves most of the build time and memory when rays only ever
+	*    reach a small part of the scene. Requires the \c sah builder, and
+	*    can not be combined with \c bvhCache or \c precomputeTriangles
+	*  - \c bvhLazySize: number of triangles below which subtrees are
+	*    deferred in the lazy mode (default: 4096)
+	*  - \c bvhInterleave: number of rays which \ref rayIntersectBatch()
+	*    traverses in round-robin, between 1 (one ray after the other)
+	*    and \ref MAX_INTERLEAVE. Only pays off for trees which are much
+	*    larger than the caches, for those 8 works well (default: 1)
+	*/
+	BVH(const PropertyList &propList)
+		: m_precomputeTriangles(propList.getBoolean("precomputeTriangles", false))
+		, m_builder(parseBuilder(propList))
+		, m_binCount(propList.getInteger("bvhBinCount", 16))
+		, m_spatialSplitBudget(propList.getFloat("spatialSplitBudget", 0.3f))
+		, m_spatialSplitAlpha(propList.getFloat("spatialSplitAlpha", 1e-5f))
+		, m_cacheDir(propList.getString("bvhCache", ""))
+		, m_refitThreshold(propList.getFloat("refitThreshold", 1.5f))
+		, m_lazy(propList.getBoolean("bvhLazy", false))
+		, m_lazySize(propList.getInteger("bvhLazySize", 4096))
+		, m_interleave(propList.getInteger("bvhInterleave", 1)) {
+		m_shapeOffset.push_back(0u);
+		if (m_binCount < 2)
+			throw NoriException("BVH: bvhBinCount must be at least 2 (got %i)", m_binCount);
+		if (m_lazy && m_builder != EBuilder::ESAH)
+			throw NoriException("BVH: bvhLazy requires bvhBuilder = sah");
+		if (m_lazy && (!m_cacheDir.empty() || m_precomputeTriangles))
+			throw NoriException("BVH: bvhLazy can not be combined with bvhCache or precomputeTriangles");
+		if (m_lazySize < 1)
+			throw NoriException("BVH: bvhLazySize must be positive (got %i)", m_lazySize);
+		if (m_interleave < 1 || m_interleave > MAX_INTERLEAVE)
+			throw NoriException("BVH: bvhInterleave must be between 1 and %i (got %i)", (int) MAX_INTERLEAVE, m_interleave);
+	}
+
 	/// Release all resources
 	virtual ~BVH() { clear(); };
 
 	/// Release all resources
 	void clear();
 
+	/// Forget the registered shapes without deleting them (when they are owned by another accelerator)
+	void releaseShapes() { m_shapes.clear(); }
+
 	/**
 	* \brief Register a shape for inclusion in the BVH.
 	*
@@ -55,9 +146,25 @@ public:
 	*/
 	virtual void addShape(Shape *shape) override;
 
-	/// Build the BVH
+	/// Build the BVH, or load it from the cache directory if enabled
 	virtual void build() override;
 
+	/**
+	* \brief Update the BVH after shapes were moved or deformed
+	*
+	* Recomputes all node bounds bottom-up while keeping the tree topology.
+	* Since the quality of a refitted tree degrades as the geometry moves
+	* away from where it was at build time, the SAH cost is re-evaluated
+	* afterwards, and the tree is rebuilt from scratch when it exceeds the
+	* cost at build time by more than the \c refitThreshold factor. Note
+	* that the clipped reference bounds of a spatial split BVH are replaced
+	* by full primitive bounds, so such trees degrade much faster.
+	*
+	* In the lazy mode (\c bvhLazy), the top levels are rebuilt instead, and
+	* the subtrees are built again on demand.
+	*/
+	virtual void refit() override;
+
 	/**
 	* \brief Intersect a ray against all shapes registered
 	* with the BVH
@@ -69,18 +176,80 @@ public:
 	* information is really needed. When set to \c true, the
 	* function just checks whether or not there is occlusion, but without
 	* providing any more detail (i.e. \c its will not be filled with
-	* contents). This is usually much faster.
+	* contents). This is usually much faster, such queries are forwarded
+	* to \ref rayOccluded().
 	*
 	* \return \c true If an intersection was found
 	*/
 	virtual bool rayIntersect(const Ray3f &ray, Intersection &its,
 		bool shadowRay = false) const override;
 
+	/**
+	* \brief Any-hit traversal for shadow rays
+	*
+	* Visits children front-to-back, and returns as soon as any primitive
+	* blocks the ray segment, without any of the intersection bookkeeping.
+	*/
+	virtual bool rayOccluded(const Ray3f &ray) const override;
+
+	/**
+	* \brief Closest-hit traversal which only reports the primitive that was hit
+	*
+	* Unlike \ref rayIntersect(), no \ref Intersection record is filled in.
+	* This lets callers which intersect the BVH with a transformed ray (e.g.
+	* instances) defer that work until the overall closest hit is known.
+	*
+	* \param t
+	*    Upon success, the distance to the closest intersection
+	* \param miqr
+	*    Upon success, \c miqr.f and \c miqr.uv describe the hit primitive
+	* \param shape
+	*    Upon success, the shape which was hit
+	*
+	* \return \c true if an intersection was found
+	*/
+	virtual bool rayIntersectPrimitive(const Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const;
+
+	/**
+	* \brief Intersect a packet of rays against all shapes registered with the BVH
+	*
+	* All rays of the packet descend the tree together, so each node is only
+	* fetched once, and its bounding box is tested against all rays at once
+	* (using SSE where available). Rays which miss a node are masked out of
+	* its subtree; once a single ray is left, it continues with the regular
+	* single-ray traversal. Packets whose directions do not share the same
+	* octant would visit children in inconsistent orders, and are traced as
+	* single rays instead.
+	*/
+	virtual void rayIntersectPacket(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const override;
+
+	/**
+	* \brief Intersect a batch of independent rays, interleaving their traversals
+	*
+	* A single ray spends most of its time waiting for the next node or
+	* triangle to arrive from memory. Here, groups of \c bvhInterleave rays
+	* take turns: each ray advances by one step, and prefetches the data of
+	* its next step (the next pair of child nodes, or the primitives of a
+	* leaf) before the next ray continues. By the time a ray gets its next
+	* turn, its data is likely in the cache. The rays need not be coherent,
+	* so this also works for secondary rays. This is the asynchronous memory
+	* access chaining (AMAC) scheme of
+	*
+	* "Asynchronous Memory Access Chaining"
+	* by Onur Kocberber, Babak Falsafi and Boris Grot (Proc. VLDB 2015)
+	*
+	* The results are the same as those of \ref rayIntersect().
+	*/
+	virtual void rayIntersectBatch(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const override;
+
 	/// Return the total number of shapes registered with the BVH
 	uint32_t getShapeCount() const { return (uint32_t)m_shapes.size(); }
 
 	/// Return the total number of internally represented triangles 
-	uint32_t getTriangleCount() const { return m_shapeOffset.back(); }
+	IndexType getTriangleCount() const { return m_shapeOffset.back(); }
 
 	/// Return one of the registered shapes
 	Shape *getShape(uint32_t idx) { return m_shapes[idx]; }
@@ -88,20 +257,49 @@ public:
 	/// Return one of the registered shapes (const version)
 	const Shape *getShape(uint32_t idx) const { return m_shapes[idx]; }
 
+	/// In the lazy mode, report how much of the tree was built on demand so far
+	virtual std::string getStatistics() const override;
+
 
 protected:
+	struct BVHNode;
+	struct PrecomputedTriangle;
+
+	/**
+	* \brief Primitive type of a leaf, which selects the intersection kernel
+	*
+	* The builders produce leaves whose primitives are all of one type (see
+	* \ref separatePrimitiveTypes()), so that the leaf loops are specialized
+	* for that type and call the inlined tests of \ref Mesh and \ref Sphere
+	* directly. Only other shapes go through the virtual
+	* \ref Shape::rayIntersect().
+	*/
+	enum class EPrimitiveType : uint8_t {
+		ETriangle = 0,  ///< Mesh triangles (also the type of zero-initialized leaves)
+		ESphere,        ///< Spheres
+		EGeneric,       ///< Any other shape
+		EMixed          ///< Several of the above (only for \ref m_sceneType)
+	};
+
+	/// Return the primitive type of a shape
+	static EPrimitiveType getPrimitiveType(const Shape *shape) {
+		if (shape->isMesh())
+			return EPrimitiveType::ETriangle;
+		return shape->isSphere() ? EPrimitiveType::ESphere : EPrimitiveType::EGeneric;
+	}
+
 	/**
 	* \brief Compute the shape indices corresponding to
 	* a primitive index used by the underlying generic BVH implementation.
 	*/
-	uint32_t findShape(uint32_t &idx) const {
+	uint32_t findShape(IndexType &idx) const {
 		auto it = std::lower_bound(m_shapeOffset.begin(), m_shapeOffset.end(), idx + 1) - 1;
 		idx -= *it;
 		return (uint32_t)(it - m_shapeOffset.begin());
 	}
 
 	//// Return an axis-aligned bounding box containing the given triangle or shape
-	BoundingBox3f getBoundingBox(uint32_t index) const {
+	BoundingBox3f getBoundingBox(IndexType index) const {
 		uint32_t shapeIdx = findShape(index);
 		if (m_shapes[shapeIdx]->isMesh())
 			return static_cast<Mesh*>(m_shapes[shapeIdx])->getBoundingBox(index);
@@ -110,7 +308,7 @@ protected:
 	}
 
 	//// Return the centroid of the given triangle or shape
-	Point3f getCentroid(uint32_t index) const {
+	Point3f getCentroid(IndexType index) const {
 		uint32_t shapeIdx = findShape(index);
 		if (m_shapes[shapeIdx]->isMesh())
 			return static_cast<Mesh*>(m_shapes[shapeIdx])->getCentroid(index);
@@ -119,24 +317,212 @@ protected:
 	}
 
 	/// Compute internal tree statistics
-	std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
+	std::pair<float, IndexType> statistics(IndexType index = 0) const;
+
+	/// Read the \c bvhBuilder and \c spatialSplits properties
+	static EBuilder parseBuilder(const PropertyList &propList);
+
+	/// Run the configured builder, filling \ref m_nodes and \ref m_indices
+	void buildTree();
+
+	/**
+	* \brief Make every leaf below \c root refer to primitives of a single type
+	*
+	* The primitives of mixed leaves are sorted by type, and the leaf is
+	* replaced by a small subtree with one leaf per type. This is a no-op
+	* for scenes which only consist of meshes.
+	*/
+	void separatePrimitiveTypes(NodeAllocator &nodes, IndexType root);
+
+	/// Recompute the bounds of all nodes bottom-up (used by \ref refit())
+	virtual void refitNodes();
+
+	/// Return the SAH cost of the tree used by the traversal
+	virtual float getSAHCost() const { return statistics().first; }
+
+	/// Let the traversal use the node and index arrays built into \ref m_nodes and \ref m_indices
+	void useBuiltTree();
+
+	/// Hash of everything the built tree depends on (geometry and build parameters)
+	uint64_t computeCacheKey() const;
+
+	/// Map a cached tree from disk, returns \c false if the file is missing or stale
+	bool loadCache(const std::string &filename, uint64_t key);
+
+	/// Write the built tree to a cache file
+	void writeCache(const std::string &filename, uint64_t key) const;
+
+	/**
+	* \brief Intersect a ray against the primitives referenced by
+	* <tt>m_indices[start, end)</tt>
+	*
+	* On a hit, <tt>ray.maxt</tt> is shortened, \c hitShape and
+	* <tt>miqr.f</tt> are updated to refer to the closest primitive
+	* found so far.
+	*
+	* The range may mix primitive types (leaves of the kd-tree and the
+	* wide BVH do not record their type), which are then dispatched one
+	* primitive at a time.
+	*
+	* \return \c true if any of the primitives was hit
+	*/
+	bool intersectPrimitives(IndexType start, IndexType end, Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&hitShape) const;
+
+	/// Like \ref intersectPrimitives(), for the primitives of a (non-lazy) leaf of the given type
+	bool intersectLeaf(const BVHNode &node, Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&hitShape) const;
+
+	/// Leaf loop of \ref intersectPrimitives() specialized for one primitive type
+	template <EPrimitiveType Type> bool intersectRange(IndexType start, IndexType end, Ray3f &ray,
+		float &t, MeshIntersectionQueryRecord &miqr, const Shape *&hitShape) const;
+
+	/**
+	* \brief Intersect a ray against a single primitive of a known type
+	*
+	* \param tri
+	*    The precomputed primitive, or \c nullptr if there are none
+	*
+	* \param idx
+	*    Triangle index within the mesh \c shape (unused for other types)
+	*/
+	template <EPrimitiveType Type> bool intersectPrimitive(const PrecomputedTriangle *tri,
+		const Shape *shape, IndexType idx, const Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr) const;
+
+	/**
+	* \brief Look up the shape, precomputed triangle and type of the primitive <tt>m_indices[i]</tt>
+	*
+	* \param shapeIdx
+	*    Index of the shape of the previous primitive, which is updated. The
+	*    primitives of a leaf mostly belong to the same shape, so the shape is
+	*    only searched for when the primitive lies outside of that one. Start
+	*    each leaf with 0
+	*/
+	const Shape *lookupPrimitive(IndexType i, const PrecomputedTriangle *&tri,
+		IndexType &idx, EPrimitiveType &type, uint32_t &shapeIdx) const;
+
+	/**
+	* \brief Closest-hit traversal of the subtree below \c node_idx
+	*
+	* Like \ref intersectPrimitives(), this shortens <tt>ray.maxt</tt> and
+	* updates \c t, \c miqr and \c shape whenever a closer hit is found.
+	*
+	* \param nodes
+	*    Node array of the tree: \ref m_nodeData or a lazily built subtree
+	*/
+	bool intersectSubtree(const BVHNode *nodes, IndexType node_idx, Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const;
+
+	/// Return whether any of the primitives <tt>m_indices[start, end)</tt> blocks the ray
+	bool occludedPrimitives(IndexType start, IndexType end, const Ray3f &ray) const;
+
+	/// Return whether any of the primitives of a (non-lazy) leaf blocks the ray
+	bool occludedLeaf(const BVHNode &node, const Ray3f &ray) const;
+
+	/// Loop of \ref occludedPrimitives() specialized for one primitive type
+	template <EPrimitiveType Type> bool occludedRange(IndexType start, IndexType end, const Ray3f &ray) const;
+
+	/// Any-hit traversal of the subtree below \c node_idx in the node array \c nodes
+	bool occludedSubtree(const BVHNode *nodes, IndexType node_idx, const Ray3f &ray) const;
+
+	/// Round-robin traversal of at most \ref MAX_INTERLEAVE rays (see \ref rayIntersectBatch())
+	void intersectInterleaved(int count, const Ray3f *rays, Intersection *its, bool *hit) const;
+
+	/// Prefetch the primitive data of the leaf \c node
+	void prefetchPrimitives(const BVHNode &node) const;
+
+	/// Apply the adaptive ray epsilon used by all BVH traversals
+	static void adaptEpsilon(Ray3f &ray) {
+		if (ray.mint == Epsilon)
+			ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+	}
+
+	/// Fill \ref m_triangles from the final leaf order of \ref m_indices
+	void precomputeTriangles();
+
+	/**
+	* \brief Triangle copied out of its mesh in BVH leaf order
+	*
+	* Stores the first vertex and the two edges used by the Moeller-Trumbore
+	* test, so that the leaf loop streams through memory without looking up
+	* the shape, the face indices and the vertex positions. Primitives that
+	* are not triangles only keep their shape pointer and a marker of their
+	* type in \c idx.
+	*/
+	struct PrecomputedTriangle {
+		/// Marks primitives that are neither mesh triangles nor spheres
+		static const IndexType GENERIC_SHAPE = (IndexType) -1;
+
+		/// Marks spheres
+		static const IndexType SPHERE_SHAPE = (IndexType) -2;
+
+		float p0[3], edge1[3], edge2[3];
+		IndexType idx;       ///< Triangle index within its mesh, \ref SPHERE_SHAPE or \ref GENERIC_SHAPE
+		const Shape *shape;  ///< Shape the primitive belongs to
+
+		/// Same test as \ref Mesh::rayIntersect(IndexType, const Ray3f &, float &, float &, float &) const
+		bool rayIntersect(const Ray3f &ray, float &u, float &v, float &t) const {
+			const Vector3f e1(edge1[0], edge1[1], edge1[2]), e2(edge2[0], edge2[1], edge2[2]);
+
+			/* Begin calculating determinant - also used to calculate U parameter */
+			Vector3f pvec = ray.d.cross(e2);
+
+			/* If determinant is near zero, ray lies in plane of triangle */
+			float det = e1.dot(pvec);
+
+			if (det > -1e-8f && det < 1e-8f)
+				return false;
+			float inv_det = 1.0f / det;
+
+			/* Calculate distance from v[0] to ray origin */
+			Vector3f tvec = ray.o - Point3f(p0[0], p0[1], p0[2]);
+
+			/* Calculate U parameter and test bounds */
+			u = tvec.dot(pvec) * inv_det;
+			if (u < 0.0 || u > 1.0)
+				return false;
+
+			/* Prepare to test V parameter */
+			Vector3f qvec = tvec.cross(e1);
+
+			/* Calculate V parameter and test bounds */
+			v = ray.d.dot(qvec) * inv_det;
+			if (v < 0.0 || u + v > 1.0)
+				return false;
+
+			/* Ray intersects triangle -> compute t */
+			t = e2.dot(qvec) * inv_det;
+
+			return t >= ray.mint && t <= ray.maxt;
+		}
+	};
 
-	/* BVH node in 32 bytes */
+	/**
+	* \brief BVH node in 32 bytes (40 bytes with wide indices)
+	*
+	* The two children of an inner node are stored next to each other, so
+	* that a pair of siblings shares a cache line. The pairs are grouped into
+	* page-sized treelets, see \ref NodeAllocator. Index 0 holds the root,
+	* followed by an empty leaf which aligns the pairs.
+	*/
 	struct BVHNode {
+		/// Value of \c leaf.size which marks a lazy leaf, whose \c leaf.start is an index into \ref m_lazySubtrees
+		static const IndexType LAZY = ((IndexType) 1 << (8 * sizeof(IndexType) - 3)) - 1;
+
 		union {
 			struct {
-				unsigned flag : 1;
-				uint32_t size : 31;
-				uint32_t start;
+				IndexType flag : 1;
+				IndexType type : 2;  ///< \ref EPrimitiveType of all primitives in the leaf
+				IndexType size : 8 * sizeof(IndexType) - 3;
+				IndexType start;
 			} leaf;
 
 			struct {
-				unsigned flag : 1;
-				uint32_t axis : 31;
-				uint32_t rightChild;
+				IndexType flag : 1;
+				IndexType axis : 8 * sizeof(IndexType) - 1;
+				IndexType child;  ///< Index of the left child, the right child follows it
 			} inner;
-
-			uint64_t data;
 		};
 		BoundingBox3f bbox;
 
@@ -148,22 +534,73 @@ protected:
 			return leaf.flag == 0;
 		}
 
-		bool isUnused() const {
-			return data == 0;
+		bool isLazy() const {
+			return leaf.flag == 1 && leaf.size == LAZY;
 		}
 
-		uint32_t start() const {
+		IndexType start() const {
 			return leaf.start;
 		}
 
-		uint32_t end() const {
+		IndexType end() const {
 			return leaf.start + leaf.size;
 		}
 	};
-private:
-	std::vector<uint32_t> m_shapeOffset; ///< Index of the first triangle for each shape or the shape itself if not a mesh
-	std::vector<BVHNode> m_nodes;        ///< BVH nodes
-	std::vector<uint32_t> m_indices;     ///< Index references by BVH nodes
+
+	/// Node array, aligned such that the sibling pairs start at cache line boundaries
+	typedef std::vector<BVHNode, tbb::cache_aligned_allocator<BVHNode>> NodeVector;
+
+	/**
+	* \brief Subtree of the lazy mode, which is built the first time a ray enters it
+	*
+	* The top-level build already partitioned the primitives, so the subtree
+	* only reorders its own range of \ref m_indices.
+	*/
+	struct LazySubtree {
+		IndexType start = 0, end = 0;  ///< Range of \ref m_indices covered by the subtree
+		BoundingBox3f bbox;            ///< Bounds of the primitives
+		BoundingBox3f centroidBounds;  ///< Bounds of the primitive centroids
+		NodeVector nodes;              ///< Nodes of the subtree, once built
+		std::atomic<const BVHNode *> built { nullptr }; ///< Points to \c nodes once they are complete
+		std::mutex mutex;              ///< Serializes the build
+	};
+
+	/// Return the nodes of a lazy subtree, building it first if no ray entered it before
+	const BVHNode *getLazySubtree(IndexType idx) const {
+		const BVHNode *nodes = m_lazySubtrees[idx].built.load(std::memory_order_acquire);
+		return nodes ? nodes : buildLazySubtree(m_lazySubtrees[idx]);
+	}
+
+	/// Build a lazy subtree (thread-safe) and return its nodes
+	const BVHNode *buildLazySubtree(LazySubtree &subtree) const;
+protected:
+	std::vector<IndexType> m_shapeOffset; ///< Index of the first triangle for each shape or the shape itself if not a mesh
+	std::vector<EPrimitiveType> m_shapeTypes; ///< Primitive type of each shape
+	EPrimitiveType m_sceneType = EPrimitiveType::EMixed; ///< Type shared by all shapes, or \c EMixed
+	NodeVector m_nodes;                  ///< BVH nodes (while building)
+	std::vector<IndexType> m_indices;    ///< Index references by BVH nodes (while building)
+	const BVHNode *m_nodeData = nullptr; ///< Nodes used by the traversal: \ref m_nodes or a mapped cache file
+	IndexType m_nodeCount = 0;           ///< Number of entries in \ref m_nodeData
+	const IndexType *m_indexData = nullptr; ///< Indices used by the traversal: \ref m_indices or a mapped cache file
+	IndexType m_indexCount = 0;          ///< Number of entries in \ref m_indexData
+	std::unique_ptr<MemoryMappedFile> m_cacheFile; ///< Mapped cache file, if the tree was loaded from disk
+	std::vector<PrecomputedTriangle> m_triangles; ///< Triangles in leaf order (only if m_precomputeTriangles)
+	bool m_precomputeTriangles = false;  ///< Build \ref m_triangles after the tree?
+	EBuilder m_builder = EBuilder::ESAH; ///< Tree construction algorithm
+	int m_binCount = 16;                 ///< Number of bins per axis of the SAH builder
+	float m_spatialSplitBudget = 0.3f;   ///< Maximum fraction of duplicated references
+	float m_spatialSplitAlpha = 1e-5f;   ///< Overlap threshold for trying spatial splits
+	std::string m_cacheDir;              ///< Directory for cached trees (empty: caching disabled)
+	float m_refitThreshold = 1.5f;       ///< Relative SAH cost increase which triggers a rebuild
+	float m_builtCost = 0.f;             ///< SAH cost of the tree right after it was built
+	bool m_lazy = false;                 ///< Build subtrees on demand?
+	int m_lazySize = 4096;               ///< Deferred subtree size in the lazy mode
+	int m_interleave = 1;                ///< Number of rays traversed in round-robin by \ref rayIntersectBatch()
+	std::unique_ptr<LazySubtree[]> m_lazySubtrees; ///< Subtrees of the lazy mode
+	IndexType m_lazyCount = 0;           ///< Number of entries in \ref m_lazySubtrees
+	mutable std::atomic<IndexType> m_lazyBuilt { 0 };    ///< Number of lazy subtrees built so far
+	mutable std::atomic<IndexType> m_lazyBuiltPrims { 0 }; ///< Number of primitives in those subtrees
+	mutable std::atomic<size_t> m_lazyBuiltMemory { 0 };   ///< Size of their nodes in bytes
 };
 
 NORI_NAMESPACE_END
\ No newline at end of file
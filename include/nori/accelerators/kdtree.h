@@ -0,0 +1,124 @@
+#pragma once
+
+#include <nori/accelerators/bvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+* \brief SAH kd-tree for fast ray intersection queries
+*
+* Space is recursively split by axis-aligned planes, which are chosen with
+* the Surface Area Heuristic over binned candidate positions. Unlike the
+* BVH, the children of a node never overlap, so traversal visits the leaves
+* along a ray strictly front to back and stops at the first leaf that
+* contains a hit. The price is that primitives straddling a split plane are
+* referenced from both sides. Splits which cut off empty space are favored,
+* which works well for architectural scenes with large axis-aligned
+* polygons.
+*
+* The subtrees are built in parallel using <tt>tbb::parallel_invoke</tt>.
+* Reference bounds are clipped to the node bounds when they are split.
+*
+* The tree depth is limited by \ref MAX_DEPTH, so the traversal stack has
+* a fixed size and never overflows.
+*
+* The primitive handling (shapes, leaf index arrays, precomputed triangles)
+* is shared with \ref BVH. The \c bvhBuilder, \c bvhCache and \c bvhLazy
+* properties do not apply to kd-trees, and since the split planes can not
+* be moved, \ref refit() always rebuilds the tree.
+*/
+class KDTree : public BVH {
+	friend class KDTreeBuilder;
+public:
+	/// Maximum depth of the tree, which is also the size of the traversal stack
+	static const int MAX_DEPTH = 64;
+
+	/**
+	* \brief Create a new and empty kd-tree configured by the scene properties
+	*
+	* In addition to \c precomputeTriangles (see \ref BVH), this recognizes
+	*  - \c kdIntersectionCost: cost of intersecting a primitive, relative to
+	*    traversing an inner node, used by the SAH (default: 4)
+	*  - \c kdEmptyBonus: relative SAH cost reduction of splits which cut
+	*    off empty space (default: 0.2)
+	*/
+	KDTree(const PropertyList &propList)
+		: BVH(propList)
+		, m_intersectionCost(propList.getFloat("kdIntersectionCost", 4.f))
+		, m_emptyBonus(propList.getFloat("kdEmptyBonus", 0.2f)) {
+		if (m_intersectionCost <= 0.f)
+			throw NoriException("KDTree: kdIntersectionCost must be positive (got %f)", m_intersectionCost);
+		if (m_emptyBonus < 0.f || m_emptyBonus >= 1.f)
+			throw NoriException("KDTree: kdEmptyBonus must be in [0, 1) (got %f)", m_emptyBonus);
+	}
+
+	/// Build the kd-tree
+	virtual void build() override;
+
+	/// The split planes can not be refitted, so this rebuilds the tree
+	virtual void refit() override;
+
+	/// Closest-hit traversal of the kd-tree
+	virtual bool rayIntersectPrimitive(const Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const override;
+
+	/// Any-hit traversal for shadow rays
+	virtual bool rayOccluded(const Ray3f &ray) const override;
+
+	/// Packets are traced as single rays
+	virtual void rayIntersectPacket(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const override {
+		Accel::rayIntersectPacket(count, rays, its, hit);
+	}
+
+	/// Batches are traced as single rays
+	virtual void rayIntersectBatch(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const override {
+		Accel::rayIntersectBatch(count, rays, its, hit);
+	}
+
+protected:
+	/**
+	* \brief kd-tree node in 8 bytes (16 bytes with wide indices)
+	*
+	* Like in the BVH, the two children of an inner node are stored next to
+	* each other, and the nodes are laid out in depth-first order.
+	*/
+	struct KDNode {
+		/// Value of \ref axis which marks a leaf
+		static const IndexType LEAF = 3;
+
+		union {
+			float split;      ///< Inner node: position of the split plane
+			IndexType start;  ///< Leaf: first index into m_indexData
+		};
+		IndexType axis : 2;   ///< Split axis of an inner node, or \ref LEAF
+		IndexType data : 8 * sizeof(IndexType) - 2; ///< Inner node: index of the lower child. Leaf: number of primitives
+
+		bool isLeaf() const {
+			return axis == LEAF;
+		}
+	};
+
+	/// Traversal stack entry: a node still to be visited and its ray segment
+	struct StackEntry {
+		IndexType node;
+		float mint, maxt;
+	};
+
+	/// Return the SAH cost of the tree
+	virtual float getSAHCost() const override;
+
+	/// Recursive helper of \ref getSAHCost(), returns the cost of the subtree below node \c idx
+	float getSAHCost(IndexType idx, const BoundingBox3f &bbox) const;
+
+	/// Return the ray segment within the scene bounds, or \c false if the ray misses them
+	bool clipRay(const Ray3f &ray, float &mint, float &maxt) const;
+
+protected:
+	std::vector<KDNode> m_kdNodes;  ///< kd-tree nodes, the root is at index 0
+	float m_intersectionCost;       ///< SAH cost of a primitive intersection
+	float m_emptyBonus;             ///< SAH cost reduction for cutting off empty space
+};
+
+NORI_NAMESPACE_END
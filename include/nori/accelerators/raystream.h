@@ -0,0 +1,84 @@
+#pragma once
+
+#include <nori/core/bbox.h>
+#include <vector>
+
+NORI_NAMESPACE_BEGIN
+
+struct Intersection;
+
+/**
+* \brief Batch of rays which are traced together
+*
+* Secondary rays (diffuse bounces, shadow rays) are generated in an order
+* which has little to do with the parts of the scene they visit, so tracing
+* them one after the other keeps evicting the nodes and triangles that the
+* previous ray fetched. A ray stream first collects the rays, sorts them by
+* the cell of the scene that their origin lies in (along a Morton curve) and
+* by the octant of their direction, and then traces them in that order, so
+* that consecutive rays mostly traverse the same parts of the acceleration
+* data structure. The results are still returned in insertion order.
+*
+* The gained coherence is accumulated over all streams, see
+* \ref getStatistics().
+*/
+class RayStream {
+public:
+	/// Remove all rays from the stream (keeps the allocated memory)
+	void clear();
+
+	/// Append a ray to the stream and return its index
+	uint32_t add(const Ray3f &ray);
+
+	/// Return the number of rays in the stream
+	uint32_t size() const { return (uint32_t) m_rays.size(); }
+
+	/// Return a ray by its insertion index
+	const Ray3f &operator[](uint32_t index) const { return m_rays[index]; }
+
+	/**
+	* \brief Reorder the traversal by origin cell and direction octant
+	*
+	* \param bbox
+	*    Bounding box of the scene, subdivided into the origin cells
+	*/
+	void sort(const BoundingBox3f &bbox);
+
+	/**
+	* \brief Find the closest intersection of every ray
+	*
+	* The rays are traced in batches through \ref Scene::rayIntersectBatch()
+	*
+	* \param its
+	*    Array of \ref size() intersection records, indexed like the rays
+	*
+	* \param hit
+	*    Array of \ref size() flags, set for the rays that hit something
+	*/
+	void intersect(const Scene *scene, Intersection *its, bool *hit) const;
+
+	/// Test every ray for occlusion, writing one flag per ray (in insertion order)
+	void occluded(const Scene *scene, bool *occluded) const;
+
+	/// Reset the accumulated coherence statistics
+	static void resetStatistics();
+
+	/// Return a summary of the coherence gained by sorting all streams so far
+	static std::string getStatistics();
+
+private:
+	/// Number of rays passed to \ref Scene::rayIntersectBatch() at once (after sorting)
+	static const uint32_t BATCH_SIZE = 64;
+
+	/// Key of a ray: Morton code of its origin cell followed by its direction octant
+	static uint64_t sortKey(const Ray3f &ray, const BoundingBox3f &bbox);
+
+	/// Count consecutive rays with the same coarse origin cell and octant
+	static uint64_t countCoherentPairs(const uint64_t *keys, uint32_t count);
+
+	std::vector<Ray3f> m_rays;
+	std::vector<uint32_t> m_order;    ///< Traversal order (empty while unsorted)
+	std::vector<uint64_t> m_keys;
+};
+
+NORI_NAMESPACE_END
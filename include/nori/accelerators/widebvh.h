@@ -0,0 +1,221 @@
+#pragma once
+
+#include <nori/accelerators/bvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+* \brief Wide (N-ary) Bounding Volume Hierarchy
+*
+* The tree is first built as a binary SAH BVH by \ref BVH::build(), and is
+* then collapsed into nodes with up to \c Width children by repeatedly
+* opening the child with the largest surface area. Child bounds are stored
+* in SoA layout so that all of them can be tested against a ray at once
+* using SSE (4-wide) or AVX (8-wide) slab tests. Compared to the binary
+* tree, this roughly halves the number of node visits during traversal.
+*
+* Unused child slots hold an inverted (empty) bounding box, which never
+* passes the slab test.
+*
+* Optionally, the child bounds are compressed to 8 or 16 bit integers on a
+* grid spanning the bounds of the node (\c bvhQuantization property). The
+* grid spacing is a power of two along each axis, and the quantized bounds
+* are rounded outwards, so the decoded boxes always contain the exact ones.
+* With 8 bits, this halves the size of the wide nodes (e.g. 128 instead of
+* 256 bytes for 8-wide nodes), at the cost of decoding the bounds during
+* traversal and of some additional box hits due to the looser bounds.
+*/
+template <int Width> class WideBVH : public BVH {
+public:
+	static_assert(Width % 4 == 0, "WideBVH: width must be a multiple of 4");
+
+	/**
+	* \brief Create a new and empty wide BVH configured by the scene properties
+	*
+	* In addition to the properties of \ref BVH, this recognizes
+	*  - \c bvhQuantization: number of bits per quantized child bound,
+	*    either 8 or 16, or 0 for full precision bounds (default: 0)
+	*/
+	WideBVH(const PropertyList &propList)
+		: BVH(propList)
+		, m_quantization(propList.getInteger("bvhQuantization", 0)) {
+		if (m_quantization != 0 && m_quantization != 8 && m_quantization != 16)
+			throw NoriException("WideBVH: bvhQuantization must be 0, 8 or 16 (got %i)", m_quantization);
+		if (m_lazy)
+			throw NoriException("WideBVH: bvhLazy is not supported, the collapse needs the complete tree");
+	}
+
+	/// Build the binary BVH, and collapse it into wide nodes
+	virtual void build() override;
+
+	/// Closest-hit traversal of the wide nodes
+	virtual bool rayIntersectPrimitive(const Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const override;
+
+	/// Any-hit traversal for shadow rays
+	virtual bool rayOccluded(const Ray3f &ray) const override;
+
+	/// Packets are traced as single rays, as the wide nodes already test all children at once
+	virtual void rayIntersectPacket(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const override {
+		Accel::rayIntersectPacket(count, rays, its, hit);
+	}
+
+	/// Batches are traced as single rays
+	virtual void rayIntersectBatch(int count, const Ray3f *rays,
+		Intersection *its, bool *hit) const override {
+		Accel::rayIntersectBatch(count, rays, its, hit);
+	}
+
+protected:
+	/* Wide BVH node, child bounds stored in SoA layout */
+	struct WideNode {
+		/// Child bounds: rows are min x/y/z followed by max x/y/z
+		float bounds[6][Width];
+
+		/// Inner child: index of the child node. Leaf child: first index into m_indices
+		IndexType child[Width];
+
+		/// Number of primitives of a leaf child, or 0 for inner children and empty slots
+		IndexType count[Width];
+	};
+
+	/* Wide BVH node with quantized child bounds */
+	template <typename T> struct QuantizedNode {
+		/// Largest quantized coordinate
+		static const uint32_t QMAX = (1u << (8 * sizeof(T))) - 1;
+
+		/// Minimum corner of the node bounds, i.e. the origin of the grid
+		float origin[3];
+
+		/// Grid spacing along each axis is 2^exponent
+		int8_t exponent[3];
+
+		/// Bit mask of the non-empty child slots
+		uint8_t validMask;
+
+		/// Child bounds in grid units: rows are min x/y/z followed by max x/y/z
+		T bounds[6][Width];
+
+		/// Inner child: index of the child node. Leaf child: first index into m_indices
+		IndexType child[Width];
+
+		/// Number of primitives of a leaf child, or 0 for inner children and empty slots
+		IndexType count[Width];
+	};
+
+	typedef QuantizedNode<uint8_t> QuantizedNode8;
+	typedef QuantizedNode<uint16_t> QuantizedNode16;
+
+	/// Precomputed per-ray data used by the slab tests
+	struct RayData {
+		float o[3];
+		float dRcp[3];
+		int nearRow[3];
+		int farRow[3];
+
+		RayData(const Ray3f &ray) {
+			for (int axis = 0; axis < 3; ++axis) {
+				o[axis] = ray.o[axis];
+				dRcp[axis] = ray.dRcp[axis];
+				bool positive = !std::signbit(ray.dRcp[axis]);
+				nearRow[axis] = positive ? axis : axis + 3;
+				farRow[axis] = positive ? axis + 3 : axis;
+			}
+		}
+	};
+
+	/// Recursively collapse the binary subtree at \c binIdx into wide nodes
+	IndexType collapse(IndexType binIdx);
+
+	/// Convert the full precision wide nodes into quantized ones
+	template <typename Node> void quantize(std::vector<Node> &nodes);
+
+	/// Recompute the child bounds of all wide nodes bottom-up
+	virtual void refitNodes() override;
+
+	/// Return the SAH cost of the wide tree
+	virtual float getSAHCost() const override;
+
+	/// Return the number of wide nodes and their size in bytes
+	std::pair<size_t, size_t> getNodeMemory() const;
+
+	/**
+	* \name Operations shared by full precision and quantized nodes
+	* \{
+	*/
+
+	/// Implementation of \ref refitNodes()
+	template <typename Node> void refitNodes(std::vector<Node> &nodes);
+
+	/// Recursive helper of \ref getSAHCost(), also returns the bounds of node \c idx
+	template <typename Node> float getSAHCost(const std::vector<Node> &nodes,
+		IndexType idx, BoundingBox3f &bbox) const;
+
+	/// Implementation of \ref rayIntersectPrimitive()
+	template <typename Node> bool intersectTree(const std::vector<Node> &nodes,
+		Ray3f &ray, float &t, MeshIntersectionQueryRecord &miqr, const Shape *&shape) const;
+
+	/// Implementation of \ref rayOccluded()
+	template <typename Node> bool occludedTree(const std::vector<Node> &nodes, const Ray3f &ray) const;
+
+	/// \}
+
+	/// Return the bounds of child slot \c i of a node
+	static BoundingBox3f getChildBounds(const WideNode &node, int i) {
+		return BoundingBox3f(
+			Point3f(node.bounds[0][i], node.bounds[1][i], node.bounds[2][i]),
+			Point3f(node.bounds[3][i], node.bounds[4][i], node.bounds[5][i]));
+	}
+
+	/// Return the (decoded) bounds of child slot \c i of a quantized node
+	template <typename T> static BoundingBox3f getChildBounds(const QuantizedNode<T> &node, int i) {
+		if (!(node.validMask & (1 << i)))
+			return BoundingBox3f();
+		BoundingBox3f bbox;
+		for (int axis = 0; axis < 3; ++axis) {
+			bbox.min[axis] = dequantize(node, axis, node.bounds[axis][i]);
+			bbox.max[axis] = dequantize(node, axis, node.bounds[axis + 3][i]);
+		}
+		return bbox;
+	}
+
+	/// Set the bounds of all child slots of a node (invalid boxes mark empty slots)
+	static void setChildBounds(WideNode &node, const BoundingBox3f *bbox);
+
+	/// Set the bounds of all child slots of a quantized node, choosing its grid
+	template <typename T> static void setChildBounds(QuantizedNode<T> &node, const BoundingBox3f *bbox);
+
+	/// Decode a quantized coordinate along an axis
+	template <typename T> static float dequantize(const QuantizedNode<T> &node, int axis, uint32_t q) {
+		/* q * 2^exponent is exact, so this only rounds once and matches the encoder */
+		return node.origin[axis] + (float) q * std::ldexp(1.f, node.exponent[axis]);
+	}
+
+	/**
+	* \brief Test a ray against all child bounding boxes of a node
+	*
+	* \return A bit mask of the children which were hit. Entry distances
+	* are stored in \c tNear.
+	*/
+	int intersectChildren(const WideNode &node, const RayData &rd,
+		float mint, float maxt, float *tNear) const;
+
+	/// Decode the child bounds of a quantized node, and test them like the above
+	template <typename T> int intersectChildren(const QuantizedNode<T> &node, const RayData &rd,
+		float mint, float maxt, float *tNear) const;
+
+	/// Slab test of a ray against child bounds in SoA layout
+	static int intersectBounds(const float bounds[6][Width], const RayData &rd,
+		float mint, float maxt, float *tNear);
+
+	int m_quantization;                           ///< Bits per quantized child bound (0: full precision)
+	std::vector<WideNode> m_wideNodes;            ///< Wide BVH nodes (full precision)
+	std::vector<QuantizedNode8> m_quantizedNodes8;   ///< Wide BVH nodes (8 bit bounds)
+	std::vector<QuantizedNode16> m_quantizedNodes16; ///< Wide BVH nodes (16 bit bounds)
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+NORI_NAMESPACE_END
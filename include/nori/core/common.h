@@ -111,6 +111,7 @@ class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
 class Integrator;
 class KDTree;
 class Emitter;
@@ -130,6 +131,26 @@ using std::endl;
 
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
+
+/**
+* \brief Index of a primitive, a vertex or an acceleration data structure node
+*
+* 32 bits by default. Scenes with more than 2^31 triangles need the wide
+* index mode (CMake option \c NORI_WIDE_INDICES), which makes this 64 bits
+* wide at the cost of larger meshes and tree nodes.
+*/
+#if defined(NORI_WIDE_INDICES)
+typedef uint64_t IndexType;
+#else
+typedef uint32_t IndexType;
+#endif
+
+/// Matrix of \ref IndexType entries, e.g. the faces of a mesh
+typedef Eigen::Matrix<IndexType, Eigen::Dynamic, Eigen::Dynamic> IndexMatrix;
+
+/// Read-only views of matrices stored elsewhere, e.g. in a memory mapped file
+typedef Eigen::Map<const MatrixXf> ConstMatrixXfMap;
+typedef Eigen::Map<const IndexMatrix> ConstIndexMatrixMap;
 typedef Eigen::Matrix<float, 4, 4> Matrix4f; 
 
 /// Simple exception class, which stores a human-readable error description
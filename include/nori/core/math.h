@@ -75,6 +75,21 @@ inline int mod(int a, int b) {
 	return (r < 0) ? r + b : r;
 }
 
+/// Spread the lower 10 bits of \c v so that two zero bits separate each of them
+inline uint32_t expandBits(uint32_t v) {
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+/// Interleave the lower 10 bits of three integers into a 30 bit Morton code
+inline uint32_t mortonCode3D(uint32_t x, uint32_t y, uint32_t z) {
+	return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
 /// Compute a direction for the given coordinates in spherical coordinates
 extern Vector3f sphericalDirection(float theta, float phi);
 
@@ -104,7 +119,39 @@ extern float fresnel(float cosThetaI, float extIOR, float intIOR);
 * \param[out] t1
 *     The second zero found
 */
-extern bool quadratic(double a, double b, double c, double& t0, double& t1);
+inline bool quadratic(double a, double b, double c, double& t0, double& t1) {
+	// Linear case
+	if (a == 0) {
+		if (b != 0) {
+			t0 = t1 = -c / b;
+			return true;
+		}
+	}
+
+	// Find quadratic discriminant
+	double discrim = b*b - 4.0f * a*c;
+
+	if (discrim < 0.0)
+		return false;
+
+	double rootDiscrim = std::sqrt(discrim);
+
+	// Compute quadratic t values
+	double q;
+	if (b < 0.0)
+		q = -0.5 * (b - rootDiscrim);
+
+	else
+		q = -0.5 * (b + rootDiscrim);
+
+	t0 = q / a;
+	t1 = c / q;
+
+	if (t0 > t1)
+		std::swap(t0, t1);
+
+	return true;
+}
 
 /**
 * \brief Returns the squared distance of the segment pq
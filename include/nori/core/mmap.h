@@ -0,0 +1,44 @@
+#pragma once
+
+#include <nori/core/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+* \brief Read-only memory mapping of a whole file
+*
+* The file contents are paged in by the operating system on demand, so
+* large binary caches can be used in place without reading or copying them.
+* The mapping stays valid for the lifetime of this object.
+*/
+class MemoryMappedFile {
+public:
+	/// Map the given file, throws a \ref NoriException on failure
+	MemoryMappedFile(const std::string &filename);
+
+	/// Unmap the file
+	~MemoryMappedFile();
+
+	/// Return a pointer to the start of the mapped file
+	const uint8_t *data() const { return m_data; }
+
+	/// Return the size of the mapped file in bytes
+	size_t size() const { return m_size; }
+
+	/// Return the name of the mapped file
+	const std::string &getFilename() const { return m_filename; }
+
+private:
+	MemoryMappedFile(const MemoryMappedFile &) = delete;
+	MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+	std::string m_filename;
+	const uint8_t *m_data = nullptr;
+	size_t m_size = 0;
+#if defined(PLATFORM_WINDOWS)
+	void *m_file = nullptr;
+	void *m_mapping = nullptr;
+#endif
+};
+
+NORI_NAMESPACE_END
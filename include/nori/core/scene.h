@@ -48,6 +48,24 @@ public:
     /// Return a pointer to the scene's kd-tree
     const Accel *getAccel() const { return m_accel; }
 
+    /**
+     * \brief Update the scene after shapes were moved or deformed
+     *
+     * Recomputes the bounding boxes of all shapes and refits the
+     * acceleration data structure, which is much cheaper than a
+     * full rebuild when only a few objects changed.
+     */
+    void updateGeometry();
+
+    /// Return the number of camera rays traced together (1 disables packet tracing)
+    int getPacketSize() const { return m_packetSize; }
+
+    /**
+     * \brief Return whether the rays of a block are traced as sorted ray
+     * streams (see \ref Integrator::LiStream()) instead of pixel by pixel
+     */
+    bool useRayStreams() const { return m_rayStreams; }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -88,6 +106,35 @@ public:
      */
 	bool rayIntersect(const Ray3f &ray, Intersection &its) const;
 
+    /**
+     * \brief Intersect a packet of coherent rays (e.g. camera rays of
+     * neighbouring pixels) against the scene
+     *
+     * Equivalent to calling \ref rayIntersect() for each ray, but the
+     * acceleration data structure can share the traversal work
+     *
+     * \param count
+     *    Number of rays, at most \ref Accel::MAX_PACKET_SIZE
+     *
+     * \param its
+     *    Array of \c count intersection records to be filled
+     *
+     * \param hit
+     *    Array of \c count flags, set to \c true for the rays that
+     *    found an intersection
+     */
+	void rayIntersectPacket(int count, const Ray3f *rays, Intersection *its, bool *hit) const;
+
+    /**
+     * \brief Intersect a batch of independent rays (e.g. secondary rays)
+     * against the scene
+     *
+     * Equivalent to calling \ref rayIntersect() for each ray, but the
+     * acceleration data structure can hide memory latency by traversing
+     * several rays at once, see \ref Accel::rayIntersectBatch()
+     */
+	void rayIntersectBatch(int count, const Ray3f *rays, Intersection *its, bool *hit) const;
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and \a only determine whether or not there is an intersection.
@@ -131,6 +178,8 @@ private:
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    int m_packetSize;
+    bool m_rayStreams;
 };
 
 NORI_NAMESPACE_END
@@ -23,6 +23,9 @@ public:
 	*/
 	virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override;
 
+	/// Shade the given first intersection (\c nullptr if the ray escaped)
+	virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const override;
+
 	/// Return a brief string summary of the instance (for debugging purpose)
 	std::string toString() const override;
 
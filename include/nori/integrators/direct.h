@@ -23,12 +23,39 @@ public:
 	*/
 	virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override;
 
+	/// Shade the given first intersection (\c nullptr if the ray escaped)
+	virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const override;
+
+	/// Shade a batch of camera rays, tracing all of their shadow rays as one sorted \ref RayStream
+	virtual void LiStream(const Scene *scene, Sampler *sampler, uint32_t count, const Ray3f *rays, Color3f *Li) const override;
+
 	/// Return a brief string summary of the instance (for debugging purpose)
 	std::string toString() const override;
 
 	DirectIntegrator(const PropertyList &props);
 	DirectIntegrator(EMeasure measure, Warp::EWarpType warpType, const MIS* mis, bool isFirst);
 
+protected:
+	/// Shadow ray towards a sampled emitter, with the contribution it adds if unoccluded
+	struct ShadowQuery {
+		Ray3f ray;
+		const Emitter *emitter;
+		Color3f value;
+	};
+
+	/**
+	* \brief Sample the emitters at a shading point and append one shadow
+	* query per sample and emitter
+	*
+	* \return \c false if a sample had a zero pdf, in which case the
+	*    estimate of the whole shading point is zero
+	*/
+	bool sampleEmitters(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+		const Intersection &its, std::vector<ShadowQuery> &queries) const;
+
+	/// Check whether a shadow ray reaches its emitter
+	bool isVisible(const Scene *scene, const ShadowQuery &query) const;
+
 protected:
 	// Direct Integrator members
 	uint32_t m_nSamples;
@@ -22,6 +22,8 @@
 
 NORI_NAMESPACE_BEGIN
 
+struct Intersection;
+
 /**
  * \brief Abstract integrator (i.e. a rendering technique)
  *
@@ -53,6 +55,33 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose
+     * first intersection was already found (e.g. by packet tracing)
+     *
+     * \param its
+     *    The first intersection along \c ray, or \c nullptr if the
+     *    ray escaped the scene
+     *
+     * The default implementation ignores \c its and traces the ray again
+     */
+    virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+        const Intersection *its) const { return Li(scene, sampler, ray); }
+
+    /**
+     * \brief Sample the incident radiance along a batch of camera rays
+     *
+     * Used when the scene enables ray streams (\c rayStreams property).
+     * Integrators tracing many incoherent secondary rays can override this
+     * to trace them in sorted \ref RayStream batches over all paths of the
+     * batch. The default implementation calls \ref Li() for every ray.
+     *
+     * \param Li
+     *    Array of \c count radiance estimates to be filled
+     */
+    virtual void LiStream(const Scene *scene, Sampler *sampler, uint32_t count,
+        const Ray3f *rays, Color3f *Li) const;
+
 	/// randomly choose one light that can be used then to sample
 	static const nori::Emitter* chooseOneLight(const Scene &scene, Sampler *sampler);
 
@@ -21,6 +21,9 @@ public:
 	*/
 	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const;
 
+	/// Shade the given first intersection (\c nullptr if the ray escaped)
+	Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const;
+
 	/// Return a brief string summary of the instance (for debugging purpose)
 	std::string toString() const;
 
@@ -24,12 +24,30 @@ public:
 	*/
 	virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override;
 
+	/// Continue the path from the given first intersection (\c nullptr if the ray escaped)
+	virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const override;
+
+	/**
+	* \brief Trace a batch of paths bounce by bounce
+	*
+	* The rays of each bounce of all paths are collected into one
+	* \ref RayStream and sorted before they are traced. Only implicit
+	* path tracing is streamed, explicit path tracing calls \ref Li()
+	*/
+	virtual void LiStream(const Scene *scene, Sampler *sampler, uint32_t count, const Ray3f *rays, Color3f *Li) const override;
+
 	// Implicit Path tracing
 	virtual Color3f implicitLi(const Scene* scene, Sampler* sampler, const Ray3f &ray) const;
 
+	// Implicit Path tracing from a known first intersection
+	virtual Color3f implicitLiPrimary(const Scene* scene, Sampler* sampler, const Ray3f &ray, const Intersection *its) const;
+
 	// Explicit Path Tracing
 	virtual Color3f explicitLi(const Scene* scene, Sampler* sampler, const Ray3f &ray) const;
 
+	// Explicit Path Tracing from a known first intersection
+	virtual Color3f explicitLiPrimary(const Scene* scene, Sampler* sampler, const Ray3f &ray, const Intersection *its) const;
+
 	// Simplified Direct Integrator (For Explicit)
 	virtual Color3f simplifiedDirect(const Scene* scene, Sampler* sampler, const Ray3f &ray, const Intersection& its) const;
 
@@ -54,6 +72,7 @@ protected:
 	Warp::EWarpType m_directWarpType;	//> warp type used for Direct Illumination (explicit)
 	Warp::EWarpType m_indirectWarpType;	//> warp type used for indirect illumination
 	uint32_t m_nSamples;		//> number of samples 
+	bool m_isExplicit;			//> explicit (next event estimation) or implicit path tracing
 	std::function<Color3f(const PathIntegrator* const, const Scene*, Sampler*, const Ray3f&)> m_Li; //> explicit or implicit Lis
 };
 
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <nori/shapes/mesh.h>
+#include <nori/core/mmap.h>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+* \brief Triangle mesh loaded from a file, which is cached in a binary format
+*
+* Parsing text formats like OBJ takes far longer than rendering many
+* scenes. After a loader has parsed a file, it writes the mesh next to it
+* (with a hash of the \c toWorld transform and the \c reorder property and
+* the extension <tt>.nmesh</tt> appended, so that every placement of a
+* file has its own cache), and later runs map that file instead. The cache
+* stores the raw vertex and face arrays in the layout of the mesh
+* matrices, so that the mesh can use the mapped memory in place: loading
+* takes constant time, and pages are only read from disk when they are
+* touched.
+*
+* A cache is only used if it matches the size and modification time of
+* the source file, the \c toWorld transform (which is applied before
+* caching), the \c reorder property of \ref Mesh and the index width of
+* the build.
+*
+* Optionally, the arrays are compressed with zlib. Compressed caches are
+* smaller on disk, but have to be inflated into memory when loading.
+*
+* Subclasses call \ref loadCache() and, if that fails, parse the file,
+* call \ref reorder() if \c m_reorder is set and then \ref writeCache().
+* They recognize the properties
+*  - \c cache: read and write cache files (default: true)
+*  - \c compressCache: compress newly written cache files (default: false)
+*/
+class CachedMesh : public Mesh {
+protected:
+	CachedMesh(const PropertyList &propList)
+		: Mesh(propList)
+		, m_cache(propList.getBoolean("cache", true))
+		, m_compressCache(propList.getBoolean("compressCache", false)) { }
+
+	/**
+	* \brief Load the cache of the given source file
+	*
+	* \return \c false if caching is disabled, or if there is no valid
+	*    cache file, in which case the source has to be parsed
+	*/
+	bool loadCache(const std::string &source, const Transform &trafo);
+
+	/// Write the current mesh data to the cache of the given source file
+	void writeCache(const std::string &source, const Transform &trafo) const;
+
+private:
+	/// Name of the cache file of the given source file, transform and layout
+	std::string getCacheFilename(const std::string &source, const Transform &trafo) const;
+
+	/// Size and modification time (in nanoseconds) of the source file, which
+	/// identify its version
+	static bool getSourceInfo(const std::string &source, uint64_t &size, int64_t &time);
+
+private:
+	bool m_cache;                               ///< Whether caching is enabled
+	bool m_compressCache;                       ///< Whether to compress new cache files
+	std::unique_ptr<MemoryMappedFile> m_cacheFile; ///< Mapped cache, if the mesh data points into it
+};
+
+NORI_NAMESPACE_END
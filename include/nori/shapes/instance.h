@@ -0,0 +1,88 @@
+#pragma once
+
+#include <nori/shapes/mesh.h>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+class BVH;
+
+/**
+* \brief Transformed reference to a shared triangle mesh
+*
+* The mesh is loaded once per file in its own object space, together with a
+* bottom-level BVH over its triangles. Every instance of the same file then
+* only stores its \c toWorld transform and a reference to this shared
+* geometry, and appears as a single primitive in the scene's (top-level)
+* acceleration structure. Rays are transformed into object space to traverse
+* the bottom-level BVH.
+*
+* Recognized properties:
+*  - \c filename: Wavefront OBJ file which is instanced
+*  - \c toWorld: object-to-world transform of this instance
+*  - \c cache, \c compressCache, \c compactAttributes, \c reorder: passed
+*    on to the shared mesh (see \ref CachedMesh and \ref Mesh). Instances
+*    of one file with different values load separate copies of it
+*  - \c bvhBuilder, \c spatialSplits, \c bvhBinCount, \c spatialSplitBudget,
+*    \c spatialSplitAlpha, \c precomputeTriangles, \c bvhCache, \c bvhLazy,
+*    \c bvhLazySize: configure the shared bottom-level BVH like the scene's
+*    (see \ref BVH). They are not inherited from the scene, so give the
+*    scene's values to build instanced geometry the same way. Instances with
+*    different values build separate BVHs
+*/
+class Instance : public Shape {
+public:
+	/// Create an instance of the mesh referenced by the \c filename property
+	Instance(const PropertyList &propList);
+
+	/// Calculate the world-space bounding box of the transformed mesh
+	void calculateBoundingBox() override;
+
+	/// Intersect the ray against the shared mesh in object space
+	bool rayIntersect(const Ray3f &ray_, float &outT, IntersectionQueryRecord* IQR = nullptr) const override;
+
+	void updateIntersection(const Ray3f &ray, Intersection &its, const IntersectionQueryRecord* IQR = nullptr) const override;
+
+	/// Returns a sample point using surface area sampling
+	virtual void sampleArea(SampleQueryRecord &outSQR, const Point2f &sample) const override;
+
+	/// Returns a sample point using subtended solid angle sampling
+	virtual void sampleSolidAngle(SampleQueryRecord &outSQR, const Point2f &sample, const Point3f& x) const override;
+
+	/// Returns a pdf of a 3D point on the shape using surface area sampling
+	virtual float pdfArea(const Point3f &sample) const override;
+
+	/// Returns a pdf of a 3D point on the shape using subtended solid angle sampling
+	virtual float pdfSolidAngle(const Point3f &sample, const Point3f& x) const override;
+
+	/// Return Centroid of the Shape
+	virtual Point3f getCentroid() const override { return m_bbox.getCenter(); }
+
+	virtual void initializeBuffers() override { throw NoriException("Instance::initializeBuffers not implemented"); }
+
+	/**
+	* \brief Move the instance
+	*
+	* Call \ref Scene::updateGeometry() afterwards to refit the
+	* acceleration data structure
+	*/
+	void setToWorld(const Transform &toWorld);
+
+	/// Return the shared (object space) mesh
+	const Mesh *getMesh() const { return m_mesh; }
+
+	/// Return a human-readable summary of this instance
+	std::string toString() const override;
+
+protected:
+	/// Load a mesh and build its BVH, or return the existing copy if it was already loaded
+	static std::shared_ptr<BVH> loadPrototype(const std::string &filename, const PropertyList &propList);
+
+protected:
+	std::shared_ptr<BVH> m_prototype;    ///< Bottom-level BVH, shared by all instances of the file
+	const Mesh   *m_mesh;                ///< Instanced mesh (owned by \ref m_prototype)
+	Transform     m_toLocal;             ///< World-to-object transform
+	float         m_orientation;         ///< -1 if the transform flips handedness, 1 otherwise
+};
+
+NORI_NAMESPACE_END
@@ -33,8 +33,8 @@ NORI_NAMESPACE_BEGIN
 *
 */
 struct MeshIntersectionQueryRecord : public IntersectionQueryRecord {
-	uint32_t idx; ///< current triangle index tested for intersection
-	uint32_t f;   ///< closest triangle index for which an intersection was found
+	IndexType idx; ///< current triangle index tested for intersection
+	IndexType f;   ///< closest triangle index for which an intersection was found
 	Point2f uv; 
 };
 
@@ -45,15 +45,32 @@ struct MeshIntersectionQueryRecord : public IntersectionQueryRecord {
 * for querying the individual triangles. Subclasses of \c Mesh implement
 * the specifics of how to create its contents (e.g. by loading from an
 * external file)
+*
+* With the property \c compactAttributes, the mesh compresses its shading
+* attributes when it is activated: normals are stored as 32 bit octahedral
+* encodings and texture coordinates as half precision floats, which are
+* decoded when an intersection is updated. This cuts their memory from 20
+* to 8 bytes per vertex. Half floats keep about three significant digits,
+* so heavily tiled texture coordinates far outside [0, 1] lose precision.
+* Positions are kept at full precision, since every ray-triangle test and
+* the acceleration structures read them directly.
+*
+* With the property \c reorder, the triangles are sorted along a Morton
+* curve through their centroids when the mesh is activated, and the
+* vertices are renumbered in the order in which these triangles use them.
+* Triangles which are close in space then also have nearby indices, and
+* share cache lines of the vertex data, whichever order the file had.
+* Cached meshes are reordered before they are written, so that later runs
+* map the reordered data, see \ref CachedMesh.
 */
 class Mesh : public Shape {
 public:
 
 	/// Return the surface area of the given triangle
-	float surfaceArea(uint32_t index) const;
+	float surfaceArea(IndexType index) const;
 
-	/// Return the bounding box of the full mesh
-	void calculateBoundingBox() override { /* TODO: */ }
+	/// Calculate/Update the bounding box of the full mesh
+	void calculateBoundingBox() override;
 
 	/// Return whether a ray intersects with the mesh or not
 	bool rayIntersect(const Ray3f &ray_, float &outT, IntersectionQueryRecord* IQR = nullptr) const override;
@@ -82,8 +99,11 @@ public:
 	*   in barycentric coordinates
 	* \return
 	*   \c true if an intersection has been detected
+	*
+	* This is defined inline, so that the leaf loops of the BVH can
+	* intersect triangles without going through \ref Shape::rayIntersect().
 	*/
-	bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
+	bool rayIntersect(IndexType index, const Ray3f &ray, float &u, float &v, float &t) const;
 
 	void updateIntersection(const Ray3f &ray, Intersection &its, const IntersectionQueryRecord* IQR = nullptr) const override;
 
@@ -103,28 +123,43 @@ public:
 	const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
 	/// Return an axis-aligned bounding box containing the given triangle
-	BoundingBox3f getBoundingBox(uint32_t index) const;
+	BoundingBox3f getBoundingBox(IndexType index) const;
 
 	/// Return the centroid of the given triangle
-	Point3f getCentroid(uint32_t index) const;
+	Point3f getCentroid(IndexType index) const;
+
+	/// Prepare the mesh for rendering, compacting its attributes if requested
+	virtual void activate() override;
 
 	/// Return a pointer to the vertex positions
-	const MatrixXf &getVertexPositions() const { return m_V; }
+	const ConstMatrixXfMap &getVertexPositions() const { return m_V; }
+
+	/// Return a pointer to the vertex normals (or \c nullptr if there are none or they are compacted)
+	const ConstMatrixXfMap &getVertexNormals() const { return m_N; }
+
+	/// Return a pointer to the texture coordinates (or \c nullptr if there are none or they are compacted)
+	const ConstMatrixXfMap &getVertexTexCoords() const { return m_UV; }
+
+	/// Return whether the mesh has vertex normals (in either representation)
+	bool hasVertexNormals() const { return m_N.size() > 0 || !m_compactN.empty(); }
 
-	/// Return a pointer to the vertex normals (or \c nullptr if there are none)
-	const MatrixXf &getVertexNormals() const { return m_N; }
+	/// Return whether the mesh has texture coordinates (in either representation)
+	bool hasVertexTexCoords() const { return m_UV.size() > 0 || !m_compactUV.empty(); }
 
-	/// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-	const MatrixXf &getVertexTexCoords() const { return m_UV; }
+	/// Return the normal of the given vertex (which must exist)
+	Normal3f getVertexNormal(IndexType index) const;
+
+	/// Return the texture coordinates of the given vertex (which must exist)
+	Point2f getVertexTexCoord(IndexType index) const;
 
 	/// Return a pointer to the triangle vertex index list
-	const MatrixXu &getIndices() const { return m_F; }
+	const ConstIndexMatrixMap &getIndices() const { return m_F; }
 
 	/// Return the total number of triangles in this shape
-	uint32_t getTriangleCount() const { return (uint32_t)m_F.cols(); }
+	IndexType getTriangleCount() const { return (IndexType)m_F.cols(); }
 
 	/// Return the total number of vertices in this shape
-	uint32_t getVertexCount() const { return (uint32_t)m_V.cols(); }
+	IndexType getVertexCount() const { return (IndexType)m_V.cols(); }
 
 	/// Return a human-readable summary of this instance
 	std::string toString() const override;
@@ -132,17 +167,92 @@ public:
 	/// Return whether the shape is a mesh or not
 	virtual bool isMesh() const override { return true; }
 
+	/// Upload the triangles to OpenGL buffers for the viewer
+	virtual void initializeBuffers() override;
+
 protected:
 	/// Create an empty mesh
 	Mesh();
-	Mesh(const PropertyList& propList) : Shape(propList){}
+	Mesh(const PropertyList& propList)
+		: Shape(propList)
+		, m_compactAttributes(propList.getBoolean("compactAttributes", false))
+		, m_reorder(propList.getBoolean("reorder", false)) { }
+
+	/// Make the given matrices the mesh data (normals and texture coordinates may be empty)
+	void setData(MatrixXf &&V, MatrixXf &&N, MatrixXf &&UV, IndexMatrix &&F);
+
+	/**
+	* \brief Use arrays stored elsewhere as the mesh data, without copying them
+	*
+	* The arrays are laid out like the matrices of the other overload, and
+	* must stay valid for the lifetime of the mesh (e.g. a memory mapped
+	* file owned by the subclass). \c N and \c UV may be \c nullptr.
+	*/
+	void setData(const float *V, const float *N, const float *UV, const IndexType *F,
+		IndexType vertexCount, IndexType triangleCount);
+
+	/// Replace the normals and texture coordinates by their compact encodings
+	void compactAttributes();
+
+	/// Sort the triangles and vertices along a space-filling curve
+	void reorder();
 
 protected:
 	std::string m_name;                  ///< Identifying name
-	MatrixXf      m_V;                   ///< Vertex positions
-	MatrixXf      m_N;                   ///< Vertex normals
-	MatrixXf      m_UV;                  ///< Vertex texture coordinates
-	MatrixXu      m_F;                   ///< Faces
+	ConstMatrixXfMap    m_V{nullptr, 3, 0};  ///< Vertex positions
+	ConstMatrixXfMap    m_N{nullptr, 3, 0};  ///< Vertex normals
+	ConstMatrixXfMap    m_UV{nullptr, 2, 0}; ///< Vertex texture coordinates
+	ConstIndexMatrixMap m_F{nullptr, 3, 0};  ///< Faces
+	bool m_reorder = false;              ///< Whether to reorder the mesh (see \ref reorder())
+	bool m_reordered = false;            ///< Whether the mesh data is reordered already
+
+private:
+	/// Storage of the above, unless they point to external memory
+	MatrixXf m_VData, m_NData, m_UVData;
+	IndexMatrix m_FData;
+
+	bool m_compactAttributes = false;  ///< Whether to compact the attributes on activation
+	std::vector<uint32_t> m_compactN;  ///< Octahedral normals (two 16 bit components each)
+	std::vector<uint32_t> m_compactUV; ///< Half precision texture coordinates (u in the low bits)
 };
 
+inline bool Mesh::rayIntersect(IndexType index, const Ray3f &ray, float &u, float &v, float &t) const {
+	IndexType i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+	const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+
+	/* Find vectors for two edges sharing v[0] */
+	Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+
+	/* Begin calculating determinant - also used to calculate U parameter */
+	Vector3f pvec = ray.d.cross(edge2);
+
+	/* If determinant is near zero, ray lies in plane of triangle */
+	float det = edge1.dot(pvec);
+
+	if (det > -1e-8f && det < 1e-8f)
+		return false;
+	float inv_det = 1.0f / det;
+
+	/* Calculate distance from v[0] to ray origin */
+	Vector3f tvec = ray.o - p0;
+
+	/* Calculate U parameter and test bounds */
+	u = tvec.dot(pvec) * inv_det;
+	if (u < 0.0 || u > 1.0)
+		return false;
+
+	/* Prepare to test V parameter */
+	Vector3f qvec = tvec.cross(edge1);
+
+	/* Calculate V parameter and test bounds */
+	v = ray.d.dot(qvec) * inv_det;
+	if (v < 0.0 || u + v > 1.0)
+		return false;
+
+	/* Ray intersects triangle -> compute t */
+	t = edge2.dot(qvec) * inv_det;
+
+	return t >= ray.mint && t <= ray.maxt;
+}
+
 NORI_NAMESPACE_END
\ No newline at end of file
@@ -161,6 +161,9 @@ public:
 /// Return whether the Shape is a mesh or not
 	virtual bool isMesh() const { return false; }
 
+	/// Return whether the Shape is a \ref Sphere, whose intersection test the BVH inlines
+	virtual bool isSphere() const { return false; }
+
 	/// Is this object an area emitter?
 	virtual bool isEmitter() const { return m_emitter != nullptr; }
 
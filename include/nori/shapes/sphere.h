@@ -13,6 +13,42 @@ public:
 	/// Return whether a ray intersects with the sphere or not
 	bool rayIntersect(const Ray3f &ray_, float &outT, IntersectionQueryRecord* IQR = nullptr) const override;
 
+	/**
+	* \brief Non-virtual ray-sphere test used by \ref rayIntersect()
+	*
+	* Defined inline, so that the leaf loops of the BVH can intersect
+	* spheres without a virtual call.
+	*/
+	bool intersect(const Ray3f &ray, float &outT) const {
+		// Calculate quadratic coefficients
+		double a = ray.d.dot(ray.d);
+		double b = 2.f * (ray.d.dot(ray.o - m_center));
+		double c = (ray.o - m_center).dot(ray.o - m_center) - m_radius*m_radius;
+
+		double t0, t1;
+
+		// Check for a quadratic solution. If none, no intersection
+		if (!quadratic(a, b, c, t0, t1))
+			return false;
+
+		// If the intersection is outside the ray's min and max, no intersection
+		if (t0 > ray.maxt || t1 < ray.mint)
+			return false;
+
+		// try to get a solution inside the ray's min and max
+		float tHit = (float)t0;
+		if (t0 < ray.mint)
+		{
+			tHit = (float)t1;
+			if (tHit > ray.maxt)
+				return false;
+		}
+
+		// Intersection found
+		outT = tHit;
+		return true;
+	}
+
 	void updateIntersection(const Ray3f &ray, Intersection &its, const IntersectionQueryRecord* IQR = nullptr) const override;
 
 	/// Returns a sample point using surface area sampling
@@ -27,6 +63,9 @@ public:
 	/// Returns a pdf of a 3D point on the shape using subtended solid angle sampling
 	virtual float pdfSolidAngle(const Point3f &sample, const Point3f& x) const override;
 
+	/// Return whether the Shape is a sphere or not
+	virtual bool isSphere() const override { return true; }
+
 	/// Return Centroid of the Shape
 	virtual Point3f getCentroid() const override { return m_center; }
 
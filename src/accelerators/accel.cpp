@@ -33,6 +33,12 @@ void Accel::build() {
 	/* Nothing to do here for now */
 }
 
+void Accel::refit() {
+	m_bbox.reset();
+	for (auto shape : m_shapes)
+		m_bbox.expandBy(shape->getBoundingBox());
+}
+
 bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
 	bool hit = false;
 
@@ -40,13 +46,13 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
 	float t = std::numeric_limits<float>::infinity(); 
 
 	for (int i = 0; i < m_shapes.size(); ++i) {
-		uint32_t nPrimitives = 1; 
+		IndexType nPrimitives = 1; 
 		if (m_shapes[i]->isMesh())
 			nPrimitives = static_cast<Mesh*>(m_shapes[i])->getTriangleCount(); 
 		
 		MeshIntersectionQueryRecord miqr;
 
-		for (int j = 0; j < nPrimitives; ++j) {
+		for (IndexType j = 0; j < nPrimitives; ++j) {
 			
 			miqr.idx = j;
 
@@ -68,5 +74,20 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
 	return hit;
 }
 
+void Accel::rayIntersectPacket(int count, const Ray3f *rays, Intersection *its, bool *hit) const {
+	for (int i = 0; i < count; ++i)
+		hit[i] = rayIntersect(rays[i], its[i], false);
+}
+
+void Accel::rayIntersectBatch(int count, const Ray3f *rays, Intersection *its, bool *hit) const {
+	for (int i = 0; i < count; ++i)
+		hit[i] = rayIntersect(rays[i], its[i], false);
+}
+
+bool Accel::rayOccluded(const Ray3f &ray) const {
+	Intersection its; // Unused
+	return rayIntersect(ray, its, true);
+}
+
 NORI_NAMESPACE_END
 
@@ -15,9 +15,18 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <nori/core/timer.h>
+#include <nori/shapes/sphere.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <fstream>
+#include <cstdio>
+#include <filesystem/resolver.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NORI_BVH_SSE
+#include <immintrin.h>
+#endif
 
 /*
 * =======================================================================
@@ -30,35 +39,202 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 
 NORI_NAMESPACE_BEGIN
 
-/* Bin data structure for counting triangles and computing their bounding box */
+/* Bin data structure for counting triangles and computing their bounding box along each axis */
 struct Bins {
-	static const int BIN_COUNT = 16;
-	Bins() { memset(counts, 0, sizeof(uint32_t) * BIN_COUNT); }
-	uint32_t counts[BIN_COUNT];
-	BoundingBox3f bbox[BIN_COUNT];
+	Bins(int binCount) : binCount(binCount), counts(3 * binCount, 0u), bbox(3 * binCount) { }
+
+	IndexType &count(int axis, int bin) { return counts[axis * binCount + bin]; }
+	BoundingBox3f &bounds(int axis, int bin) { return bbox[axis * binCount + bin]; }
+
+	/// Accumulate the contents of another set of bins
+	void merge(const Bins &other) {
+		for (size_t i = 0; i < counts.size(); ++i) {
+			counts[i] += other.counts[i];
+			bbox[i].expandBy(other.bbox[i]);
+		}
+	}
+
+	int binCount;
+	std::vector<IndexType> counts;
+	std::vector<BoundingBox3f> bbox;
+};
+
+/* Tracks the memory held by a tree construction, to report its peak usage */
+struct BuildMemory {
+	void allocate(size_t bytes) {
+		size_t value = current += bytes, previous = peak;
+		while (value > previous && !peak.compare_exchange_weak(previous, value))
+			;
+	}
+
+	void release(size_t bytes) {
+		current -= bytes;
+	}
+
+	std::atomic<size_t> current{0};
+	std::atomic<size_t> peak{0};
+};
+
+/**
+* \brief Allocates the nodes of a tree under construction from per-thread chunks
+*
+* The subtrees are built in parallel, and their sizes are not known in
+* advance. Instead of reserving a conservatively sized array, the builders
+* request nodes (the two children of a node together) from a chunk owned
+* by the calling thread, and refer to them by ids which encode the chunk
+* and the position within it. While building, the \c child field of inner
+* nodes holds the id of the left child.
+*
+* Once the tree is complete, \ref layout() writes it into the final node
+* array. With 32-bit indices, sibling pairs are 64 bytes and start at cache
+* line boundaries, so fetching one child also fetches the other. The pairs
+* are grouped into treelets of about a page each: starting from a pair, the
+* treelet keeps adding the children of the node with the largest surface
+* area (i.e. the children most likely to be visited next), and the remaining
+* children start new treelets, which are laid out right after their parent
+* treelet.
+* A ray descending through the tree thus touches far fewer cache lines and
+* pages than with a depth-first order, where right children can be
+* arbitrarily far from their parent.
+*/
+class NodeAllocator {
+public:
+	enum {
+		/// log2 of the number of nodes per chunk
+		CHUNK_BITS = 12,
+
+		/// Number of nodes per chunk (64 KiB)
+		CHUNK_SIZE = 1 << CHUNK_BITS,
+
+		/// Number of sibling pairs per treelet (4 KiB pages)
+		TREELET_PAIRS = 4096 / (2 * sizeof(BVH::BVHNode))
+	};
+
+	NodeAllocator(BuildMemory &memory) : memory(memory) { }
+
+	~NodeAllocator() {
+		memory.release(chunks.size() * CHUNK_SIZE * sizeof(BVH::BVHNode));
+	}
+
+	/// Allocate \c count consecutive (zeroed) nodes and return the id of the first one
+	IndexType allocate(IndexType count) {
+		Cursor &cursor = cursors.local();
+		if (cursor.next + count > cursor.end) {
+			/* Value-initialized, i.e. with zeroed node data and empty bounds */
+			std::unique_ptr<BVH::BVHNode[]> chunk(new BVH::BVHNode[CHUNK_SIZE]());
+			memory.allocate(CHUNK_SIZE * sizeof(BVH::BVHNode));
+			size_t index = chunks.push_back(std::move(chunk)) - chunks.begin();
+			cursor.next = (IndexType) index << CHUNK_BITS;
+			cursor.end = cursor.next + CHUNK_SIZE;
+		}
+		cursor.count += count;
+		IndexType id = cursor.next;
+		cursor.next += count;
+		return id;
+	}
+
+	BVH::BVHNode &operator[](IndexType id) {
+		return chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+	}
+
+	/// Write the tree below \c root into \c nodes in treelet order, and release the chunks
+	void layout(IndexType root, BVH::NodeVector &nodes) {
+		IndexType count = 0;
+		for (const Cursor &cursor : cursors)
+			count += cursor.count;
+
+		/* The root is followed by an empty leaf, so that the pairs start at even indices */
+		BVH::NodeVector().swap(nodes);
+		memory.allocate((count + 1) * sizeof(BVH::BVHNode));
+		nodes.resize(count + 1);
+		nodes[0] = (*this)[root];
+		nodes[1] = BVH::BVHNode();
+		nodes[1].leaf.flag = 1;
+
+		IndexType next = 2;
+		if (nodes[0].isInner())
+			emitTreelet(0, nodes, next);
+		assert(next == count + 1);
+
+		memory.release(chunks.size() * CHUNK_SIZE * sizeof(BVH::BVHNode));
+		chunks.clear();
+		cursors.clear();
+	}
+
+private:
+	/// Allocation state of one thread
+	struct Cursor {
+		IndexType next = 0, end = 0;
+		IndexType count = 0;
+	};
+
+	/**
+	* \brief Lay out a treelet starting with the children of node \c parent
+	*
+	* \c parent is the final index of an inner node whose \c child field
+	* still holds an allocator id.
+	*/
+	void emitTreelet(IndexType parent, BVH::NodeVector &nodes, IndexType &next) {
+		/* Inner nodes of the treelet whose children have not been placed yet */
+		std::vector<IndexType> frontier(1, parent);
+
+		for (int pairs = 0; pairs < TREELET_PAIRS && !frontier.empty(); ++pairs) {
+			auto it = std::max_element(frontier.begin(), frontier.end(), [&](IndexType a, IndexType b) {
+				return nodes[a].bbox.getSurfaceArea() < nodes[b].bbox.getSurfaceArea();
+			});
+			IndexType idx = *it;
+			*it = frontier.back();
+			frontier.pop_back();
+
+			IndexType id = nodes[idx].inner.child;
+			nodes[next] = (*this)[id];
+			nodes[next + 1] = (*this)[id + 1];
+			nodes[idx].inner.child = next;
+
+			for (IndexType child = next; child < next + 2; ++child) {
+				if (nodes[child].isInner())
+					frontier.push_back(child);
+			}
+			next += 2;
+		}
+
+		for (IndexType idx : frontier)
+			emitTreelet(idx, nodes, next);
+	}
+
+	BuildMemory &memory;
+	tbb::concurrent_vector<std::unique_ptr<BVH::BVHNode[]>> chunks;
+	tbb::enumerable_thread_specific<Cursor> cursors;
 };
 
 /**
-* \brief Build task for parallel BVH construction
+* \brief Parallel binned SAH builder
 *
-* This class uses the task scheduling system of Intel' Thread Building Blocks
-* to parallelize the divide and conquer BVH build at all levels.
+* Every node is split using the binned SAH: the centroids of its primitives
+* are sorted into a configurable number of equally sized bins along all three
+* axes, and the plane between two bins with the lowest SAH cost is chosen.
+* The two children of large nodes are built as separate tasks using
+* <tt>tbb::parallel_invoke</tt>, and the top levels of the tree, where there
+* are too few tasks to keep all threads busy, also bin and partition their
+* primitives in parallel.
 *
 * The used methodology is roughly that described in
 * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
 * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
+*
+* With a lazy threshold, subtrees over at most that many triangles are not
+* built but turned into lazy leaves, which refer to the ranges recorded in
+* \ref getLazyRanges(). These ranges are built later by \ref buildRange().
 */
-class BVHBuildTask : public tbb::task {
-private:
-	BVH &bvh;
-	uint32_t node_idx;
-	uint32_t *start, *end, *temp;
-
+class BVHBuilder {
 public:
 	/// Build-related parameters
 	enum {
-		/// Switch to a serial build when less than 32 triangles are left
-		SERIAL_THRESHOLD = 32,
+		/// Build the children of nodes with more triangles than this as separate tasks
+		TASK_THRESHOLD = 1024,
+
+		/// Bin and partition the triangles of nodes larger than this in parallel
+		PARALLEL_THRESHOLD = 64 * 1024,
 
 		/// Process triangles in batches of 1K for the purpose of parallelization
 		GRAIN_SIZE = 1000,
@@ -70,387 +246,1895 @@ public:
 		INTERSECTION_COST = 1
 	};
 
-public:
 	/**
-	* Create a new build task
-	*
-	* \param bvh
-	*    Reference to the underlying BVH
-	*
-	* \param node_idx
-	*    Index of the BVH node that should be built
-	*
-	* \param start
-	*    Start pointer into a list of triangle indices to be processed
+	* Create a new builder
 	*
-	* \param end
-	*    End pointer into a list of triangle indices to be processed
+	* \param nodes
+	*    Allocator providing the nodes of the tree
 	*
-	*  \param temp
-	*    Pointer into a temporary memory region that can be used for
-	*    construction purposes. The usable length is <tt>end-start</tt>
-	*    unsigned integers.
+	* \param binCount
+	*    Number of bins per axis used to evaluate split planes
 	*/
-	BVHBuildTask(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp)
-		: bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
-
-	task *execute() {
-		uint32_t size = (uint32_t)(end - start);
-		BVH::BVHNode &node = bvh.m_nodes[node_idx];
-
-		/* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
-		if (size < SERIAL_THRESHOLD) {
-			execute_serially(bvh, node_idx, start, end, temp);
-			return nullptr;
-		}
-
-		/* Always split along the largest axis */
-		int axis = node.bbox.getLargestAxis();
-		float min = node.bbox.min[axis], max = node.bbox.max[axis],
-			inv_bin_size = Bins::BIN_COUNT / (max - min);
-
-		/* Accumulate all triangles into bins */
-		Bins bins = tbb::parallel_reduce(
-			tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
-			Bins(),
-			/* MAP: Bin a number of triangles and return the resulting 'Bins' data structure */
-			[&](const tbb::blocked_range<uint32_t> &range, Bins result) {
-			for (uint32_t i = range.begin(); i != range.end(); ++i) {
-				uint32_t f = start[i];
-				float centroid = bvh.getCentroid(f)[axis];
+	BVHBuilder(BVH &bvh, NodeAllocator &nodes, int binCount)
+		: bvh(bvh), nodes(nodes), binCount(binCount) { }
+
+	/// Triangle range of a deferred subtree
+	struct LazyRange {
+		IndexType start, end;
+		BoundingBox3f bbox;
+		BoundingBox3f centroidBounds;
+	};
 
-				int index = std::min(std::max(
-					(int)((centroid - min) * inv_bin_size), 0),
-					(Bins::BIN_COUNT - 1));
+	/// Defer subtrees over at most \c threshold triangles (0: build everything)
+	void setLazyThreshold(IndexType threshold) {
+		lazyThreshold = threshold;
+	}
 
-				result.counts[index]++;
-				result.bbox[index].expandBy(bvh.getBoundingBox(f));
-			}
+	/// Return the ranges of the subtrees deferred by \ref build()
+	const tbb::concurrent_vector<LazyRange> &getLazyRanges() const {
+		return lazyRanges;
+	}
+
+	/// Build the tree over all triangles below the (allocated) root node
+	void build(IndexType root) {
+		IndexType size = bvh.getTriangleCount();
+		IndexType *indices = bvh.m_indices.data();
+		for (IndexType i = 0; i < size; ++i)
+			indices[i] = i;
+
+		BoundingBox3f centroidBounds = tbb::parallel_reduce(
+			tbb::blocked_range<IndexType>(0u, size, GRAIN_SIZE),
+			BoundingBox3f(),
+			[&](const tbb::blocked_range<IndexType> &range, BoundingBox3f result) {
+			for (IndexType i = range.begin(); i != range.end(); ++i)
+				result.expandBy(bvh.getCentroid(i));
 			return result;
 		},
-			/* REDUCE: Combine two 'Bins' data structures */
-			[](const Bins &b1, const Bins &b2) {
-			Bins result;
-			for (int i = 0; i < Bins::BIN_COUNT; ++i) {
-				result.counts[i] = b1.counts[i] + b2.counts[i];
-				result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
-			}
-			return result;
+			[](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+			return BoundingBox3f::merge(b1, b2);
 		}
 		);
 
-		/* Choose the best split plane based on the binned data */
-		BoundingBox3f bbox_left[Bins::BIN_COUNT];
-		bbox_left[0] = bins.bbox[0];
-		for (int i = 1; i<Bins::BIN_COUNT; ++i) {
-			bins.counts[i] += bins.counts[i - 1];
-			bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bbox[i]);
+		buildNode(root, indices, indices + size, centroidBounds);
+	}
+
+	/// Build the tree over the triangles <tt>m_indices[start, end)</tt> below the (allocated) root node
+	void buildRange(IndexType root, IndexType start, IndexType end, const BoundingBox3f &centroidBounds) {
+		IndexType *indices = bvh.m_indices.data();
+		buildNode(root, indices + start, indices + end, centroidBounds);
+	}
+
+private:
+	/**
+	* \brief Build the subtree over the triangles <tt>[start, end)</tt>
+	*
+	* \param node_id
+	*    Allocator id of the node to be built, its bounding box must already be set
+	*
+	* \param centroidBounds
+	*    Bounding box of the centroids of the triangles
+	*/
+	void buildNode(IndexType node_id, IndexType *start, IndexType *end,
+			const BoundingBox3f &centroidBounds) {
+		BVH::BVHNode &node = nodes[node_id];
+		IndexType size = (IndexType)(end - start);
+		bool parallel = size > PARALLEL_THRESHOLD;
+
+		if (size <= lazyThreshold) {
+			/* Defer this subtree until a ray enters it */
+			IndexType offset = (IndexType)(start - bvh.m_indices.data());
+			auto it = lazyRanges.push_back(LazyRange { offset, offset + size, node.bbox, centroidBounds });
+			node.leaf.flag = 1;
+			node.leaf.start = (IndexType)(it - lazyRanges.begin());
+			node.leaf.size = BVH::BVHNode::LAZY;
+			return;
+		}
+
+		Vector3f inv_bin_size;
+		for (int axis = 0; axis < 3; ++axis) {
+			float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+			inv_bin_size[axis] = extent > 0 ? binCount / extent : 0.f;
+		}
+		auto binIndex = [&](float centroid, int axis) {
+			return std::min(std::max((int)((centroid - centroidBounds.min[axis]) * inv_bin_size[axis]), 0), binCount - 1);
+		};
+
+		/* Accumulate all triangles into bins along all three axes */
+		auto binRange = [&](IndexType begin, IndexType end, Bins &bins) {
+			for (IndexType i = begin; i != end; ++i) {
+				IndexType f = start[i];
+				Point3f centroid = bvh.getCentroid(f);
+				BoundingBox3f bbox = bvh.getBoundingBox(f);
+				for (int axis = 0; axis < 3; ++axis) {
+					int index = binIndex(centroid[axis], axis);
+					bins.count(axis, index)++;
+					bins.bounds(axis, index).expandBy(bbox);
+				}
+			}
+		};
+
+		Bins bins(binCount);
+		if (parallel) {
+			bins = tbb::parallel_reduce(
+				tbb::blocked_range<IndexType>(0u, size, GRAIN_SIZE),
+				Bins(binCount),
+				[&](const tbb::blocked_range<IndexType> &range, Bins result) {
+				binRange(range.begin(), range.end(), result);
+				return result;
+			},
+				[](Bins b1, const Bins &b2) {
+				b1.merge(b2);
+				return b1;
+			}
+			);
+		}
+		else {
+			binRange(0u, size, bins);
 		}
 
-		BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT - 1], best_bbox_right;
-		int64_t best_index = -1;
+		/* Choose the best split plane based on the binned data */
+		std::vector<BoundingBox3f> bbox_left(binCount);
 		float best_cost = (float)INTERSECTION_COST * size;
 		float tri_factor = (float)INTERSECTION_COST / node.bbox.getSurfaceArea();
+		int best_axis = -1, best_index = -1;
+		IndexType best_count = 0;
+		BoundingBox3f best_bbox_left, best_bbox_right;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			if (inv_bin_size[axis] == 0)
+				continue;
+
+			bbox_left[0] = bins.bounds(axis, 0);
+			for (int i = 1; i < binCount; ++i) {
+				bins.count(axis, i) += bins.count(axis, i - 1);
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bounds(axis, i));
+			}
 
-		for (int i = Bins::BIN_COUNT - 2; i >= 0; --i) {
-			uint32_t prims_left = bins.counts[i], prims_right = (uint32_t)(end - start) - bins.counts[i];
-			float sah_cost = 2.0f * TRAVERSAL_COST +
-				tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-					prims_right * bbox_right.getSurfaceArea());
-			if (sah_cost < best_cost) {
-				best_cost = sah_cost;
-				best_index = i;
-				best_bbox_right = bbox_right;
+			BoundingBox3f bbox_right = bins.bounds(axis, binCount - 1);
+			for (int i = binCount - 2; i >= 0; --i) {
+				IndexType prims_left = bins.count(axis, i), prims_right = size - bins.count(axis, i);
+				if (prims_left > 0 && prims_right > 0) {
+					float sah_cost = 2.0f * TRAVERSAL_COST +
+						tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+							prims_right * bbox_right.getSurfaceArea());
+					if (sah_cost < best_cost) {
+						best_cost = sah_cost;
+						best_axis = axis;
+						best_index = i;
+						best_count = prims_left;
+						best_bbox_left = bbox_left[i];
+						best_bbox_right = bbox_right;
+					}
+				}
+				bbox_right = BoundingBox3f::merge(bbox_right, bins.bounds(axis, i));
 			}
-			bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
 		}
 
-		if (best_index == -1) {
-			/* Could not find a good split plane -- retry with
-			more careful serial code just to be sure.. */
-			execute_serially(bvh, node_idx, start, end, temp);
-			return nullptr;
+		if (best_axis == -1) {
+			/* Splitting does not reduce the cost, make a leaf */
+			node.leaf.flag = 1;
+			node.leaf.start = (IndexType)(start - bvh.m_indices.data());
+			node.leaf.size = size;
+			return;
 		}
 
-		uint32_t left_count = bins.counts[best_index];
-		int node_idx_left = node_idx + 1;
-		int node_idx_right = node_idx + 2 * left_count;
+		/* Partition the triangles, collecting the centroid bounds of both sides */
+		BoundingBox3f centroids_left, centroids_right;
+		auto isLeft = [&](IndexType f, BoundingBox3f &left, BoundingBox3f &right) {
+			Point3f centroid = bvh.getCentroid(f);
+			bool result = binIndex(centroid[best_axis], best_axis) <= best_index;
+			(result ? left : right).expandBy(centroid);
+			return result;
+		};
+
+		if (parallel)
+			partitionParallel(start, size, best_count, isLeft, centroids_left, centroids_right);
+		else
+			std::partition(start, end, [&](IndexType f) { return isLeft(f, centroids_left, centroids_right); });
 
-		bvh.m_nodes[node_idx_left].bbox = bbox_left[best_index];
-		bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
-		node.inner.rightChild = node_idx_right;
-		node.inner.axis = axis;
+		IndexType node_id_left = nodes.allocate(2);
+		IndexType node_id_right = node_id_left + 1;
+
+		nodes[node_id_left].bbox = best_bbox_left;
+		nodes[node_id_right].bbox = best_bbox_right;
+		node.inner.child = node_id_left;
+		node.inner.axis = best_axis;
 		node.inner.flag = 0;
 
-		std::atomic<uint32_t> offset_left(0),
-			offset_right(bins.counts[best_index]);
+		auto buildLeft = [&] {
+			buildNode(node_id_left, start, start + best_count, centroids_left);
+		};
+		auto buildRight = [&] {
+			buildNode(node_id_right, start + best_count, end, centroids_right);
+		};
+
+		if (size > TASK_THRESHOLD) {
+			tbb::parallel_invoke(buildLeft, buildRight);
+		}
+		else {
+			buildLeft();
+			buildRight();
+		}
+	}
+
+	/**
+	* \brief Partition a large range of triangles in place and in parallel
+	*
+	* Every block of \ref GRAIN_SIZE triangles is partitioned on its own
+	* first. The right-hand triangles which then lie in front of position
+	* \c count are exactly as many as the left-hand triangles behind it,
+	* and both are swapped pairwise.
+	*/
+	template <typename Predicate> void partitionParallel(IndexType *start, IndexType size, IndexType count,
+			const Predicate &isLeft, BoundingBox3f &centroids_left, BoundingBox3f &centroids_right) {
+		IndexType blockCount = (size + GRAIN_SIZE - 1) / GRAIN_SIZE;
+		std::vector<IndexType> blockSplit(blockCount);
+		tbb::spin_mutex mutex;
+
+		tbb::parallel_for((IndexType) 0, blockCount, [&](IndexType block) {
+			IndexType begin = block * GRAIN_SIZE, end = std::min(size, begin + GRAIN_SIZE);
+			BoundingBox3f local_left, local_right;
+			IndexType *split = std::partition(start + begin, start + end,
+				[&](IndexType f) { return isLeft(f, local_left, local_right); });
+			blockSplit[block] = (IndexType) (split - start);
+
+			tbb::spin_mutex::scoped_lock lock(mutex);
+			centroids_left.expandBy(local_left);
+			centroids_right.expandBy(local_right);
+		});
+
+		/* Collect the misplaced ranges on both sides, along with their prefix sums */
+		struct Range { IndexType begin, end, offset; };
+		std::vector<Range> misplacedLeft, misplacedRight;
+		IndexType totalLeft = 0, totalRight = 0;
+		for (IndexType block = 0; block < blockCount; ++block) {
+			IndexType begin = block * GRAIN_SIZE, end = std::min(size, begin + GRAIN_SIZE), split = blockSplit[block];
+			/* Right-hand triangles in front of 'count' */
+			IndexType rBegin = split, rEnd = std::min(end, count);
+			if (rBegin < rEnd) {
+				misplacedRight.push_back(Range{ rBegin, rEnd, totalRight });
+				totalRight += rEnd - rBegin;
+			}
+			/* Left-hand triangles behind 'count' */
+			IndexType lBegin = std::max(begin, count), lEnd = split;
+			if (lBegin < lEnd) {
+				misplacedLeft.push_back(Range{ lBegin, lEnd, totalLeft });
+				totalLeft += lEnd - lBegin;
+			}
+		}
+		assert(totalLeft == totalRight);
+
+		/* Position of the k-th misplaced triangle */
+		auto locate = [](const std::vector<Range> &ranges, IndexType k) {
+			auto it = std::upper_bound(ranges.begin(), ranges.end(), k,
+				[](IndexType k, const Range &range) { return k < range.offset; }) - 1;
+			return std::make_pair((size_t) (it - ranges.begin()), it->begin + (k - it->offset));
+		};
 
 		tbb::parallel_for(
-			tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
-			[&](const tbb::blocked_range<uint32_t> &range) {
-			uint32_t count_left = 0, count_right = 0;
-			for (uint32_t i = range.begin(); i != range.end(); ++i) {
-				uint32_t f = start[i];
-				float centroid = bvh.getCentroid(f)[axis];
-				int index = (int)((centroid - min) * inv_bin_size);
-				(index <= best_index ? count_left : count_right)++;
-			}
-			uint32_t idx_l = offset_left.fetch_add(count_left);
-			uint32_t idx_r = offset_right.fetch_add(count_right);
-			for (uint32_t i = range.begin(); i != range.end(); ++i) {
-				uint32_t f = start[i];
-				float centroid = bvh.getCentroid(f)[axis];
-				int index = (int)((centroid - min) * inv_bin_size);
-				if (index <= best_index)
-					temp[idx_l++] = f;
-				else
-					temp[idx_r++] = f;
+			tbb::blocked_range<IndexType>(0u, totalLeft, GRAIN_SIZE),
+			[&](const tbb::blocked_range<IndexType> &range) {
+			std::pair<size_t, IndexType> l = locate(misplacedLeft, range.begin());
+			std::pair<size_t, IndexType> r = locate(misplacedRight, range.begin());
+			for (IndexType k = range.begin(); k != range.end(); ++k) {
+				if (l.second == misplacedLeft[l.first].end)
+					l = std::make_pair(l.first + 1, misplacedLeft[l.first + 1].begin);
+				if (r.second == misplacedRight[r.first].end)
+					r = std::make_pair(r.first + 1, misplacedRight[r.first + 1].begin);
+				std::swap(start[l.second++], start[r.second++]);
 			}
 		}
 		);
-		memcpy(start, temp, size * sizeof(uint32_t));
-		assert(offset_left == left_count && offset_right == size);
+	}
 
-		/* Create an empty parent task */
-		tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
-		c.set_ref_count(2);
+	BVH &bvh;
+	NodeAllocator &nodes;
+	int binCount;
+	IndexType lazyThreshold = 0;
+	tbb::concurrent_vector<LazyRange> lazyRanges;
+};
 
-		/* Post right subtree to scheduler */
-		BVHBuildTask &b = *new (c.allocate_child())
-			BVHBuildTask(bvh, node_idx_right, start + left_count,
-				end, temp + left_count);
-		spawn(b);
+/**
+* \brief Builder for BVHs with spatial splits (SBVH)
+*
+* In addition to the object splits of \ref BVHBuilder, this builder
+* considers splitting space itself when the two halves of the best object
+* split overlap a lot. Primitives which straddle a spatial split plane are
+* referenced from both children, each time with a bounding box clipped to
+* the respective side. The number of such duplicated references is capped
+* by a budget relative to the primitive count.
+*
+* The used methodology is roughly that described in
+* "Spatial Splits in Bounding Volume Hierarchies"
+* by Martin Stich, Heiko Friedrich and Andreas Dietrich (Proc. HPG 2009)
+*
+* The build runs serially and allocates its nodes from a \ref NodeAllocator
+* like the other builders.
+*/
+class SBVHBuilder {
+public:
+	/// Build-related parameters
+	enum {
+		/// Number of bins used to evaluate object splits
+		OBJECT_BINS = 32,
 
-		/* Directly start working on left subtree */
-		recycle_as_child_of(c);
-		node_idx = node_idx_left;
-		end = start + left_count;
+		/// Number of bins used to evaluate spatial splits
+		SPATIAL_BINS = 32,
 
-		return this;
-	}
+		/// Only consider spatial splits above this depth
+		MAX_SPATIAL_DEPTH = 48
+	};
 
-	/// Single-threaded build function
-	static void execute_serially(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
-		BVH::BVHNode &node = bvh.m_nodes[node_idx];
-		uint32_t size = (uint32_t)(end - start);
-		float best_cost = (float)INTERSECTION_COST * size;
-		int64_t best_index = -1, best_axis = -1;
-		float *left_areas = (float *)temp;
-
-		/* Try splitting along every axis */
-		for (int axis = 0; axis<3; ++axis) {
-			/* Sort all triangles based on their centroid positions projected on the axis */
-			std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-				return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
-			});
+	/// Primitive reference with a (possibly clipped) bounding box
+	struct Reference {
+		IndexType prim;
+		BoundingBox3f bbox;
+	};
+
+	/**
+	* Create a new spatial split builder
+	*
+	* \param budget
+	*    Maximum number of duplicated references, relative to the primitive count
+	*
+	* \param alpha
+	*    Spatial splits are only considered when the overlap of the best object
+	*    split exceeds this fraction of the root surface area
+	*/
+	SBVHBuilder(BVH &bvh, NodeAllocator &nodes, BuildMemory &memory, float budget, float alpha)
+		: bvh(bvh), nodes(nodes), memory(memory), alpha(alpha) {
+		maxDuplicates = (size_t) (std::max(budget, 0.f) * bvh.getTriangleCount());
+	}
 
-			BoundingBox3f bbox;
-			for (uint32_t i = 0; i<size; ++i) {
-				uint32_t f = *(start + i);
-				bbox.expandBy(bvh.getBoundingBox(f));
-				left_areas[i] = (float)bbox.getSurfaceArea();
+	/// Build the tree below the (already allocated) node \c root and fill the index array of the BVH
+	void build(IndexType root) {
+		IndexType size = bvh.getTriangleCount();
+		std::vector<Reference> refs(size);
+		memory.allocate(size * sizeof(Reference));
+		tbb::parallel_for(
+			tbb::blocked_range<IndexType>(0u, size, BVHBuilder::GRAIN_SIZE),
+			[&](const tbb::blocked_range<IndexType> &range) {
+			for (IndexType i = range.begin(); i != range.end(); ++i) {
+				refs[i].prim = i;
+				refs[i].bbox = bvh.getBoundingBox(i);
 			}
-			if (axis == 0)
-				node.bbox = bbox;
+		}
+		);
 
-			bbox.reset();
+		rootArea = bvh.m_bbox.getSurfaceArea();
+		duplicates = 0;
+		bvh.m_indices.clear();
+		bvh.m_indices.reserve(size);
+		memory.allocate(size * sizeof(IndexType));
 
-			/* Choose the best split plane */
-			float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
-			for (uint32_t i = size - 1; i >= 1; --i) {
-				uint32_t f = *(start + i);
-				bbox.expandBy(bvh.getBoundingBox(f));
+		buildNode(root, refs, 0);
 
-				float left_area = left_areas[i - 1];
-				float right_area = bbox.getSurfaceArea();
-				uint32_t prims_left = i;
-				uint32_t prims_right = size - i;
+		size_t indexCapacity = bvh.m_indices.capacity();
+		bvh.m_indices.shrink_to_fit();
+		trackGrowth(indexCapacity, bvh.m_indices.capacity(), sizeof(IndexType));
+	}
 
-				float sah_cost = 2.0f * TRAVERSAL_COST +
-					tri_factor * (prims_left * left_area +
-						prims_right * right_area);
+	/// Return the number of references which were duplicated by spatial splits
+	size_t getDuplicateCount() const { return duplicates; }
 
-				if (sah_cost < best_cost) {
-					best_cost = sah_cost;
-					best_index = i;
-					best_axis = axis;
-				}
-			}
+private:
+	struct ObjectSplit {
+		float cost = std::numeric_limits<float>::infinity();
+		int axis = -1;
+		float pos;
+		BoundingBox3f bboxLeft, bboxRight;
+	};
+
+	struct SpatialSplit {
+		float cost = std::numeric_limits<float>::infinity();
+		int axis = -1;
+		float pos;
+	};
+
+	/// Account for an output array whose capacity changed from \c before to \c after elements
+	void trackGrowth(size_t before, size_t after, size_t elementSize) {
+		/* When growing, the old and the new array exist at the same time */
+		memory.allocate(after * elementSize);
+		memory.release(before * elementSize);
+	}
+
+	/// Release the memory of a reference list
+	void releaseReferences(std::vector<Reference> &refs) {
+		memory.release(refs.capacity() * sizeof(Reference));
+		std::vector<Reference>().swap(refs);
+	}
+
+	/// Recursively build the subtree of \c node_id (whose bounding box is set) over \c refs (which are released)
+	void buildNode(IndexType node_id, std::vector<Reference> &refs, int depth) {
+		BoundingBox3f bbox = nodes[node_id].bbox;
+		IndexType size = (IndexType) refs.size();
+		float leafCost = (float) BVHBuilder::INTERSECTION_COST * size;
+		float tri_factor = (float) BVHBuilder::INTERSECTION_COST / bbox.getSurfaceArea();
+
+		ObjectSplit object = findObjectSplit(refs, tri_factor);
+
+		SpatialSplit spatial;
+		if (depth < MAX_SPATIAL_DEPTH && duplicates < maxDuplicates) {
+			BoundingBox3f overlap = object.bboxLeft;
+			overlap.clip(object.bboxRight);
+			if (object.axis == -1 || (overlap.isValid() &&
+				overlap.getSurfaceArea() > alpha * rootArea))
+				spatial = findSpatialSplit(refs, bbox, tri_factor);
+		}
+
+		std::vector<Reference> left, right;
+		BoundingBox3f bboxLeft, bboxRight;
+		int axis = -1;
+
+		if (spatial.axis != -1 && spatial.cost < object.cost && spatial.cost < leafCost &&
+			performSpatialSplit(refs, spatial, left, right)) {
+			axis = spatial.axis;
+			for (const Reference &ref : left)
+				bboxLeft.expandBy(ref.bbox);
+			for (const Reference &ref : right)
+				bboxRight.expandBy(ref.bbox);
+		}
+		else if (object.axis != -1 && object.cost < leafCost) {
+			axis = object.axis;
+			for (const Reference &ref : refs)
+				(ref.bbox.getCenter()[axis] < object.pos ? left : right).push_back(ref);
+			bboxLeft = object.bboxLeft;
+			bboxRight = object.bboxRight;
 		}
 
-		if (best_index == -1) {
+		memory.allocate((left.capacity() + right.capacity()) * sizeof(Reference));
+
+		if (axis == -1 || left.empty() || right.empty()) {
 			/* Splitting does not reduce the cost, make a leaf */
+			BVH::BVHNode &node = nodes[node_id];
 			node.leaf.flag = 1;
-			node.leaf.start = (uint32_t)(start - bvh.m_indices.data());
+			node.leaf.start = (IndexType) bvh.m_indices.size();
 			node.leaf.size = size;
+			size_t indexCapacity = bvh.m_indices.capacity();
+			for (const Reference &ref : refs)
+				bvh.m_indices.push_back(ref.prim);
+			trackGrowth(indexCapacity, bvh.m_indices.capacity(), sizeof(IndexType));
+			memory.release((left.capacity() + right.capacity()) * sizeof(Reference));
+			releaseReferences(refs);
 			return;
 		}
 
-		std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-			return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
-		});
+		/* Release the parent's references before descending */
+		releaseReferences(refs);
 
-		uint32_t left_count = (uint32_t)best_index;
-		uint32_t node_idx_left = node_idx + 1;
-		uint32_t node_idx_right = node_idx + 2 * left_count;
-		node.inner.rightChild = node_idx_right;
-		node.inner.axis = best_axis;
-		node.inner.flag = 0;
+		IndexType node_id_left = nodes.allocate(2), node_id_right = node_id_left + 1;
+		nodes[node_id_left].bbox = bboxLeft;
+		nodes[node_id_right].bbox = bboxRight;
 
-		execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-		execute_serially(bvh, node_idx_right, start + left_count, end, temp + left_count);
+		buildNode(node_id_left, left, depth + 1);
+		buildNode(node_id_right, right, depth + 1);
+
+		BVH::BVHNode &node = nodes[node_id];
+		node.inner.child = node_id_left;
+		node.inner.axis = axis;
+		node.inner.flag = 0;
 	}
-};
 
-void BVH::addShape(Shape *shape) {
-	m_shapes.push_back(shape);
+	/// Binned SAH search for the best object split along all three axes
+	ObjectSplit findObjectSplit(const std::vector<Reference> &refs, float tri_factor) const {
+		ObjectSplit best;
+		IndexType size = (IndexType) refs.size();
+		if (size < 2)
+			return best;
+
+		BoundingBox3f centroids;
+		for (const Reference &ref : refs)
+			centroids.expandBy(ref.bbox.getCenter());
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float min = centroids.min[axis], max = centroids.max[axis];
+			if (!(max > min))
+				continue;
+			float inv_bin_size = OBJECT_BINS / (max - min);
+
+			IndexType counts[OBJECT_BINS] = { 0 };
+			BoundingBox3f bins[OBJECT_BINS];
+			for (const Reference &ref : refs) {
+				int index = std::min(std::max(
+					(int) ((ref.bbox.getCenter()[axis] - min) * inv_bin_size), 0),
+					OBJECT_BINS - 1);
+				counts[index]++;
+				bins[index].expandBy(ref.bbox);
+			}
 
-	uint32_t offset = 1;
-	if (shape->isMesh())
-		offset = static_cast<Mesh*>(shape)->getTriangleCount();
-		
-	m_shapeOffset.push_back(m_shapeOffset.back() + offset);
-	m_bbox.expandBy(shape->getBoundingBox());
-}
+			BoundingBox3f bbox_left[OBJECT_BINS];
+			bbox_left[0] = bins[0];
+			for (int i = 1; i < OBJECT_BINS; ++i) {
+				counts[i] += counts[i - 1];
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins[i]);
+			}
 
-void BVH::clear() {
-	for (auto shape : m_shapes)
-		delete shape;
-	m_shapes.clear();
-	m_shapeOffset.clear();
-	m_shapeOffset.push_back(0u);
-	m_nodes.clear();
-	m_indices.clear();
-	m_bbox.reset();
-	m_nodes.shrink_to_fit();
-	m_shapes.shrink_to_fit();
-	m_shapeOffset.shrink_to_fit();
-	m_indices.shrink_to_fit();
-}
+			BoundingBox3f bbox_right = bins[OBJECT_BINS - 1];
+			for (int i = OBJECT_BINS - 2; i >= 0; --i) {
+				IndexType prims_left = counts[i], prims_right = size - counts[i];
+				if (prims_left > 0 && prims_right > 0) {
+					float sah_cost = 2.0f * BVHBuilder::TRAVERSAL_COST +
+						tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+							prims_right * bbox_right.getSurfaceArea());
+					if (sah_cost < best.cost) {
+						best.cost = sah_cost;
+						best.axis = axis;
+						best.pos = min + (i + 1) / inv_bin_size;
+						best.bboxLeft = bbox_left[i];
+						best.bboxRight = bbox_right;
+					}
+				}
+				bbox_right = BoundingBox3f::merge(bbox_right, bins[i]);
+			}
+		}
 
-void BVH::build() {
-	uint32_t size = getTriangleCount();
-	if (size == 0)
-		return;
-	cout << "Constructing a SAH BVH (" << m_shapes.size()
-		<< (m_shapes.size() == 1 ? " shape, " : " shapes, ")
-		<< size << " triangles) .. ";
-	cout.flush();
-	Timer timer;
+		if (best.axis != -1) {
+			/* Recompute the child bounds with the exact classification used for partitioning */
+			best.bboxLeft.reset();
+			best.bboxRight.reset();
+			for (const Reference &ref : refs) {
+				if (ref.bbox.getCenter()[best.axis] < best.pos)
+					best.bboxLeft.expandBy(ref.bbox);
+				else
+					best.bboxRight.expandBy(ref.bbox);
+			}
+		}
 
-	/* Conservative estimate for the total number of nodes */
-	m_nodes.resize(2 * size);
-	memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-	m_nodes[0].bbox = m_bbox;
-	m_indices.resize(size);
+		return best;
+	}
 
-	if (sizeof(BVHNode) != 32)
-		throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+	/// Binned SAH search for the best spatial split along all three axes
+	SpatialSplit findSpatialSplit(const std::vector<Reference> &refs,
+			const BoundingBox3f &bbox, float tri_factor) const {
+		SpatialSplit best;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float origin = bbox.min[axis], extent = bbox.max[axis] - bbox.min[axis];
+			if (!(extent > 0))
+				continue;
+			float bin_size = extent / SPATIAL_BINS, inv_bin_size = 1.0f / bin_size;
+
+			IndexType enter[SPATIAL_BINS] = { 0 }, exit[SPATIAL_BINS] = { 0 };
+			BoundingBox3f bins[SPATIAL_BINS];
+
+			for (const Reference &ref : refs) {
+				int first = std::min(std::max(
+					(int) ((ref.bbox.min[axis] - origin) * inv_bin_size), 0), SPATIAL_BINS - 1);
+				int last = std::min(std::max(
+					(int) ((ref.bbox.max[axis] - origin) * inv_bin_size), first), SPATIAL_BINS - 1);
+
+				/* Chop the reference into the bins it overlaps */
+				Reference cur = ref, left, right;
+				for (int i = first; i < last; ++i) {
+					splitReference(cur, axis, origin + (i + 1) * bin_size, left, right);
+					bins[i].expandBy(left.bbox);
+					cur = right;
+				}
+				bins[last].expandBy(cur.bbox);
+				enter[first]++;
+				exit[last]++;
+			}
 
-	for (uint32_t i = 0; i < size; ++i)
-		m_indices[i] = i;
+			BoundingBox3f bbox_left[SPATIAL_BINS];
+			IndexType count_left[SPATIAL_BINS];
+			bbox_left[0] = bins[0];
+			count_left[0] = enter[0];
+			for (int i = 1; i < SPATIAL_BINS; ++i) {
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins[i]);
+				count_left[i] = count_left[i - 1] + enter[i];
+			}
 
-	uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-	BVHBuildTask& task = *new(tbb::task::allocate_root())
-		BVHBuildTask(*this, 0u, indices, indices + size, temp);
-	tbb::task::spawn_root_and_wait(task);
-	delete[] temp;
-	std::pair<float, uint32_t> stats = statistics();
+			BoundingBox3f bbox_right = bins[SPATIAL_BINS - 1];
+			IndexType count_right = exit[SPATIAL_BINS - 1];
+			for (int i = SPATIAL_BINS - 2; i >= 0; --i) {
+				IndexType prims_left = count_left[i], prims_right = count_right;
+				if (prims_left > 0 && prims_right > 0) {
+					float sah_cost = 2.0f * BVHBuilder::TRAVERSAL_COST +
+						tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+							prims_right * bbox_right.getSurfaceArea());
+					if (sah_cost < best.cost) {
+						best.cost = sah_cost;
+						best.axis = axis;
+						best.pos = origin + (i + 1) * bin_size;
+					}
+				}
+				bbox_right = BoundingBox3f::merge(bbox_right, bins[i]);
+				count_right += exit[i];
+			}
+		}
 
-	/* The node array was allocated conservatively and now contains
-	many unused entries -- do a compactification pass. */
-	std::vector<BVHNode> compactified(stats.second);
-	std::vector<uint32_t> skipped_accum(m_nodes.size());
+		return best;
+	}
 
-	for (int64_t i = stats.second - 1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-		while (m_nodes[--j].isUnused())
-			skipped++;
-		BVHNode &new_node = compactified[i];
-		new_node = m_nodes[j];
-		skipped_accum[j] = (uint32_t)skipped;
+	/**
+	* \brief Distribute the references to both sides of a spatial split plane
+	*
+	* \return \c false if the split would exceed the duplication budget or
+	* leave one of the sides empty
+	*/
+	bool performSpatialSplit(const std::vector<Reference> &refs, const SpatialSplit &split,
+			std::vector<Reference> &left, std::vector<Reference> &right) {
+		size_t straddling = 0;
+		for (const Reference &ref : refs)
+			if (ref.bbox.min[split.axis] < split.pos && ref.bbox.max[split.axis] > split.pos)
+				straddling++;
+
+		if (duplicates + straddling > maxDuplicates)
+			return false;
+
+		left.reserve(refs.size());
+		right.reserve(refs.size());
+		size_t added = 0;
+		for (const Reference &ref : refs) {
+			if (ref.bbox.max[split.axis] <= split.pos) {
+				left.push_back(ref);
+			}
+			else if (ref.bbox.min[split.axis] >= split.pos) {
+				right.push_back(ref);
+			}
+			else {
+				Reference refLeft, refRight;
+				splitReference(ref, split.axis, split.pos, refLeft, refRight);
+				bool validLeft = refLeft.bbox.isValid(), validRight = refRight.bbox.isValid();
+				if (validLeft)
+					left.push_back(refLeft);
+				if (validRight)
+					right.push_back(refRight);
+				if (validLeft && validRight)
+					added++;
+				else if (!validLeft && !validRight)
+					left.push_back(ref);
+			}
+		}
 
-		if (new_node.isInner()) {
-			new_node.inner.rightChild = (uint32_t)
-				(i + new_node.inner.rightChild - j -
-				(skipped - skipped_accum[new_node.inner.rightChild]));
+		if (left.empty() || right.empty()) {
+			left.clear();
+			right.clear();
+			return false;
 		}
+
+		duplicates += added;
+		return true;
 	}
-	cout << "done (took " << timer.elapsedString() << " and "
-		<< memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-		<< ", SAH cost = " << stats.first
-		<< ")." << endl;
 
-	m_nodes = std::move(compactified);
-}
+	/// Split a reference by an axis-aligned plane, clipping the primitive if it is a triangle
+	void splitReference(const Reference &ref, int axis, float pos, Reference &left, Reference &right) const {
+		left.prim = right.prim = ref.prim;
+		left.bbox.reset();
+		right.bbox.reset();
+
+		IndexType idx = ref.prim;
+		const Shape *shape = bvh.m_shapes[bvh.findShape(idx)];
+
+		if (shape->isMesh()) {
+			const Mesh *mesh = static_cast<const Mesh *>(shape);
+			const ConstIndexMatrixMap &F = mesh->getIndices();
+			const ConstMatrixXfMap &V = mesh->getVertexPositions();
+
+			/* Clip the triangle edges against the plane */
+			for (int k = 0; k < 3; ++k) {
+				const Point3f v0 = V.col(F(k, idx)), v1 = V.col(F((k + 1) % 3, idx));
+				float p0 = v0[axis], p1 = v1[axis];
+
+				if (p0 <= pos)
+					left.bbox.expandBy(v0);
+				if (p0 >= pos)
+					right.bbox.expandBy(v0);
+
+				if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+					float t = std::min(std::max((pos - p0) / (p1 - p0), 0.0f), 1.0f);
+					Point3f p = (1 - t) * v0 + t * v1;
+					p[axis] = pos;
+					left.bbox.expandBy(p);
+					right.bbox.expandBy(p);
+				}
+			}
+		}
+		else {
+			left.bbox = right.bbox = ref.bbox;
+		}
 
-std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
-	const BVHNode &node = m_nodes[node_idx];
-	if (node.isLeaf()) {
-		return std::make_pair((float)BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
-	}
-	else {
-		std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-		std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
-		float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
-		float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
-		float saCur = node.bbox.getSurfaceArea();
-		float sahCost =
-			2 * BVHBuildTask::TRAVERSAL_COST +
-			(saLeft * stats_left.first + saRight * stats_right.first) / saCur;
-		return std::make_pair(
-			sahCost,
-			stats_left.second + stats_right.second + 1u
-		);
+		left.bbox.max[axis] = std::min(left.bbox.max[axis], pos);
+		right.bbox.min[axis] = std::max(right.bbox.min[axis], pos);
+		left.bbox.clip(ref.bbox);
+		right.bbox.clip(ref.bbox);
 	}
-}
 
-bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-	uint32_t node_idx = 0, stack_idx = 0, stack[64]; 
+	BVH &bvh;
+	NodeAllocator &nodes;
+	BuildMemory &memory;
+	float alpha;
+	float rootArea;
+	size_t maxDuplicates;
+	size_t duplicates;
+};
 
-	/* Use an adaptive ray epsilon */
-	Ray3f ray(_ray);
-	if (ray.mint == Epsilon)
-		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+/**
+* \brief Linear BVH builder based on Morton codes (LBVH / HLBVH)
+*
+* Instead of searching for split planes, this builder sorts the primitives
+* along a Morton (Z-order) curve through their centroids with a parallel
+* radix sort. Every subtree then covers a contiguous range of the sorted
+* primitives, which is split where the highest bit of the Morton codes in
+* the range changes, i.e. in the middle of the largest occupied cell of an
+* implicit octree. Both the sort and the hierarchy emission only take
+* linear passes over the primitives, so the build is much faster than the
+* SAH builders, at the cost of a lower tree quality.
+*
+* In the hierarchical variant (HLBVH), primitives sharing the top
+* \ref CLUSTER_BITS bits of their Morton codes form clusters whose subtrees
+* are built as above, while the upper levels of the tree are built over the
+* clusters with the binned SAH. This recovers most of the trace performance
+* for a small additional cost.
+*
+* The used methodology is roughly that described in
+* "Fast BVH Construction on GPUs" by Christian Lauterbach et al.
+* (Computer Graphics Forum, Proc. Eurographics 2009) and
+* "HLBVH: Hierarchical LBVH Construction for Real-Time Ray Tracing of
+* Dynamic Geometry" by Jacopo Pantaleoni and David Luebke (Proc. HPG 2010)
+*
+* Like \ref BVHBuilder, the nodes are taken from a \ref NodeAllocator.
+*/
+class LBVHBuilder {
+public:
+	/// Build-related parameters
+	enum {
+		/// Maximum number of primitives per leaf
+		LEAF_SIZE = 4,
 
-	if (m_nodes.empty() || ray.maxt < ray.mint)
-		return false;
+		/// Number of Morton code bits sorted per radix sort pass
+		RADIX_BITS = 8,
 
-	bool foundIntersection = false;
-	MeshIntersectionQueryRecord miqr;
-	miqr.f = (uint32_t)-1;
-	float t = std::numeric_limits<float>::infinity();
+		/// Number of leading Morton code bits shared by the primitives of a cluster (HLBVH)
+		CLUSTER_BITS = 12,
 
-	while (true) {
-		const BVHNode &node = m_nodes[node_idx];
+		/// Number of bins used to split the clusters with the SAH (HLBVH)
+		CLUSTER_BINS = 16,
 
-		if (!node.bbox.rayIntersect(ray)) {
-			if (stack_idx == 0)
-				break;
+		/// Build subtrees serially below this number of primitives
+		SERIAL_THRESHOLD = 4096,
+
+		/// Split the upper levels at the median cluster below this depth (HLBVH)
+		MAX_SAH_DEPTH = 32
+	};
+
+	/// Primitive index with the Morton code of its centroid
+	struct MortonPrimitive {
+		uint32_t code;
+		IndexType prim;
+	};
+
+	/**
+	* Create a new linear BVH builder
+	*
+	* \param nodes
+	*    Allocator providing the nodes of the tree
+	*
+	* \param hierarchical
+	*    Build the upper levels over clusters of primitives with the SAH (HLBVH)
+	*/
+	LBVHBuilder(BVH &bvh, NodeAllocator &nodes, BuildMemory &memory, bool hierarchical)
+		: bvh(bvh), nodes(nodes), memory(memory), hierarchical(hierarchical) { }
+
+	/// Build the tree below the (allocated) root node, and fill in the index array of the BVH
+	void build(IndexType root) {
+		IndexType size = bvh.getTriangleCount();
+		prims.resize(size);
+		memory.allocate(size * sizeof(MortonPrimitive));
+
+		/* Quantize the centroids to a 1024^3 grid over their bounding box */
+		BoundingBox3f centroidBounds = tbb::parallel_reduce(
+			tbb::blocked_range<IndexType>(0u, size, BVHBuilder::GRAIN_SIZE),
+			BoundingBox3f(),
+			[&](const tbb::blocked_range<IndexType> &range, BoundingBox3f result) {
+			for (IndexType i = range.begin(); i != range.end(); ++i)
+				result.expandBy(bvh.getCentroid(i));
+			return result;
+		},
+			[](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+			return BoundingBox3f::merge(b1, b2);
+		}
+		);
+
+		Vector3f extents = centroidBounds.getExtents();
+		tbb::parallel_for(
+			tbb::blocked_range<IndexType>(0u, size, BVHBuilder::GRAIN_SIZE),
+			[&](const tbb::blocked_range<IndexType> &range) {
+			for (IndexType i = range.begin(); i != range.end(); ++i) {
+				Point3f c = bvh.getCentroid(i);
+				uint32_t cell[3];
+				for (int axis = 0; axis < 3; ++axis) {
+					float rel = extents[axis] > 0 ? (c[axis] - centroidBounds.min[axis]) / extents[axis] : 0.f;
+					cell[axis] = (uint32_t) clamp((int) (rel * 1024.f), 0, 1023);
+				}
+				prims[i].code = mortonCode3D(cell[0], cell[1], cell[2]);
+				prims[i].prim = i;
+			}
+		}
+		);
+
+		radixSort();
+
+		if (hierarchical)
+			buildClusters(root);
+		else
+			buildRange(root, 0u, size, 29);
+
+		prims.clear();
+		prims.shrink_to_fit();
+		memory.release(size * sizeof(MortonPrimitive));
+	}
+
+private:
+	/// Sort \ref prims by their Morton codes (stable, least significant digit first)
+	void radixSort() {
+		const uint32_t BUCKETS = 1 << RADIX_BITS;
+		IndexType size = (IndexType) prims.size();
+		IndexType chunkSize = std::max(size / (IndexType) (4 * tbb::this_task_arena::max_concurrency()), (IndexType) BVHBuilder::GRAIN_SIZE);
+		IndexType chunkCount = (size + chunkSize - 1) / chunkSize;
+		std::vector<MortonPrimitive> temp(size);
+		std::vector<IndexType> offsets(chunkCount * BUCKETS);
+		memory.allocate(size * sizeof(MortonPrimitive));
+
+		for (uint32_t shift = 0; shift < 30; shift += RADIX_BITS) {
+			/* Count the digits in every chunk */
+			std::fill(offsets.begin(), offsets.end(), 0u);
+			tbb::parallel_for((IndexType) 0, chunkCount, [&](IndexType chunk) {
+				IndexType *counts = &offsets[chunk * BUCKETS];
+				IndexType end = std::min(size, (chunk + 1) * chunkSize);
+				for (IndexType i = chunk * chunkSize; i < end; ++i)
+					counts[(prims[i].code >> shift) & (BUCKETS - 1)]++;
+			});
+
+			/* Turn the counts into output offsets, ordered by digit and then by chunk */
+			IndexType sum = 0;
+			for (uint32_t digit = 0; digit < BUCKETS; ++digit) {
+				for (IndexType chunk = 0; chunk < chunkCount; ++chunk) {
+					IndexType count = offsets[chunk * BUCKETS + digit];
+					offsets[chunk * BUCKETS + digit] = sum;
+					sum += count;
+				}
+			}
+
+			/* Scatter every chunk to its offsets */
+			tbb::parallel_for((IndexType) 0, chunkCount, [&](IndexType chunk) {
+				IndexType *offset = &offsets[chunk * BUCKETS];
+				IndexType end = std::min(size, (chunk + 1) * chunkSize);
+				for (IndexType i = chunk * chunkSize; i < end; ++i)
+					temp[offset[(prims[i].code >> shift) & (BUCKETS - 1)]++] = prims[i];
+			});
+
+			prims.swap(temp);
+		}
+
+		memory.release(size * sizeof(MortonPrimitive));
+	}
+
+	/**
+	* \brief Emit the subtree over the sorted primitives <tt>[start, end)</tt>
+	*
+	* \param bit
+	*    Highest Morton code bit which can still differ within the range
+	*
+	* \return The bounding box of the subtree
+	*/
+	BoundingBox3f buildRange(IndexType node_id, IndexType start, IndexType end, int bit) {
+		BVH::BVHNode &node = nodes[node_id];
+		IndexType size = end - start;
+
+		if (size <= LEAF_SIZE) {
+			node.leaf.flag = 1;
+			node.leaf.start = start;
+			node.leaf.size = size;
+			node.bbox.reset();
+			for (IndexType i = start; i < end; ++i) {
+				bvh.m_indices[i] = prims[i].prim;
+				node.bbox.expandBy(bvh.getBoundingBox(prims[i].prim));
+			}
+			return node.bbox;
+		}
+
+		/* Find the highest bit in which the first and the last code differ */
+		uint32_t first = prims[start].code, last = prims[end - 1].code;
+		while (bit >= 0 && ((first ^ last) & (1u << bit)) == 0)
+			--bit;
+
+		IndexType split;
+		if (bit < 0) {
+			/* All codes are the same, split in the middle */
+			split = start + size / 2;
+		}
+		else {
+			/* Binary search for the first code with the bit set */
+			IndexType lo = start, hi = end - 1;
+			while (lo < hi) {
+				IndexType mid = (lo + hi) / 2;
+				if (prims[mid].code & (1u << bit))
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			split = lo;
+		}
+
+		IndexType node_id_left = nodes.allocate(2);
+		IndexType node_id_right = node_id_left + 1;
+		BoundingBox3f bbox_left, bbox_right;
+		int next = bit < 0 ? -1 : bit - 1;
+
+		if (size > SERIAL_THRESHOLD) {
+			tbb::parallel_invoke(
+				[&] { bbox_left = buildRange(node_id_left, start, split, next); },
+				[&] { bbox_right = buildRange(node_id_right, split, end, next); }
+			);
+		}
+		else {
+			bbox_left = buildRange(node_id_left, start, split, next);
+			bbox_right = buildRange(node_id_right, split, end, next);
+		}
+
+		makeInner(node, node_id_left, bit < 0 ? -1 : 2 - bit % 3, bbox_left, bbox_right);
+		return node.bbox;
+	}
+
+	/// Fill in an inner node; axis -1 chooses the axis along which the children are separated most
+	static void makeInner(BVH::BVHNode &node, IndexType child, int axis,
+			const BoundingBox3f &bbox_left, const BoundingBox3f &bbox_right) {
+		if (axis < 0) {
+			Vector3f d = bbox_right.getCenter() - bbox_left.getCenter();
+			d.maxCoeff(&axis);
+		}
+		node.inner.flag = 0;
+		node.inner.axis = (uint32_t) axis;
+		node.inner.child = child;
+		node.bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+	}
+
+	/// Range of sorted primitives sharing the top \ref CLUSTER_BITS bits of their Morton codes
+	struct Cluster {
+		IndexType start, end;
+		BoundingBox3f bbox;
+	};
+
+	/// Subtree over one cluster, which is built once the clusters are in their final order
+	struct ClusterJob {
+		IndexType node_id, start, end;
+	};
+
+	/// HLBVH: build the SAH tree over the clusters, and then their subtrees
+	void buildClusters(IndexType root) {
+		const int shift = 30 - CLUSTER_BITS;
+		IndexType size = (IndexType) prims.size();
+
+		std::vector<Cluster> clusters;
+		for (IndexType start = 0; start < size; ) {
+			IndexType end = start + 1;
+			while (end < size && (prims[end].code >> shift) == (prims[start].code >> shift))
+				++end;
+			clusters.push_back(Cluster{ start, end, BoundingBox3f() });
+			start = end;
+		}
+
+		tbb::parallel_for(size_t(0), clusters.size(), [&](size_t i) {
+			Cluster &cluster = clusters[i];
+			for (IndexType j = cluster.start; j < cluster.end; ++j)
+				cluster.bbox.expandBy(bvh.getBoundingBox(prims[j].prim));
+		});
+
+		/* The upper levels reorder the clusters, so their primitives
+		   are gathered into a new array in the final order */
+		std::vector<MortonPrimitive> ordered(size);
+		memory.allocate(size * sizeof(MortonPrimitive));
+		std::vector<ClusterJob> jobs;
+		jobs.reserve(clusters.size());
+		buildUpper(clusters.data(), clusters.data() + clusters.size(), root, 0u, ordered, jobs, 0);
+		prims.swap(ordered);
+		std::vector<MortonPrimitive>().swap(ordered);
+		memory.release(size * sizeof(MortonPrimitive));
+
+		tbb::parallel_for(size_t(0), jobs.size(), [&](size_t i) {
+			buildRange(jobs[i].node_id, jobs[i].start, jobs[i].end, shift - 1);
+		});
+	}
+
+	/**
+	* \brief Emit the upper levels over the clusters <tt>[begin, end)</tt> with the binned SAH
+	*
+	* \param offset
+	*    Position of the first primitive of the subtree in the final primitive order
+	*
+	* \return The bounding box of the subtree
+	*/
+	BoundingBox3f buildUpper(Cluster *begin, Cluster *end, IndexType node_id, IndexType offset,
+			std::vector<MortonPrimitive> &ordered, std::vector<ClusterJob> &jobs, int depth) {
+		if (end - begin == 1) {
+			/* The node becomes the root of the cluster's subtree */
+			IndexType count = begin->end - begin->start;
+			std::copy(prims.begin() + begin->start, prims.begin() + begin->end, ordered.begin() + offset);
+			jobs.push_back(ClusterJob{ node_id, offset, offset + count });
+			return begin->bbox;
+		}
+
+		BoundingBox3f centroidBounds;
+		for (Cluster *c = begin; c != end; ++c)
+			centroidBounds.expandBy(c->bbox.getCenter());
+		int axis = centroidBounds.getLargestAxis();
+		float min = centroidBounds.min[axis], max = centroidBounds.max[axis];
+
+		Cluster *mid = nullptr;
+		if (max > min && depth < MAX_SAH_DEPTH) {
+			/* Bin the clusters, weighted by their primitive counts */
+			Bins bins(CLUSTER_BINS);
+			float inv_bin_size = CLUSTER_BINS / (max - min);
+			auto binIndex = [&](const Cluster &c) {
+				return std::min(std::max((int) ((c.bbox.getCenter()[axis] - min) * inv_bin_size), 0), CLUSTER_BINS - 1);
+			};
+			for (Cluster *c = begin; c != end; ++c) {
+				int index = binIndex(*c);
+				bins.count(axis, index) += c->end - c->start;
+				bins.bounds(axis, index).expandBy(c->bbox);
+			}
+
+			BoundingBox3f bbox_left[CLUSTER_BINS];
+			IndexType counts_left[CLUSTER_BINS];
+			bbox_left[0] = bins.bounds(axis, 0);
+			counts_left[0] = bins.count(axis, 0);
+			for (int i = 1; i < CLUSTER_BINS; ++i) {
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bounds(axis, i));
+				counts_left[i] = counts_left[i - 1] + bins.count(axis, i);
+			}
+
+			IndexType total = counts_left[CLUSTER_BINS - 1];
+			BoundingBox3f bbox_right;
+			float best_cost = std::numeric_limits<float>::infinity();
+			int best_index = -1;
+			for (int i = CLUSTER_BINS - 2; i >= 0; --i) {
+				bbox_right.expandBy(bins.bounds(axis, i + 1));
+				IndexType prims_left = counts_left[i], prims_right = total - counts_left[i];
+				if (prims_left == 0 || prims_right == 0)
+					continue;
+				float cost = prims_left * bbox_left[i].getSurfaceArea() + prims_right * bbox_right.getSurfaceArea();
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_index = i;
+				}
+			}
+
+			if (best_index >= 0)
+				mid = std::partition(begin, end, [&](const Cluster &c) { return binIndex(c) <= best_index; });
+		}
+
+		if (!mid) {
+			/* No usable split plane, split at the median cluster */
+			mid = begin + (end - begin) / 2;
+			std::nth_element(begin, mid, end, [&](const Cluster &c1, const Cluster &c2) {
+				return c1.bbox.getCenter()[axis] < c2.bbox.getCenter()[axis];
+			});
+		}
+
+		IndexType left_count = 0;
+		for (Cluster *c = begin; c != mid; ++c)
+			left_count += c->end - c->start;
+
+		IndexType node_id_left = nodes.allocate(2);
+		IndexType node_id_right = node_id_left + 1;
+		BoundingBox3f bbox_left = buildUpper(begin, mid, node_id_left, offset, ordered, jobs, depth + 1);
+		BoundingBox3f bbox_right = buildUpper(mid, end, node_id_right, offset + left_count, ordered, jobs, depth + 1);
+
+		makeInner(nodes[node_id], node_id_left, axis, bbox_left, bbox_right);
+		return nodes[node_id].bbox;
+	}
+
+	BVH &bvh;
+	NodeAllocator &nodes;
+	BuildMemory &memory;
+	bool hierarchical;
+	std::vector<MortonPrimitive> prims;  ///< Primitives sorted by their Morton codes
+};
+
+void BVH::addShape(Shape *shape) {
+	m_shapes.push_back(shape);
+
+	EPrimitiveType type = getPrimitiveType(shape);
+	m_shapeTypes.push_back(type);
+	if (m_shapes.size() == 1)
+		m_sceneType = type;
+	else if (m_sceneType != type)
+		m_sceneType = EPrimitiveType::EMixed;
+
+	IndexType offset = 1;
+	if (shape->isMesh())
+		offset = static_cast<Mesh*>(shape)->getTriangleCount();
+		
+	m_shapeOffset.push_back(m_shapeOffset.back() + offset);
+	m_bbox.expandBy(shape->getBoundingBox());
+}
+
+void BVH::clear() {
+	for (auto shape : m_shapes)
+		delete shape;
+	m_shapes.clear();
+	m_shapeTypes.clear();
+	m_sceneType = EPrimitiveType::EMixed;
+	m_shapeOffset.clear();
+	m_shapeOffset.push_back(0u);
+	m_nodes.clear();
+	m_indices.clear();
+	m_triangles.clear();
+	m_nodeData = nullptr;
+	m_indexData = nullptr;
+	m_nodeCount = m_indexCount = 0;
+	m_lazySubtrees.reset();
+	m_lazyCount = 0;
+	m_cacheFile.reset();
+	m_bbox.reset();
+	m_nodes.shrink_to_fit();
+	m_triangles.shrink_to_fit();
+	m_shapes.shrink_to_fit();
+	m_shapeTypes.shrink_to_fit();
+	m_shapeOffset.shrink_to_fit();
+	m_indices.shrink_to_fit();
+}
+
+void BVH::build() {
+	if (getTriangleCount() == 0)
+		return;
+
+	if (m_cacheDir.empty()) {
+		buildTree();
+	}
+	else {
+		uint64_t key = computeCacheKey();
+		std::string filename = (filesystem::path(m_cacheDir) /
+			filesystem::path(tfm::format("bvh-%016x.bin", key))).str();
+
+		if (!loadCache(filename, key)) {
+			buildTree();
+			writeCache(filename, key);
+		}
+	}
+
+	if (m_precomputeTriangles)
+		precomputeTriangles();
+}
+
+void BVH::useBuiltTree() {
+	m_cacheFile.reset();
+	m_nodeData = m_nodes.data();
+	m_nodeCount = (IndexType) m_nodes.size();
+	m_indexData = m_indices.data();
+	m_indexCount = (IndexType) m_indices.size();
+}
+
+BVH::EBuilder BVH::parseBuilder(const PropertyList &propList) {
+	std::string builder = propList.getString("bvhBuilder",
+		propList.getBoolean("spatialSplits", false) ? "sbvh" : "sah");
+
+	if (builder == "sah")
+		return EBuilder::ESAH;
+	else if (builder == "sbvh")
+		return EBuilder::ESpatialSplits;
+	else if (builder == "lbvh")
+		return EBuilder::ELinear;
+	else if (builder == "hlbvh")
+		return EBuilder::EHierarchical;
+
+	throw NoriException("BVH: unknown builder \"%s\" (expected sah, sbvh, lbvh or hlbvh)", builder);
+}
+
+void BVH::buildTree() {
+	static const char *builderNames[] = { "SAH", "spatial split", "linear", "hierarchical linear" };
+
+	IndexType size = getTriangleCount();
+	cout << "Constructing a " << builderNames[(int) m_builder]
+		<< " BVH (" << m_shapes.size()
+		<< (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+		<< size << " triangles) .. ";
+	cout.flush();
+	Timer timer;
+
+	/* Build throughput in millions of triangles per second */
+	auto throughput = [&]() {
+		return tfm::format("%.2fM triangles/s", size / (1000.0 * std::max(timer.elapsed(), 1.0)));
+	};
+
+	if (sizeof(BVHNode) != 2 * sizeof(IndexType) + sizeof(BoundingBox3f))
+		throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+
+	BuildMemory memory;
+	size_t duplicates = 0;
+
+	NodeVector().swap(m_nodes);
+	m_lazySubtrees.reset();
+	m_lazyCount = 0;
+	m_lazyBuilt = 0;
+	m_lazyBuiltPrims = 0;
+	m_lazyBuiltMemory = 0;
+
+	NodeAllocator nodes(memory);
+	IndexType root = nodes.allocate(1);
+	nodes[root].bbox = m_bbox;
+
+	if (m_builder == EBuilder::ESpatialSplits) {
+		SBVHBuilder builder(*this, nodes, memory, m_spatialSplitBudget, m_spatialSplitAlpha);
+		builder.build(root);
+		duplicates = builder.getDuplicateCount();
+	}
+	else {
+		m_indices.resize(size);
+		memory.allocate(sizeof(IndexType) * size);
+
+		if (m_builder == EBuilder::ELinear || m_builder == EBuilder::EHierarchical) {
+			LBVHBuilder builder(*this, nodes, memory, m_builder == EBuilder::EHierarchical);
+			builder.build(root);
+		}
+		else {
+			BVHBuilder builder(*this, nodes, m_binCount);
+			if (m_lazy)
+				builder.setLazyThreshold((IndexType) m_lazySize);
+			builder.build(root);
+
+			const tbb::concurrent_vector<BVHBuilder::LazyRange> &ranges = builder.getLazyRanges();
+			m_lazyCount = (IndexType) ranges.size();
+			if (m_lazyCount > 0)
+				m_lazySubtrees.reset(new LazySubtree[m_lazyCount]);
+			for (IndexType i = 0; i < m_lazyCount; ++i) {
+				LazySubtree &subtree = m_lazySubtrees[i];
+				subtree.start = ranges[i].start;
+				subtree.end = ranges[i].end;
+				subtree.bbox = ranges[i].bbox;
+				subtree.centroidBounds = ranges[i].centroidBounds;
+			}
+		}
+	}
+
+	separatePrimitiveTypes(nodes, root);
+
+	/* The nodes are scattered over the chunks of the threads that built
+	   them, copy them into page-sized treelets of sibling pairs */
+	nodes.layout(root, m_nodes);
+
+	useBuiltTree();
+	std::pair<float, IndexType> stats = statistics();
+	m_builtCost = stats.first;
+
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(BVHNode) * m_nodes.size() + sizeof(IndexType)*m_indices.size())
+		<< ", peak build memory " << memString(memory.peak)
+		<< ", SAH cost = " << stats.first;
+	if (m_builder == EBuilder::ESpatialSplits)
+		cout << ", " << duplicates << " duplicated references";
+	if (m_lazy)
+		cout << ", " << m_lazyCount << " subtrees deferred";
+	cout << ", " << throughput()
+		<< ")." << endl;
+}
+
+void BVH::separatePrimitiveTypes(NodeAllocator &nodes, IndexType root) {
+	/* Nodes are allocated zeroed, so all leaves already have the triangle type */
+	if (m_sceneType == EPrimitiveType::ETriangle)
+		return;
+
+	auto typeOf = [&](IndexType idx) { return m_shapeTypes[findShape(idx)]; };
+
+	std::vector<IndexType> stack(1, root);
+	while (!stack.empty()) {
+		IndexType id = stack.back();
+		stack.pop_back();
+		BVHNode &node = nodes[id];
+
+		if (node.isInner()) {
+			stack.push_back(node.inner.child);
+			stack.push_back(node.inner.child + 1);
+			continue;
+		}
+		if (node.isLazy() || node.leaf.size == 0)
+			continue;
+
+		IndexType *start = m_indices.data() + node.leaf.start, *end = start + node.leaf.size;
+		std::stable_sort(start, end, [&](IndexType a, IndexType b) { return typeOf(a) < typeOf(b); });
+
+		/* Split off one leaf per type, the remaining types go to the right */
+		while (true) {
+			EPrimitiveType type = typeOf(*start);
+			IndexType *split = start + 1;
+			while (split != end && typeOf(*split) == type)
+				++split;
+
+			BVHNode &current = nodes[id];
+			if (split == end) {
+				current.leaf.type = (IndexType) type;
+				break;
+			}
+
+			BoundingBox3f bbox_left, bbox_right;
+			for (IndexType *it = start; it != split; ++it)
+				bbox_left.expandBy(getBoundingBox(*it));
+			for (IndexType *it = split; it != end; ++it)
+				bbox_right.expandBy(getBoundingBox(*it));
+
+			/* References of the spatial split builder can be clipped to the node */
+			bbox_left.clip(current.bbox);
+			bbox_right.clip(current.bbox);
+
+			IndexType child = nodes.allocate(2);
+			for (IndexType k = 0; k < 2; ++k) {
+				BVHNode &c = nodes[child + k];
+				IndexType *first = k == 0 ? start : split, *last = k == 0 ? split : end;
+				c.bbox = k == 0 ? bbox_left : bbox_right;
+				c.leaf.flag = 1;
+				c.leaf.start = (IndexType) (first - m_indices.data());
+				c.leaf.size = (IndexType) (last - first);
+			}
+			nodes[child].leaf.type = (IndexType) type;
+
+			current.inner.flag = 0;
+			current.inner.axis = 0;
+			current.inner.child = child;
+
+			id = child + 1;
+			start = split;
+		}
+	}
+}
+
+const BVH::BVHNode *BVH::buildLazySubtree(LazySubtree &subtree) const {
+	std::lock_guard<std::mutex> lock(subtree.mutex);
+
+	/* Another thread may have built the subtree while this one was waiting */
+	const BVHNode *built = subtree.built.load(std::memory_order_acquire);
+	if (built)
+		return built;
+
+	/* Isolate the build: while waiting for its tasks, this thread must not
+	   pick up another rendering task, which could enter this same subtree
+	   and would then try to lock the mutex a second time */
+	tbb::this_task_arena::isolate([&] {
+		BuildMemory memory;
+		NodeAllocator nodes(memory);
+		IndexType root = nodes.allocate(1);
+		nodes[root].bbox = subtree.bbox;
+
+		/* The builder only reorders the subtree's own range of m_indices,
+		   which no ray reads before the subtree is published below */
+		BVHBuilder builder(const_cast<BVH &>(*this), nodes, m_binCount);
+		builder.buildRange(root, subtree.start, subtree.end, subtree.centroidBounds);
+		const_cast<BVH &>(*this).separatePrimitiveTypes(nodes, root);
+		nodes.layout(root, subtree.nodes);
+	});
+
+	m_lazyBuilt++;
+	m_lazyBuiltPrims += subtree.end - subtree.start;
+	m_lazyBuiltMemory += sizeof(BVHNode) * subtree.nodes.size();
+
+	built = subtree.nodes.data();
+	subtree.built.store(built, std::memory_order_release);
+	return built;
+}
+
+std::string BVH::getStatistics() const {
+	if (m_lazyCount == 0)
+		return std::string();
+
+	return tfm::format("Lazy BVH: built %i of %i subtrees on demand (%.1f%% of the triangles, %s)",
+		(IndexType) m_lazyBuilt, m_lazyCount,
+		100.0 * (double) m_lazyBuiltPrims / (double) getTriangleCount(),
+		memString(m_lazyBuiltMemory));
+}
+
+/// Version of the BVH cache file format. Increase this whenever the node
+/// layout or one of the builders changes, so that stale caches are rebuilt
+static const uint32_t BVH_CACHE_VERSION = 7;
+
+/// Header of a BVH cache file, followed by the nodes and then the indices.
+/// It fills a whole cache line, so that the mapped node pairs stay aligned
+struct BVHCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize;
+	uint64_t key;
+	uint64_t nodeCount;
+	uint64_t indexCount;
+	float sahCost;
+	uint32_t padding[5];
+};
+
+static const char BVH_CACHE_MAGIC[8] = { 'N', 'O', 'R', 'I', 'B', 'V', 'H', '\0' };
+
+/// Accumulate a 64-bit FNV-1a style hash, processing eight bytes at a time
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *ptr = (const uint8_t *) data;
+	for (; size >= 8; size -= 8, ptr += 8) {
+		uint64_t word;
+		memcpy(&word, ptr, 8);
+		hash = (hash ^ word) * 0x100000001b3ull;
+		hash ^= hash >> 29;
+	}
+	for (; size > 0; --size, ++ptr)
+		hash = (hash ^ *ptr) * 0x100000001b3ull;
+	return hash;
+}
+
+template <typename T> static uint64_t hashValue(uint64_t hash, const T &value) {
+	return hashBytes(hash, &value, sizeof(T));
+}
+
+uint64_t BVH::computeCacheKey() const {
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	hash = hashValue(hash, BVH_CACHE_VERSION);
+	hash = hashValue(hash, (uint32_t) sizeof(BVHNode));
+	hash = hashValue(hash, (uint32_t) m_builder);
+	if (m_builder == EBuilder::ESAH)
+		hash = hashValue(hash, m_binCount);
+	if (m_builder == EBuilder::ESpatialSplits) {
+		hash = hashValue(hash, m_spatialSplitBudget);
+		hash = hashValue(hash, m_spatialSplitAlpha);
+	}
+
+	hash = hashValue(hash, (uint32_t) m_shapes.size());
+	for (size_t i = 0; i < m_shapes.size(); ++i) {
+		/* The leaves store the primitive type, which the kernels cast on */
+		const Shape *shape = m_shapes[i];
+		hash = hashValue(hash, (uint32_t) m_shapeTypes[i]);
+		if (shape->isMesh()) {
+			const Mesh *mesh = static_cast<const Mesh *>(shape);
+			const ConstMatrixXfMap &V = mesh->getVertexPositions();
+			const ConstIndexMatrixMap &F = mesh->getIndices();
+			hash = hashValue(hash, (uint64_t) V.cols());
+			hash = hashValue(hash, (uint64_t) F.cols());
+			hash = hashBytes(hash, V.data(), sizeof(float) * V.size());
+			hash = hashBytes(hash, F.data(), sizeof(IndexType) * F.size());
+		}
+		else {
+			/* Other shapes only enter the build through their bounds */
+			const BoundingBox3f &bbox = shape->getBoundingBox();
+			hash = hashBytes(hash, bbox.min.data(), sizeof(float) * 3);
+			hash = hashBytes(hash, bbox.max.data(), sizeof(float) * 3);
+		}
+	}
+
+	return hash;
+}
+
+bool BVH::loadCache(const std::string &filename, uint64_t key) {
+	if (!filesystem::path(filename).exists())
+		return false;
+
+	Timer timer;
+	std::unique_ptr<MemoryMappedFile> file;
+	try {
+		file.reset(new MemoryMappedFile(filename));
+	}
+	catch (const NoriException &) {
+		return false;
+	}
+
+	/* Reject files from other versions or with inconsistent sizes */
+	BVHCacheHeader header;
+	if (file->size() < sizeof(BVHCacheHeader))
+		return false;
+	memcpy(&header, file->data(), sizeof(BVHCacheHeader));
+	if (memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC)) != 0 ||
+		header.version != BVH_CACHE_VERSION || header.nodeSize != sizeof(BVHNode) ||
+		header.key != key || header.nodeCount == 0 ||
+		file->size() != sizeof(BVHCacheHeader) + header.nodeCount * sizeof(BVHNode)
+			+ header.indexCount * sizeof(IndexType))
+		return false;
+
+	/* Use the mapped arrays in place */
+	const uint8_t *data = file->data() + sizeof(BVHCacheHeader);
+	m_nodes.clear();
+	m_indices.clear();
+	m_nodeData = (const BVHNode *) data;
+	m_nodeCount = (IndexType) header.nodeCount;
+	m_indexData = (const IndexType *) (data + header.nodeCount * sizeof(BVHNode));
+	m_indexCount = (IndexType) header.indexCount;
+	m_builtCost = header.sahCost;
+	m_cacheFile = std::move(file);
+
+	cout << "Loaded the BVH from \"" << filename << "\" (took "
+		<< timer.elapsedString() << ", " << m_nodeCount << " nodes, "
+		<< memString(m_cacheFile->size()) << " mapped)." << endl;
+	return true;
+}
+
+void BVH::writeCache(const std::string &filename, uint64_t key) const {
+	BVHCacheHeader header;
+	memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+	header.version = BVH_CACHE_VERSION;
+	header.nodeSize = (uint32_t) sizeof(BVHNode);
+	header.key = key;
+	header.nodeCount = m_nodeCount;
+	header.indexCount = m_indexCount;
+	header.sahCost = m_builtCost;
+	memset(header.padding, 0, sizeof(header.padding));
+
+	/* Write to a temporary file first, so that an interrupted
+	   run never leaves a truncated cache file behind */
+	std::string tempFilename = filename + ".tmp";
+	std::ofstream os(tempFilename, std::ios::binary);
+	os.write((const char *) &header, sizeof(BVHCacheHeader));
+	os.write((const char *) m_nodeData, sizeof(BVHNode) * m_nodeCount);
+	os.write((const char *) m_indexData, sizeof(IndexType) * m_indexCount);
+	os.close();
+
+	std::remove(filename.c_str());
+	if (!os || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+		std::remove(tempFilename.c_str());
+		cerr << "Unable to write the BVH cache file \"" << filename << "\"!" << endl;
+		return;
+	}
+
+	cout << "Wrote the BVH to \"" << filename << "\"." << endl;
+}
+
+void BVH::refit() {
+	if (getTriangleCount() == 0)
+		return;
+
+	if (m_lazy) {
+		/* Refitting would require building all subtrees, start over instead */
+		m_bbox.reset();
+		for (const Shape *shape : m_shapes)
+			m_bbox.expandBy(shape->getBoundingBox());
+		build();
+		return;
+	}
+
+	cout << "Refitting the BVH .. ";
+	cout.flush();
+	Timer timer;
+
+	refitNodes();
+	float cost = getSAHCost();
+
+	if (cost > m_refitThreshold * m_builtCost) {
+		cout << "SAH cost increased from " << m_builtCost << " to " << cost
+			<< ", rebuilding." << endl;
+		build();
+		return;
+	}
+
+	cout << "done (took " << timer.elapsedString() << ", SAH cost = " << cost
+		<< " vs. " << m_builtCost << " when built)." << endl;
+
+	if (m_precomputeTriangles)
+		precomputeTriangles();
+}
+
+void BVH::refitNodes() {
+	/* Nodes mapped from a cache file are read-only, work on a copy */
+	if (m_nodeData != m_nodes.data()) {
+		m_nodes.assign(m_nodeData, m_nodeData + m_nodeCount);
+		m_nodeData = m_nodes.data();
+	}
+	BVHNode *nodes = m_nodes.data();
+
+	/* Leaves first, these account for most of the work */
+	tbb::parallel_for(
+		tbb::blocked_range<IndexType>(0u, m_nodeCount, BVHBuilder::GRAIN_SIZE),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i) {
+			BVHNode &node = nodes[i];
+			if (node.isInner())
+				continue;
+			node.bbox.reset();
+			for (IndexType j = node.start(); j < node.end(); ++j)
+				node.bbox.expandBy(getBoundingBox(m_indexData[j]));
+		}
+	}
+	);
+
+	/* Children are always stored after their parent (see
+	   NodeAllocator::layout()), so a reverse sweep visits them first */
+	for (int64_t i = (int64_t) m_nodeCount - 1; i >= 0; --i) {
+		BVHNode &node = nodes[i];
+		if (node.isInner())
+			node.bbox = BoundingBox3f::merge(nodes[node.inner.child].bbox, nodes[node.inner.child + 1].bbox);
+	}
+
+	m_bbox = nodes[0].bbox;
+}
+
+void BVH::precomputeTriangles() {
+	cout << "Precomputing " << m_indexCount << " primitives in leaf order .. ";
+	cout.flush();
+	Timer timer;
+
+	m_triangles.resize(m_indexCount);
+
+	tbb::parallel_for(
+		tbb::blocked_range<IndexType>(0u, m_indexCount, BVHBuilder::GRAIN_SIZE),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i) {
+			IndexType idx = m_indexData[i];
+			const Shape *shape = m_shapes[findShape(idx)];
+			PrecomputedTriangle &tri = m_triangles[i];
+			tri.shape = shape;
+
+			if (!shape->isMesh()) {
+				tri.idx = shape->isSphere() ? PrecomputedTriangle::SPHERE_SHAPE : PrecomputedTriangle::GENERIC_SHAPE;
+				continue;
+			}
+
+			const Mesh *mesh = static_cast<const Mesh *>(shape);
+			const ConstIndexMatrixMap &F = mesh->getIndices();
+			const ConstMatrixXfMap &V = mesh->getVertexPositions();
+			const Point3f p0 = V.col(F(0, idx)), p1 = V.col(F(1, idx)), p2 = V.col(F(2, idx));
+			const Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+
+			for (int k = 0; k < 3; ++k) {
+				tri.p0[k] = p0[k];
+				tri.edge1[k] = edge1[k];
+				tri.edge2[k] = edge2[k];
+			}
+			tri.idx = idx;
+		}
+	}
+	);
+
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(PrecomputedTriangle) * m_triangles.size()) << ")." << endl;
+}
+
+std::pair<float, IndexType> BVH::statistics(IndexType node_idx) const {
+	const BVHNode &node = m_nodeData[node_idx];
+	if (node.isLeaf()) {
+		/* Lazy leaves are estimated by the cost of intersecting all their primitives */
+		IndexType size = node.isLazy() ?
+			m_lazySubtrees[node.leaf.start].end - m_lazySubtrees[node.leaf.start].start : node.leaf.size;
+		return std::make_pair((float)BVHBuilder::INTERSECTION_COST * size, (IndexType) 1u);
+	}
+	else {
+		std::pair<float, IndexType> stats_left = statistics(node.inner.child);
+		std::pair<float, IndexType> stats_right = statistics(node.inner.child + 1);
+		float saLeft = m_nodeData[node.inner.child].bbox.getSurfaceArea();
+		float saRight = m_nodeData[node.inner.child + 1].bbox.getSurfaceArea();
+		float saCur = node.bbox.getSurfaceArea();
+		float sahCost =
+			2 * BVHBuilder::TRAVERSAL_COST +
+			(saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+		return std::make_pair(
+			sahCost,
+			stats_left.second + stats_right.second + 1u
+		);
+	}
+}
+
+template <BVH::EPrimitiveType Type>
+inline bool BVH::intersectPrimitive(const PrecomputedTriangle *tri, const Shape *shape, IndexType idx,
+		const Ray3f &ray, float &t, MeshIntersectionQueryRecord &miqr) const {
+	if (Type == EPrimitiveType::ETriangle) {
+		/* The test writes its distance even when it fails, so
+		   only update 't' once the triangle was actually hit */
+		float u, v, tTri;
+		if (!(tri ? tri->rayIntersect(ray, u, v, tTri)
+			: static_cast<const Mesh *>(shape)->rayIntersect(idx, ray, u, v, tTri)))
+			return false;
+		t = tTri;
+		miqr.idx = idx;
+		miqr.uv = Point2f(u, v);
+		return true;
+	}
+
+	miqr.idx = 0;
+	if (Type == EPrimitiveType::ESphere)
+		return static_cast<const Sphere *>(shape)->intersect(ray, t);
+	return shape->rayIntersect(ray, t, &miqr);
+}
+
+inline const Shape *BVH::lookupPrimitive(IndexType i, const PrecomputedTriangle *&tri,
+		IndexType &idx, EPrimitiveType &type, uint32_t &shapeIdx) const {
+	if (!m_triangles.empty()) {
+		tri = &m_triangles[i];
+		idx = tri->idx;
+		type = idx == PrecomputedTriangle::GENERIC_SHAPE ? EPrimitiveType::EGeneric
+			: idx == PrecomputedTriangle::SPHERE_SHAPE ? EPrimitiveType::ESphere : EPrimitiveType::ETriangle;
+		return tri->shape;
+	}
+
+	tri = nullptr;
+	idx = m_indexData[i];
+	if (idx >= m_shapeOffset[shapeIdx] && idx < m_shapeOffset[shapeIdx + 1])
+		idx -= m_shapeOffset[shapeIdx];
+	else
+		shapeIdx = findShape(idx);
+	type = m_shapeTypes[shapeIdx];
+	return m_shapes[shapeIdx];
+}
+
+template <BVH::EPrimitiveType Type>
+bool BVH::intersectRange(IndexType start, IndexType end, Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&hitShape) const {
+	bool foundIntersection = false;
+
+	uint32_t shapeIdx = 0;
+	for (IndexType i = start; i < end; ++i) {
+		const PrecomputedTriangle *tri;
+		IndexType idx;
+		EPrimitiveType type;
+		const Shape *shape = lookupPrimitive(i, tri, idx, type, shapeIdx);
+
+		if (intersectPrimitive<Type>(tri, shape, idx, ray, t, miqr)) {
+			ray.maxt = t;
+			hitShape = shape;
+			miqr.f = miqr.idx;
+			foundIntersection = true;
+		}
+	}
+	return foundIntersection;
+}
+
+bool BVH::intersectLeaf(const BVHNode &node, Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&hitShape) const {
+	switch ((EPrimitiveType) node.leaf.type) {
+		case EPrimitiveType::ESphere:
+			return intersectRange<EPrimitiveType::ESphere>(node.start(), node.end(), ray, t, miqr, hitShape);
+		case EPrimitiveType::EGeneric:
+			return intersectRange<EPrimitiveType::EGeneric>(node.start(), node.end(), ray, t, miqr, hitShape);
+		default:
+			return intersectRange<EPrimitiveType::ETriangle>(node.start(), node.end(), ray, t, miqr, hitShape);
+	}
+}
+
+bool BVH::intersectPrimitives(IndexType start, IndexType end, Ray3f &ray, float &t,
+	MeshIntersectionQueryRecord &miqr, const Shape *&hitShape) const {
+	switch (m_sceneType) {
+		case EPrimitiveType::ETriangle:
+			return intersectRange<EPrimitiveType::ETriangle>(start, end, ray, t, miqr, hitShape);
+		case EPrimitiveType::ESphere:
+			return intersectRange<EPrimitiveType::ESphere>(start, end, ray, t, miqr, hitShape);
+		case EPrimitiveType::EGeneric:
+			return intersectRange<EPrimitiveType::EGeneric>(start, end, ray, t, miqr, hitShape);
+		default:
+			break;
+	}
+
+	/* Several types of shapes, dispatch every primitive on its own */
+	bool foundIntersection = false;
+	uint32_t shapeIdx = 0;
+	for (IndexType i = start; i < end; ++i) {
+		const PrecomputedTriangle *tri;
+		IndexType idx;
+		EPrimitiveType type;
+		const Shape *shape = lookupPrimitive(i, tri, idx, type, shapeIdx);
+
+		bool found = type == EPrimitiveType::ETriangle ? intersectPrimitive<EPrimitiveType::ETriangle>(tri, shape, idx, ray, t, miqr)
+			: type == EPrimitiveType::ESphere ? intersectPrimitive<EPrimitiveType::ESphere>(tri, shape, idx, ray, t, miqr)
+			: intersectPrimitive<EPrimitiveType::EGeneric>(tri, shape, idx, ray, t, miqr);
+
+		if (found) {
+			ray.maxt = t;
+			hitShape = shape;
+			miqr.f = miqr.idx;
+			foundIntersection = true;
+		}
+	}
+	return foundIntersection;
+}
+
+template <BVH::EPrimitiveType Type>
+bool BVH::occludedRange(IndexType start, IndexType end, const Ray3f &ray) const {
+	float t;
+	MeshIntersectionQueryRecord miqr;
+
+	uint32_t shapeIdx = 0;
+	for (IndexType i = start; i < end; ++i) {
+		const PrecomputedTriangle *tri;
+		IndexType idx;
+		EPrimitiveType type;
+		const Shape *shape = lookupPrimitive(i, tri, idx, type, shapeIdx);
+
+		if (intersectPrimitive<Type>(tri, shape, idx, ray, t, miqr))
+			return true;
+	}
+	return false;
+}
+
+bool BVH::occludedLeaf(const BVHNode &node, const Ray3f &ray) const {
+	switch ((EPrimitiveType) node.leaf.type) {
+		case EPrimitiveType::ESphere:
+			return occludedRange<EPrimitiveType::ESphere>(node.start(), node.end(), ray);
+		case EPrimitiveType::EGeneric:
+			return occludedRange<EPrimitiveType::EGeneric>(node.start(), node.end(), ray);
+		default:
+			return occludedRange<EPrimitiveType::ETriangle>(node.start(), node.end(), ray);
+	}
+}
+
+bool BVH::occludedPrimitives(IndexType start, IndexType end, const Ray3f &ray) const {
+	switch (m_sceneType) {
+		case EPrimitiveType::ETriangle:
+			return occludedRange<EPrimitiveType::ETriangle>(start, end, ray);
+		case EPrimitiveType::ESphere:
+			return occludedRange<EPrimitiveType::ESphere>(start, end, ray);
+		case EPrimitiveType::EGeneric:
+			return occludedRange<EPrimitiveType::EGeneric>(start, end, ray);
+		default:
+			break;
+	}
+
+	/* Several types of shapes, dispatch every primitive on its own */
+	float t;
+	MeshIntersectionQueryRecord miqr;
+	uint32_t shapeIdx = 0;
+	for (IndexType i = start; i < end; ++i) {
+		const PrecomputedTriangle *tri;
+		IndexType idx;
+		EPrimitiveType type;
+		const Shape *shape = lookupPrimitive(i, tri, idx, type, shapeIdx);
+
+		if (type == EPrimitiveType::ETriangle ? intersectPrimitive<EPrimitiveType::ETriangle>(tri, shape, idx, ray, t, miqr)
+			: type == EPrimitiveType::ESphere ? intersectPrimitive<EPrimitiveType::ESphere>(tri, shape, idx, ray, t, miqr)
+			: intersectPrimitive<EPrimitiveType::EGeneric>(tri, shape, idx, ray, t, miqr))
+			return true;
+	}
+	return false;
+}
+
+bool BVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	if (shadowRay)
+		return rayOccluded(ray);
+
+	float t;
+	MeshIntersectionQueryRecord miqr;
+	if (!rayIntersectPrimitive(ray, t, miqr, its.shape))
+		return false;
+
+	its.shape->updateIntersection(Ray3f(ray, ray.mint, t), its, &miqr);
+	return true;
+}
+
+bool BVH::rayIntersectPrimitive(const Ray3f &_ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const {
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	if (m_nodeCount == 0 || ray.maxt < ray.mint)
+		return false;
+
+	miqr.f = (IndexType)-1;
+	t = std::numeric_limits<float>::infinity();
+
+	return intersectSubtree(m_nodeData, 0u, ray, t, miqr, shape);
+}
+
+bool BVH::intersectSubtree(const BVHNode *nodes, IndexType node_idx, Ray3f &ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const {
+	IndexType stack_idx = 0, stack[64];
+	bool foundIntersection = false;
+
+	while (true) {
+		const BVHNode &node = nodes[node_idx];
+
+		if (!node.bbox.rayIntersect(ray)) {
+			if (stack_idx == 0)
+				break;
 			node_idx = stack[--stack_idx];
 			continue;
 		}
 
 		if (node.isInner()) {
-			stack[stack_idx++] = node.inner.rightChild;
-			node_idx++;
+			/* Visit the child on the near side of the split first */
+			if (ray.d[node.inner.axis] < 0) {
+				stack[stack_idx++] = node.inner.child;
+				node_idx = node.inner.child + 1;
+			}
+			else {
+				stack[stack_idx++] = node.inner.child + 1;
+				node_idx = node.inner.child;
+			}
 			assert(stack_idx<64);
 		}
 		else {
-			for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-				miqr.idx = m_indices[i];
-				const Shape *shape = m_shapes[findShape(miqr.idx)];
-
-				if(shape->rayIntersect(ray, t, &miqr)){
-				
-					if (shadowRay)
-						return true;
-
-					ray.maxt = t; 
-					its.shape = shape; 
-					miqr.f = miqr.idx; 
+			if (node.isLazy()) {
+				if (intersectSubtree(getLazySubtree(node.leaf.start), 0u, ray, t, miqr, shape))
 					foundIntersection = true;
-				}
 			}
+			else if (intersectLeaf(node, ray, t, miqr, shape))
+				foundIntersection = true;
 			if (stack_idx == 0)
 				break;
 			node_idx = stack[--stack_idx];
@@ -458,12 +2142,337 @@ bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) con
 		}
 	}
 
-	if (foundIntersection){
-		its.shape->updateIntersection(ray, its, &miqr);
+	return foundIntersection;
+}
+
+void BVH::rayIntersectPacket(int count, const Ray3f *rays, Intersection *its, bool *hit) const {
+	assert(count <= MAX_PACKET_SIZE);
+
+	/* The children are visited in the order given by the first ray,
+	   which is only the right order for all of them if they share
+	   the same direction octant */
+	bool coherent = count > 1 && m_nodeCount > 0;
+	for (int i = 1; i < count && coherent; ++i) {
+		for (int axis = 0; axis < 3; ++axis) {
+			if (std::signbit(rays[i].d[axis]) != std::signbit(rays[0].d[axis]))
+				coherent = false;
+		}
 	}
 
-	return foundIntersection;
+	if (!coherent) {
+		rayIntersectBatch(count, rays, its, hit);
+		return;
+	}
+
+	/* Per-ray state, plus a structure-of-arrays copy for the box tests.
+	   Unused lanes get an empty [mint, maxt] interval and never pass */
+	Ray3f ray[MAX_PACKET_SIZE];
+	float t[MAX_PACKET_SIZE];
+	MeshIntersectionQueryRecord miqr[MAX_PACKET_SIZE];
+	const Shape *shape[MAX_PACKET_SIZE];
+	bool found[MAX_PACKET_SIZE];
+
+	alignas(16) float o[3][MAX_PACKET_SIZE], dRcp[3][MAX_PACKET_SIZE];
+	alignas(16) float mint[MAX_PACKET_SIZE], maxt[MAX_PACKET_SIZE];
+	const int lanes = (count + 3) & ~3;
+	uint32_t mask = 0;
+
+	for (int i = 0; i < lanes; ++i) {
+		if (i < count) {
+			/* Use an adaptive ray epsilon */
+			ray[i] = rays[i];
+			adaptEpsilon(ray[i]);
+			t[i] = std::numeric_limits<float>::infinity();
+			miqr[i].f = (IndexType)-1;
+			found[i] = false;
+			hit[i] = false;
+			if (ray[i].mint <= ray[i].maxt)
+				mask |= 1u << i;
+		}
+		const Ray3f &r = ray[i < count ? i : 0];
+		for (int axis = 0; axis < 3; ++axis) {
+			o[axis][i] = r.o[axis];
+			dRcp[axis][i] = r.dRcp[axis];
+		}
+		mint[i] = i < count ? r.mint : std::numeric_limits<float>::infinity();
+		maxt[i] = i < count ? r.maxt : -std::numeric_limits<float>::infinity();
+	}
+
+	/* The near and far box planes are the same for all rays */
+	bool negative[3];
+	for (int axis = 0; axis < 3; ++axis)
+		negative[axis] = std::signbit(ray[0].d[axis]);
+
+	IndexType node_idx = 0, stack[64];
+	uint32_t stack_idx = 0, stackMask[64];
+
+	while (true) {
+		const BVHNode &node = m_nodeData[node_idx];
+
+		/* Test the node's bounding box against all active rays. As in the
+		   wide BVH, the operand order of the min/max operations makes slabs
+		   that produce NaNs fall back to the running interval */
+		float nearPlane[3], farPlane[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			nearPlane[axis] = negative[axis] ? node.bbox.max[axis] : node.bbox.min[axis];
+			farPlane[axis] = negative[axis] ? node.bbox.min[axis] : node.bbox.max[axis];
+		}
+
+		uint32_t hitMask = 0;
+#if defined(NORI_BVH_SSE)
+		for (int k = 0; k < lanes; k += 4) {
+			__m128 tMin = _mm_load_ps(mint + k), tMax = _mm_load_ps(maxt + k);
+			for (int axis = 0; axis < 3; ++axis) {
+				__m128 origin = _mm_load_ps(o[axis] + k), rcp = _mm_load_ps(dRcp[axis] + k);
+				__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearPlane[axis]), origin), rcp);
+				__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farPlane[axis]), origin), rcp);
+				tMin = _mm_max_ps(t0, tMin);
+				tMax = _mm_min_ps(t1, tMax);
+			}
+			hitMask |= (uint32_t) _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << k;
+		}
+#else
+		for (int i = 0; i < lanes; ++i) {
+			float tMin = mint[i], tMax = maxt[i];
+			for (int axis = 0; axis < 3; ++axis) {
+				float t0 = (nearPlane[axis] - o[axis][i]) * dRcp[axis][i];
+				float t1 = (farPlane[axis] - o[axis][i]) * dRcp[axis][i];
+				tMin = t0 > tMin ? t0 : tMin;
+				tMax = t1 < tMax ? t1 : tMax;
+			}
+			if (tMin <= tMax)
+				hitMask |= 1u << i;
+		}
+#endif
+		mask &= hitMask;
+
+		if (mask != 0 && (mask & (mask - 1)) == 0) {
+			/* Only one ray is left, continue without the packet overhead */
+			int i = 0;
+			while (!(mask & (1u << i)))
+				++i;
+			if (intersectSubtree(m_nodeData, node_idx, ray[i], t[i], miqr[i], shape[i]))
+				found[i] = true;
+			maxt[i] = ray[i].maxt;
+			mask = 0;
+		}
+		else if (mask != 0 && node.isInner()) {
+			/* Visit the child on the near side of the split first */
+			stackMask[stack_idx] = mask;
+			if (negative[node.inner.axis]) {
+				stack[stack_idx++] = node.inner.child;
+				node_idx = node.inner.child + 1;
+			}
+			else {
+				stack[stack_idx++] = node.inner.child + 1;
+				node_idx = node.inner.child;
+			}
+			assert(stack_idx < 64);
+			continue;
+		}
+		else if (mask != 0) {
+			const BVHNode *subtree = node.isLazy() ? getLazySubtree(node.leaf.start) : nullptr;
+			for (uint32_t m = mask; m; m &= m - 1) {
+				int i = 0;
+				while (!(m & (1u << i)))
+					++i;
+				if (subtree ? intersectSubtree(subtree, 0u, ray[i], t[i], miqr[i], shape[i])
+					: intersectLeaf(node, ray[i], t[i], miqr[i], shape[i]))
+					found[i] = true;
+				maxt[i] = ray[i].maxt;
+			}
+		}
+
+		if (stack_idx == 0)
+			break;
+		--stack_idx;
+		node_idx = stack[stack_idx];
+		mask = stackMask[stack_idx];
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (!found[i])
+			continue;
+		its[i].shape = shape[i];
+		shape[i]->updateIntersection(Ray3f(rays[i], rays[i].mint, t[i]), its[i], &miqr[i]);
+		hit[i] = true;
+	}
 }
 
-NORI_NAMESPACE_END
+/// Traversal state of one ray in \ref BVH::intersectInterleaved()
+struct InterleavedRay {
+	Ray3f ray;
+	float t;
+	MeshIntersectionQueryRecord miqr;
+	const Shape *shape;
+	bool found;
+	bool leafPending;  ///< The current node is a leaf whose primitives were prefetched
+	IndexType node_idx, stack_idx, stack[64];
+};
+
+void BVH::rayIntersectBatch(int count, const Ray3f *rays, Intersection *its, bool *hit) const {
+	if (m_interleave == 1 || m_nodeCount == 0) {
+		Accel::rayIntersectBatch(count, rays, its, hit);
+		return;
+	}
+
+	for (int first = 0; first < count; first += m_interleave)
+		intersectInterleaved(std::min(m_interleave, count - first), rays + first, its + first, hit + first);
+}
+
+void BVH::prefetchPrimitives(const BVHNode &node) const {
+#if defined(NORI_BVH_SSE)
+	if (!m_triangles.empty()) {
+		const char *begin = (const char *) (m_triangles.data() + node.start());
+		const char *end = (const char *) (m_triangles.data() + node.end());
+		for (const char *ptr = begin; ptr < end; ptr += 64)
+			_mm_prefetch(ptr, _MM_HINT_T0);
+	}
+	else {
+		/* The vertices can only be located once the indices are known */
+		_mm_prefetch((const char *) (m_indexData + node.start()), _MM_HINT_T0);
+	}
+#endif
+}
+
+void BVH::intersectInterleaved(int count, const Ray3f *rays, Intersection *its, bool *hit) const {
+	assert(count <= MAX_INTERLEAVE);
+
+	InterleavedRay state[MAX_INTERLEAVE];
+	int active[MAX_INTERLEAVE], activeCount = 0;
+
+	auto prefetchNode = [&](IndexType node_idx) {
+#if defined(NORI_BVH_SSE)
+		_mm_prefetch((const char *) (m_nodeData + node_idx), _MM_HINT_T0);
+#endif
+	};
+
+	/* Continue with the next node on the stack, returns false once the traversal is complete */
+	auto pop = [&](InterleavedRay &s) {
+		if (s.stack_idx == 0)
+			return false;
+		s.node_idx = s.stack[--s.stack_idx];
+		prefetchNode(s.node_idx);
+		return true;
+	};
+
+	for (int i = 0; i < count; ++i) {
+		InterleavedRay &s = state[i];
+
+		/* Use an adaptive ray epsilon */
+		s.ray = rays[i];
+		adaptEpsilon(s.ray);
+		s.t = std::numeric_limits<float>::infinity();
+		s.miqr.f = (IndexType)-1;
+		s.found = false;
+		s.leafPending = false;
+		s.node_idx = s.stack_idx = 0;
+		hit[i] = false;
+		if (s.ray.mint <= s.ray.maxt)
+			active[activeCount++] = i;
+	}
+	prefetchNode(0u);
+
+	/* Every round advances each active ray by one node, the
+	   visit order of the nodes is the same as in intersectSubtree() */
+	while (activeCount > 0) {
+		for (int k = 0; k < activeCount;) {
+			InterleavedRay &s = state[active[k]];
+			const BVHNode &node = m_nodeData[s.node_idx];
+			bool running = true;
+
+			if (s.leafPending) {
+				if (intersectLeaf(node, s.ray, s.t, s.miqr, s.shape))
+					s.found = true;
+				s.leafPending = false;
+				running = pop(s);
+			}
+			else if (!node.bbox.rayIntersect(s.ray)) {
+				running = pop(s);
+			}
+			else if (node.isInner()) {
+				/* Visit the child on the near side of the split first */
+				if (s.ray.d[node.inner.axis] < 0) {
+					s.stack[s.stack_idx++] = node.inner.child;
+					s.node_idx = node.inner.child + 1;
+				}
+				else {
+					s.stack[s.stack_idx++] = node.inner.child + 1;
+					s.node_idx = node.inner.child;
+				}
+				assert(s.stack_idx < 64);
+				prefetchNode(s.node_idx);
+			}
+			else if (node.isLazy()) {
+				if (intersectSubtree(getLazySubtree(node.leaf.start), 0u, s.ray, s.t, s.miqr, s.shape))
+					s.found = true;
+				running = pop(s);
+			}
+			else {
+				/* Intersect the primitives in this ray's next turn */
+				prefetchPrimitives(node);
+				s.leafPending = true;
+			}
+
+			if (running)
+				++k;
+			else
+				active[k] = active[--activeCount];
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		const InterleavedRay &s = state[i];
+		if (!s.found)
+			continue;
+		its[i].shape = s.shape;
+		s.shape->updateIntersection(Ray3f(rays[i], rays[i].mint, s.t), its[i], &s.miqr);
+		hit[i] = true;
+	}
+}
+
+bool BVH::rayOccluded(const Ray3f &_ray) const {
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	if (m_nodeCount == 0 || ray.maxt < ray.mint)
+		return false;
+
+	return occludedSubtree(m_nodeData, 0u, ray);
+}
+
+bool BVH::occludedSubtree(const BVHNode *nodes, IndexType node_idx, const Ray3f &ray) const {
+	IndexType stack_idx = 0, stack[64];
+
+	while (true) {
+		const BVHNode &node = nodes[node_idx];
+
+		if (node.bbox.rayIntersect(ray)) {
+			if (node.isInner()) {
+				if (ray.d[node.inner.axis] < 0) {
+					stack[stack_idx++] = node.inner.child;
+					node_idx = node.inner.child + 1;
+				}
+				else {
+					stack[stack_idx++] = node.inner.child + 1;
+					node_idx = node.inner.child;
+				}
+				assert(stack_idx<64);
+				continue;
+			}
+
+			if (node.isLazy() ? occludedSubtree(getLazySubtree(node.leaf.start), 0u, ray)
+				: occludedLeaf(node, ray))
+				return true;
+		}
+
+		if (stack_idx == 0)
+			break;
+		node_idx = stack[--stack_idx];
+	}
+
+	return false;
+}
 
+NORI_NAMESPACE_END
\ No newline at end of file
@@ -0,0 +1,424 @@
+#include <nori/accelerators/kdtree.h>
+#include <nori/core/timer.h>
+#include <tbb/tbb.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+* \brief Parallel binned SAH kd-tree builder
+*
+* Every node bins its references along all three axes: a reference is
+* counted in \c starts at the bin of its minimum, and in \c ends at the bin
+* of its maximum. A single sweep over these counts then yields the number
+* of references below and above every bin boundary, which are the candidate
+* split planes. This is roughly the approach of
+*
+* "On fast Construction of SAH-based Bounding Volume Hierarchies"
+* by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
+*
+* applied to kd-trees, see also "Highly Parallel Fast KD-tree Construction
+* for Interactive Ray Tracing of Dynamic Scenes" by Maxim Shevtsov, Alexei
+* Soupikov and Alexander Kapustin (Eurographics 2007).
+*
+* The two halves of a split are built in parallel. Their nodes and leaf
+* indices are appended to concurrent vectors in whatever order the tasks
+* finish, so \ref layout() finally rewrites them in depth-first order.
+*/
+class KDTreeBuilder {
+public:
+	/// Build-related parameters
+	enum {
+		/// Number of bins per axis used to evaluate split planes
+		BINS = 32,
+
+		/// Build subtrees with more references than this in parallel
+		TASK_THRESHOLD = 4096,
+
+		/// Number of references processed by one task when setting up the build
+		GRAIN_SIZE = 1000,
+
+		/// Cost of traversing an inner node
+		TRAVERSAL_COST = 1
+	};
+
+	/// Primitive reference with a bounding box clipped to the current node
+	struct Reference {
+		IndexType prim;
+		BoundingBox3f bbox;
+	};
+
+	KDTreeBuilder(KDTree &tree) : tree(tree) {
+		/* Depth limit of pbrt: 8 + 1.3 log2(N) */
+		float size = (float) std::max(tree.getTriangleCount(), (IndexType) 1);
+		maxDepth = std::min((int) KDTree::MAX_DEPTH, (int) (8 + 1.3f * std::log2(size)));
+	}
+
+	/// Build the tree into the node and index arrays of the kd-tree
+	void build() {
+		IndexType size = tree.getTriangleCount();
+		std::vector<Reference> refs(size);
+		tbb::parallel_for(
+			tbb::blocked_range<IndexType>(0u, size, GRAIN_SIZE),
+			[&](const tbb::blocked_range<IndexType> &range) {
+			for (IndexType i = range.begin(); i != range.end(); ++i) {
+				refs[i].prim = i;
+				refs[i].bbox = tree.getBoundingBox(i);
+			}
+		}
+		);
+
+		IndexType root = (IndexType) (nodes.grow_by(1) - nodes.begin());
+		buildNode(root, refs, tree.m_bbox, 0);
+		layout(root);
+	}
+
+private:
+	/// Recursively build the subtree of \c node_id over \c refs (which are released)
+	void buildNode(IndexType node_id, std::vector<Reference> &refs, const BoundingBox3f &bbox, int depth) {
+		IndexType size = (IndexType) refs.size();
+		float leafCost = tree.m_intersectionCost * size;
+		float nodeArea = bbox.getSurfaceArea();
+
+		int bestAxis = -1;
+		float bestPos = 0.f, bestCost = leafCost;
+
+		for (int axis = 0; axis < 3 && size > 0 && depth < maxDepth && nodeArea > 0; ++axis) {
+			float extent = bbox.max[axis] - bbox.min[axis];
+			if (extent <= 0)
+				continue;
+
+			IndexType starts[BINS] = { 0 }, ends[BINS] = { 0 };
+			float scale = BINS / extent;
+			for (const Reference &ref : refs) {
+				starts[binIndex(ref.bbox.min[axis], bbox.min[axis], scale)]++;
+				ends[binIndex(ref.bbox.max[axis], bbox.min[axis], scale)]++;
+			}
+
+			/* Sweep over the bin boundaries, references which start in a
+			   lower bin are below the plane, and those which end in this
+			   or a higher bin are above it */
+			IndexType below = 0, above = size;
+			for (int b = 1; b < BINS; ++b) {
+				below += starts[b - 1];
+				above -= ends[b - 1];
+
+				float pos = bbox.min[axis] + extent * b / BINS;
+				BoundingBox3f lower = bbox, upper = bbox;
+				lower.max[axis] = upper.min[axis] = pos;
+
+				float cost = TRAVERSAL_COST + tree.m_intersectionCost *
+					(lower.getSurfaceArea() * below + upper.getSurfaceArea() * above) / nodeArea;
+				if (below == 0 || above == 0)
+					cost *= 1.f - tree.m_emptyBonus;
+
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestPos = pos;
+				}
+			}
+		}
+
+		if (bestAxis == -1) {
+			/* Splitting does not reduce the cost, make a leaf */
+			makeLeaf(node_id, refs);
+			return;
+		}
+
+		/* References which touch the plane go to both sides, clipped to their half */
+		std::vector<Reference> left, right;
+		for (const Reference &ref : refs) {
+			if (ref.bbox.min[bestAxis] <= bestPos) {
+				left.push_back(ref);
+				left.back().bbox.max[bestAxis] = std::min(ref.bbox.max[bestAxis], bestPos);
+			}
+			if (ref.bbox.max[bestAxis] >= bestPos) {
+				right.push_back(ref);
+				right.back().bbox.min[bestAxis] = std::max(ref.bbox.min[bestAxis], bestPos);
+			}
+		}
+
+		if (left.size() == size && right.size() == size) {
+			/* All references straddle the plane, splitting would not make any progress */
+			makeLeaf(node_id, refs);
+			return;
+		}
+
+		/* Release the parent's references before descending */
+		std::vector<Reference>().swap(refs);
+
+		IndexType node_id_left = (IndexType) (nodes.grow_by(2) - nodes.begin());
+		IndexType node_id_right = node_id_left + 1;
+
+		KDTree::KDNode &node = nodes[node_id];
+		node.split = bestPos;
+		node.axis = (IndexType) bestAxis;
+		node.data = node_id_left;
+
+		BoundingBox3f bboxLeft = bbox, bboxRight = bbox;
+		bboxLeft.max[bestAxis] = bboxRight.min[bestAxis] = bestPos;
+
+		auto buildLeft = [&] {
+			buildNode(node_id_left, left, bboxLeft, depth + 1);
+		};
+		auto buildRight = [&] {
+			buildNode(node_id_right, right, bboxRight, depth + 1);
+		};
+
+		if (size > TASK_THRESHOLD) {
+			tbb::parallel_invoke(buildLeft, buildRight);
+		}
+		else {
+			buildLeft();
+			buildRight();
+		}
+	}
+
+	/// Return the bin of coordinate \c value
+	static int binIndex(float value, float min, float scale) {
+		return std::min(std::max((int) ((value - min) * scale), 0), (int) BINS - 1);
+	}
+
+	/// Turn \c node_id into a leaf referencing \c refs
+	void makeLeaf(IndexType node_id, const std::vector<Reference> &refs) {
+		IndexType size = (IndexType) refs.size();
+		IndexType start = 0;
+		if (size > 0) {
+			start = (IndexType) (indices.grow_by(size) - indices.begin());
+			for (IndexType i = 0; i < size; ++i)
+				indices[start + i] = refs[i].prim;
+		}
+
+		KDTree::KDNode &node = nodes[node_id];
+		node.start = start;
+		node.axis = KDTree::KDNode::LEAF;
+		node.data = size;
+	}
+
+	/// Copy the tree below \c root into the kd-tree in depth-first order
+	void layout(IndexType root) {
+		tree.m_kdNodes.resize(nodes.size());
+		tree.m_indices.clear();
+		tree.m_indices.reserve(indices.size());
+
+		tree.m_kdNodes[0] = nodes[root];
+		IndexType next = 1;
+		emit(0, next);
+
+		/* The concurrent vectors are not needed anymore */
+		tbb::concurrent_vector<KDTree::KDNode>().swap(nodes);
+		tbb::concurrent_vector<IndexType>().swap(indices);
+	}
+
+	/// Recursive helper of \ref layout(): node \c idx was copied, but still refers to builder ids
+	void emit(IndexType idx, IndexType &next) {
+		KDTree::KDNode &node = tree.m_kdNodes[idx];
+		if (node.isLeaf()) {
+			IndexType start = (IndexType) tree.m_indices.size();
+			for (IndexType i = 0; i < node.data; ++i)
+				tree.m_indices.push_back(indices[node.start + i]);
+			node.start = start;
+			return;
+		}
+
+		IndexType child = node.data, pair = next;
+		next += 2;
+		tree.m_kdNodes[pair] = nodes[child];
+		tree.m_kdNodes[pair + 1] = nodes[child + 1];
+		node.data = pair;
+
+		emit(pair, next);
+		emit(pair + 1, next);
+	}
+
+	KDTree &tree;
+	int maxDepth;
+	tbb::concurrent_vector<KDTree::KDNode> nodes;  ///< Nodes, in allocation order
+	tbb::concurrent_vector<IndexType> indices;     ///< Leaf references, in allocation order
+};
+
+void KDTree::build() {
+	m_kdNodes.clear();
+	if (getTriangleCount() == 0)
+		return;
+
+	IndexType size = getTriangleCount();
+	cout << "Constructing a SAH kd-tree (" << m_shapes.size()
+		<< (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+		<< size << " triangles) .. ";
+	cout.flush();
+	Timer timer;
+
+	if (sizeof(KDNode) != 2 * sizeof(IndexType))
+		throw NoriException("kd-tree node is not packed! Investigate compiler settings.");
+
+	KDTreeBuilder builder(*this);
+	builder.build();
+	m_kdNodes.shrink_to_fit();
+	m_indices.shrink_to_fit();
+	useBuiltTree();
+	m_builtCost = getSAHCost();
+
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(KDNode) * m_kdNodes.size() + sizeof(IndexType) * m_indexCount)
+		<< ", " << m_kdNodes.size() << " nodes, " << m_indexCount << " references"
+		<< ", SAH cost = " << m_builtCost << ")." << endl;
+
+	if (m_precomputeTriangles)
+		precomputeTriangles();
+}
+
+void KDTree::refit() {
+	if (getTriangleCount() == 0)
+		return;
+
+	/* The shapes already recomputed their bounding boxes */
+	m_bbox.reset();
+	for (const Shape *shape : m_shapes)
+		m_bbox.expandBy(shape->getBoundingBox());
+
+	build();
+}
+
+float KDTree::getSAHCost() const {
+	if (m_kdNodes.empty())
+		return 0.f;
+	return getSAHCost(0u, m_bbox);
+}
+
+float KDTree::getSAHCost(IndexType idx, const BoundingBox3f &bbox) const {
+	const KDNode &node = m_kdNodes[idx];
+	if (node.isLeaf())
+		return m_intersectionCost * node.data;
+
+	BoundingBox3f lower = bbox, upper = bbox;
+	lower.max[node.axis] = upper.min[node.axis] = node.split;
+
+	return KDTreeBuilder::TRAVERSAL_COST +
+		(lower.getSurfaceArea() * getSAHCost(node.data, lower) +
+		 upper.getSurfaceArea() * getSAHCost(node.data + 1, upper)) / bbox.getSurfaceArea();
+}
+
+bool KDTree::clipRay(const Ray3f &ray, float &mint, float &maxt) const {
+	float nearT, farT;
+	if (m_kdNodes.empty() || !m_bbox.rayIntersect(ray, nearT, farT))
+		return false;
+
+	mint = std::max(nearT, ray.mint);
+	maxt = std::min(farT, ray.maxt);
+	return mint <= maxt;
+}
+
+bool KDTree::rayIntersectPrimitive(const Ray3f &_ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const {
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	float mint, maxt;
+	if (!clipRay(ray, mint, maxt))
+		return false;
+
+	miqr.f = (IndexType)-1;
+	t = std::numeric_limits<float>::infinity();
+
+	StackEntry stack[MAX_DEPTH];
+	int stack_idx = 0;
+	IndexType node_idx = 0;
+	bool foundIntersection = false;
+
+	while (true) {
+		/* The leaves are visited front to back, so nothing
+		   closer than the current hit can be left */
+		if (ray.maxt < mint)
+			break;
+
+		const KDNode &node = m_kdNodes[node_idx];
+		if (!node.isLeaf()) {
+			int axis = (int) node.axis;
+			float tPlane = (node.split - ray.o[axis]) * ray.dRcp[axis];
+			bool belowFirst = ray.o[axis] < node.split ||
+				(ray.o[axis] == node.split && ray.d[axis] <= 0);
+			IndexType first = node.data + (belowFirst ? 0 : 1);
+			IndexType second = node.data + (belowFirst ? 1 : 0);
+
+			if (tPlane > maxt || tPlane <= 0) {
+				node_idx = first;
+			}
+			else if (tPlane < mint) {
+				node_idx = second;
+			}
+			else {
+				stack[stack_idx++] = StackEntry { second, tPlane, maxt };
+				node_idx = first;
+				maxt = tPlane;
+			}
+			continue;
+		}
+
+		if (intersectPrimitives(node.start, node.start + node.data, ray, t, miqr, shape))
+			foundIntersection = true;
+
+		if (stack_idx == 0)
+			break;
+		const StackEntry &entry = stack[--stack_idx];
+		node_idx = entry.node;
+		mint = entry.mint;
+		maxt = entry.maxt;
+	}
+
+	return foundIntersection;
+}
+
+bool KDTree::rayOccluded(const Ray3f &_ray) const {
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	float mint, maxt;
+	if (!clipRay(ray, mint, maxt))
+		return false;
+
+	StackEntry stack[MAX_DEPTH];
+	int stack_idx = 0;
+	IndexType node_idx = 0;
+
+	while (true) {
+		const KDNode &node = m_kdNodes[node_idx];
+		if (!node.isLeaf()) {
+			int axis = (int) node.axis;
+			float tPlane = (node.split - ray.o[axis]) * ray.dRcp[axis];
+			bool belowFirst = ray.o[axis] < node.split ||
+				(ray.o[axis] == node.split && ray.d[axis] <= 0);
+			IndexType first = node.data + (belowFirst ? 0 : 1);
+			IndexType second = node.data + (belowFirst ? 1 : 0);
+
+			if (tPlane > maxt || tPlane <= 0) {
+				node_idx = first;
+			}
+			else if (tPlane < mint) {
+				node_idx = second;
+			}
+			else {
+				stack[stack_idx++] = StackEntry { second, tPlane, maxt };
+				node_idx = first;
+				maxt = tPlane;
+			}
+			continue;
+		}
+
+		if (occludedPrimitives(node.start, node.start + node.data, ray))
+			return true;
+
+		if (stack_idx == 0)
+			break;
+		const StackEntry &entry = stack[--stack_idx];
+		node_idx = entry.node;
+		mint = entry.mint;
+		maxt = entry.maxt;
+	}
+
+	return false;
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,139 @@
+#include <nori/accelerators/raystream.h>
+#include <nori/core/scene.h>
+#include <nori/shapes/shape.h>
+#include <algorithm>
+#include <atomic>
+
+NORI_NAMESPACE_BEGIN
+
+/* Coherence statistics, accumulated over all streams and threads */
+static std::atomic<uint64_t> sortedRays(0);
+static std::atomic<uint64_t> rayPairs(0);
+static std::atomic<uint64_t> coherentPairsBefore(0);
+static std::atomic<uint64_t> coherentPairsAfter(0);
+
+void RayStream::clear() {
+	m_rays.clear();
+	m_order.clear();
+	m_keys.clear();
+}
+
+uint32_t RayStream::add(const Ray3f &ray) {
+	m_rays.push_back(ray);
+	return (uint32_t) m_rays.size() - 1;
+}
+
+uint64_t RayStream::sortKey(const Ray3f &ray, const BoundingBox3f &bbox) {
+	/* Origin cell on a 1024^3 grid over the scene */
+	Vector3f extents = bbox.getExtents();
+	uint32_t cell[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		float rel = extents[axis] > 0 ? (ray.o[axis] - bbox.min[axis]) / extents[axis] : 0.f;
+		cell[axis] = (uint32_t) clamp((int) (rel * 1024.f), 0, 1023);
+	}
+
+	uint32_t octant = (ray.d.x() < 0 ? 4 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 1 : 0);
+
+	return ((uint64_t) mortonCode3D(cell[0], cell[1], cell[2]) << 3) | octant;
+}
+
+uint64_t RayStream::countCoherentPairs(const uint64_t *keys, uint32_t count) {
+	/* Compare on a coarser 16^3 grid, i.e. the top 4 bits per axis of the Morton code */
+	auto coarse = [](uint64_t key) { return ((key >> 21) << 3) | (key & 7); };
+
+	uint64_t coherent = 0;
+	for (uint32_t i = 1; i < count; ++i) {
+		if (coarse(keys[i - 1]) == coarse(keys[i]))
+			coherent++;
+	}
+	return coherent;
+}
+
+void RayStream::sort(const BoundingBox3f &bbox) {
+	uint32_t count = size();
+	m_order.resize(count);
+	m_keys.resize(count);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		m_order[i] = i;
+		m_keys[i] = sortKey(m_rays[i], bbox);
+	}
+
+	uint64_t before = countCoherentPairs(m_keys.data(), count);
+
+	/* Ties are broken by the insertion index to keep the order deterministic */
+	std::sort(m_order.begin(), m_order.end(), [&](uint32_t a, uint32_t b) {
+		return m_keys[a] < m_keys[b] || (m_keys[a] == m_keys[b] && a < b);
+	});
+
+	std::vector<uint64_t> sortedKeys(count);
+	for (uint32_t i = 0; i < count; ++i)
+		sortedKeys[i] = m_keys[m_order[i]];
+
+	uint64_t after = countCoherentPairs(sortedKeys.data(), count);
+
+	if (count > 1) {
+		sortedRays += count;
+		rayPairs += count - 1;
+		coherentPairsBefore += before;
+		coherentPairsAfter += after;
+	}
+}
+
+void RayStream::intersect(const Scene *scene, Intersection *its, bool *hit) const {
+	uint32_t count = size();
+	if (m_order.empty()) {
+		scene->rayIntersectBatch((int) count, m_rays.data(), its, hit);
+		return;
+	}
+
+	/* Trace the rays in sorted batches, and scatter the results */
+	Ray3f rays[BATCH_SIZE];
+	Intersection batchIts[BATCH_SIZE];
+	bool batchHit[BATCH_SIZE];
+
+	for (uint32_t first = 0; first < count; first += BATCH_SIZE) {
+		uint32_t batchSize = std::min((uint32_t) BATCH_SIZE, count - first);
+		for (uint32_t i = 0; i < batchSize; ++i)
+			rays[i] = m_rays[m_order[first + i]];
+
+		scene->rayIntersectBatch((int) batchSize, rays, batchIts, batchHit);
+
+		for (uint32_t i = 0; i < batchSize; ++i) {
+			uint32_t index = m_order[first + i];
+			hit[index] = batchHit[i];
+			if (batchHit[i])
+				its[index] = batchIts[i];
+		}
+	}
+}
+
+void RayStream::occluded(const Scene *scene, bool *occluded) const {
+	uint32_t count = size();
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t index = m_order.empty() ? i : m_order[i];
+		occluded[index] = scene->rayIntersect(m_rays[index]);
+	}
+}
+
+void RayStream::resetStatistics() {
+	sortedRays = 0;
+	rayPairs = 0;
+	coherentPairsBefore = 0;
+	coherentPairsAfter = 0;
+}
+
+std::string RayStream::getStatistics() {
+	uint64_t pairs = rayPairs;
+	if (pairs == 0)
+		return "Ray streams: no rays were sorted";
+
+	/* Fraction of consecutive rays starting in the same cell of a 16^3
+	   grid over the scene and pointing into the same octant */
+	return tfm::format("Ray streams: %i rays sorted, coherence %.1f%% -> %.1f%%",
+		(uint64_t) sortedRays,
+		100.0 * (double) coherentPairsBefore / (double) pairs,
+		100.0 * (double) coherentPairsAfter / (double) pairs);
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,498 @@
+#include <nori/accelerators/widebvh.h>
+#include <nori/core/timer.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NORI_WBVH_SSE
+#include <immintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+template <int Width> void WideBVH<Width>::build() {
+	BVH::build();
+
+	m_wideNodes.clear();
+	m_quantizedNodes8.clear();
+	m_quantizedNodes16.clear();
+	if (m_nodeCount == 0)
+		return;
+
+	cout << "Collapsing into a " << Width << "-wide BVH .. ";
+	cout.flush();
+	Timer timer;
+
+	collapse(0u);
+
+	/* The binary nodes are not used by the wide traversal anymore */
+	m_nodes.clear();
+	m_nodes.shrink_to_fit();
+	m_nodeData = nullptr;
+	m_nodeCount = 0;
+	m_wideNodes.shrink_to_fit();
+
+	if (m_quantization == 8)
+		quantize(m_quantizedNodes8);
+	else if (m_quantization == 16)
+		quantize(m_quantizedNodes16);
+
+	m_builtCost = getSAHCost();
+
+	std::pair<size_t, size_t> memory = getNodeMemory();
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(memory.second) << ", " << memory.first << " nodes";
+	if (m_quantization != 0)
+		cout << " with " << m_quantization << " bit bounds";
+	cout << ")." << endl;
+}
+
+template <int Width> template <typename Node> void WideBVH<Width>::quantize(std::vector<Node> &nodes) {
+	nodes.resize(m_wideNodes.size());
+	for (size_t idx = 0; idx < m_wideNodes.size(); ++idx) {
+		const WideNode &wide = m_wideNodes[idx];
+		BoundingBox3f bbox[Width];
+		for (int i = 0; i < Width; ++i) {
+			bbox[i] = getChildBounds(wide, i);
+			nodes[idx].child[i] = wide.child[i];
+			nodes[idx].count[i] = wide.count[i];
+		}
+		setChildBounds(nodes[idx], bbox);
+	}
+
+	m_wideNodes.clear();
+	m_wideNodes.shrink_to_fit();
+}
+
+template <int Width> std::pair<size_t, size_t> WideBVH<Width>::getNodeMemory() const {
+	if (m_quantization == 8)
+		return std::make_pair(m_quantizedNodes8.size(), sizeof(QuantizedNode8) * m_quantizedNodes8.size());
+	else if (m_quantization == 16)
+		return std::make_pair(m_quantizedNodes16.size(), sizeof(QuantizedNode16) * m_quantizedNodes16.size());
+	return std::make_pair(m_wideNodes.size(), sizeof(WideNode) * m_wideNodes.size());
+}
+
+template <int Width> void WideBVH<Width>::setChildBounds(WideNode &node, const BoundingBox3f *bbox) {
+	const float inf = std::numeric_limits<float>::infinity();
+	for (int i = 0; i < Width; ++i) {
+		for (int axis = 0; axis < 3; ++axis) {
+			node.bounds[axis][i] = bbox[i].isValid() ? bbox[i].min[axis] : inf;
+			node.bounds[axis + 3][i] = bbox[i].isValid() ? bbox[i].max[axis] : -inf;
+		}
+	}
+}
+
+template <int Width> template <typename T>
+void WideBVH<Width>::setChildBounds(QuantizedNode<T> &node, const BoundingBox3f *bbox) {
+	typedef QuantizedNode<T> Node;
+
+	BoundingBox3f nodeBounds;
+	node.validMask = 0;
+	for (int i = 0; i < Width; ++i) {
+		if (bbox[i].isValid()) {
+			nodeBounds.expandBy(bbox[i]);
+			node.validMask |= 1 << i;
+		}
+	}
+
+	for (int axis = 0; axis < 3; ++axis) {
+		float min = nodeBounds.isValid() ? nodeBounds.min[axis] : 0.f;
+		float max = nodeBounds.isValid() ? nodeBounds.max[axis] : 0.f;
+
+		/* Smallest power of two spacing for which QMAX steps cover the node */
+		int exponent = -126;
+		if (max > min) {
+			std::frexp((max - min) / (float) Node::QMAX, &exponent);
+			exponent = std::max(exponent - 1, -126);
+		}
+		node.origin[axis] = min;
+		node.exponent[axis] = (int8_t) exponent;
+		while (dequantize(node, axis, Node::QMAX) < max)
+			node.exponent[axis]++;
+	}
+
+	/* Round outwards, then correct for the rounding of the decoder */
+	for (int i = 0; i < Width; ++i) {
+		if (!(node.validMask & (1 << i))) {
+			for (int axis = 0; axis < 3; ++axis) {
+				node.bounds[axis][i] = (T) Node::QMAX;
+				node.bounds[axis + 3][i] = 0;
+			}
+			continue;
+		}
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float scale = std::ldexp(1.f, -node.exponent[axis]);
+			int64_t lo = (int64_t) std::floor((bbox[i].min[axis] - node.origin[axis]) * scale);
+			int64_t hi = (int64_t) std::ceil((bbox[i].max[axis] - node.origin[axis]) * scale);
+			lo = std::min(std::max(lo, (int64_t) 0), (int64_t) Node::QMAX);
+			hi = std::min(std::max(hi, (int64_t) 0), (int64_t) Node::QMAX);
+			while (lo > 0 && dequantize(node, axis, (uint32_t) lo) > bbox[i].min[axis])
+				--lo;
+			while (hi < Node::QMAX && dequantize(node, axis, (uint32_t) hi) < bbox[i].max[axis])
+				++hi;
+			node.bounds[axis][i] = (T) lo;
+			node.bounds[axis + 3][i] = (T) hi;
+		}
+	}
+}
+
+template <int Width> void WideBVH<Width>::refitNodes() {
+	if (m_quantization == 8)
+		refitNodes(m_quantizedNodes8);
+	else if (m_quantization == 16)
+		refitNodes(m_quantizedNodes16);
+	else
+		refitNodes(m_wideNodes);
+}
+
+template <int Width> template <typename Node> void WideBVH<Width>::refitNodes(std::vector<Node> &nodes) {
+	/* Nodes are created before their children by collapse(),
+	   so a reverse sweep visits the children first */
+	for (int64_t idx = (int64_t) nodes.size() - 1; idx >= 0; --idx) {
+		Node &node = nodes[idx];
+		BoundingBox3f bbox[Width];
+		for (int i = 0; i < Width; ++i) {
+			if (node.count[i] > 0) {
+				for (IndexType j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+					bbox[i].expandBy(getBoundingBox(m_indexData[j]));
+			}
+			else if (node.child[i] != 0) {
+				const Node &child = nodes[node.child[i]];
+				for (int k = 0; k < Width; ++k)
+					bbox[i].expandBy(getChildBounds(child, k));
+			}
+		}
+		setChildBounds(node, bbox);
+	}
+
+	m_bbox.reset();
+	for (int i = 0; i < Width; ++i)
+		m_bbox.expandBy(getChildBounds(nodes[0], i));
+}
+
+template <int Width> float WideBVH<Width>::getSAHCost() const {
+	BoundingBox3f bbox;
+	if (m_quantization == 8)
+		return m_quantizedNodes8.empty() ? 0.f : getSAHCost(m_quantizedNodes8, 0u, bbox);
+	else if (m_quantization == 16)
+		return m_quantizedNodes16.empty() ? 0.f : getSAHCost(m_quantizedNodes16, 0u, bbox);
+	return m_wideNodes.empty() ? 0.f : getSAHCost(m_wideNodes, 0u, bbox);
+}
+
+template <int Width> template <typename Node> float WideBVH<Width>::getSAHCost(
+		const std::vector<Node> &nodes, IndexType idx, BoundingBox3f &bbox) const {
+	/* Same unit traversal and intersection costs as the binary builder */
+	const Node &node = nodes[idx];
+	float weightedCost = 0.f;
+	int childCount = 0;
+	bbox.reset();
+
+	for (int i = 0; i < Width; ++i) {
+		BoundingBox3f childBounds;
+		float childCost;
+		if (node.count[i] > 0) {
+			childBounds = getChildBounds(node, i);
+			childCost = (float) node.count[i];
+		}
+		else if (node.child[i] != 0) {
+			childCost = getSAHCost(nodes, node.child[i], childBounds);
+		}
+		else {
+			continue;
+		}
+		if (!childBounds.isValid())
+			continue;
+		weightedCost += childBounds.getSurfaceArea() * childCost;
+		bbox.expandBy(childBounds);
+		childCount++;
+	}
+
+	return childCount == 0 ? 0.f : childCount + weightedCost / bbox.getSurfaceArea();
+}
+
+template <int Width> IndexType WideBVH<Width>::collapse(IndexType binIdx) {
+	IndexType idx = (IndexType) m_wideNodes.size();
+	m_wideNodes.emplace_back();
+
+	/* Gather up to 'Width' children by repeatedly opening
+	   the inner child with the largest surface area */
+	IndexType children[Width];
+	int childCount = 0;
+
+	const BVHNode &root = m_nodeData[binIdx];
+	if (root.isLeaf()) {
+		children[childCount++] = binIdx;
+	}
+	else {
+		children[childCount++] = root.inner.child;
+		children[childCount++] = root.inner.child + 1;
+	}
+
+	while (childCount < Width) {
+		int best = -1;
+		float bestArea = -1.f;
+		for (int i = 0; i < childCount; ++i) {
+			const BVHNode &node = m_nodeData[children[i]];
+			if (node.isInner() && node.bbox.getSurfaceArea() > bestArea) {
+				bestArea = node.bbox.getSurfaceArea();
+				best = i;
+			}
+		}
+		if (best == -1)
+			break;
+
+		IndexType opened = children[best];
+		children[best] = m_nodeData[opened].inner.child;
+		children[childCount++] = m_nodeData[opened].inner.child + 1;
+	}
+
+	/* Fill in the child slots. Note that the recursion may reallocate
+	   m_wideNodes, hence the node is only looked up by index */
+	const float inf = std::numeric_limits<float>::infinity();
+	for (int i = 0; i < Width; ++i) {
+		m_wideNodes[idx].child[i] = 0;
+		m_wideNodes[idx].count[i] = 0;
+		for (int axis = 0; axis < 3; ++axis) {
+			m_wideNodes[idx].bounds[axis][i] = inf;
+			m_wideNodes[idx].bounds[axis + 3][i] = -inf;
+		}
+	}
+
+	for (int i = 0; i < childCount; ++i) {
+		const BVHNode &node = m_nodeData[children[i]];
+		if (node.isLeaf() && node.leaf.size == 0)
+			continue;
+
+		IndexType child, count;
+		if (node.isLeaf()) {
+			child = node.start();
+			count = node.leaf.size;
+		}
+		else {
+			child = collapse(children[i]);
+			count = 0;
+		}
+
+		WideNode &wide = m_wideNodes[idx];
+		wide.child[i] = child;
+		wide.count[i] = count;
+		for (int axis = 0; axis < 3; ++axis) {
+			wide.bounds[axis][i] = node.bbox.min[axis];
+			wide.bounds[axis + 3][i] = node.bbox.max[axis];
+		}
+	}
+
+	return idx;
+}
+
+template <int Width> int WideBVH<Width>::intersectChildren(const WideNode &node,
+		const RayData &rd, float mint, float maxt, float *tNear) const {
+	return intersectBounds(node.bounds, rd, mint, maxt, tNear);
+}
+
+template <int Width> template <typename T> int WideBVH<Width>::intersectChildren(const QuantizedNode<T> &node,
+		const RayData &rd, float mint, float maxt, float *tNear) const {
+	/* Decode into the layout of the full precision nodes. Empty slots decode
+	   to some box inside the node, and are masked out afterwards instead */
+	float bounds[6][Width];
+	for (int axis = 0; axis < 3; ++axis) {
+		float origin = node.origin[axis], scale = std::ldexp(1.f, node.exponent[axis]);
+		for (int i = 0; i < Width; ++i) {
+			bounds[axis][i] = origin + (float) node.bounds[axis][i] * scale;
+			bounds[axis + 3][i] = origin + (float) node.bounds[axis + 3][i] * scale;
+		}
+	}
+
+	return intersectBounds(bounds, rd, mint, maxt, tNear) & node.validMask;
+}
+
+template <int Width> int WideBVH<Width>::intersectBounds(const float bounds[6][Width],
+		const RayData &rd, float mint, float maxt, float *tNear) {
+	int mask = 0;
+
+	/* Note: the operand order of the min/max operations below matters. Slabs
+	   which the ray is parallel to and starts exactly on produce NaNs, which
+	   are then ignored in favor of the running interval (as MINPS/MAXPS
+	   return their second operand when comparing against a NaN) */
+#if defined(__AVX__)
+	if (Width == 8) {
+		__m256 tMin = _mm256_set1_ps(mint), tMax = _mm256_set1_ps(maxt);
+		for (int axis = 0; axis < 3; ++axis) {
+			__m256 o = _mm256_set1_ps(rd.o[axis]), dRcp = _mm256_set1_ps(rd.dRcp[axis]);
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[rd.nearRow[axis]]), o), dRcp);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[rd.farRow[axis]]), o), dRcp);
+			tMin = _mm256_max_ps(t0, tMin);
+			tMax = _mm256_min_ps(t1, tMax);
+		}
+		_mm256_storeu_ps(tNear, tMin);
+		return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+	}
+#endif
+
+#if defined(NORI_WBVH_SSE)
+	for (int k = 0; k < Width; k += 4) {
+		__m128 tMin = _mm_set1_ps(mint), tMax = _mm_set1_ps(maxt);
+		for (int axis = 0; axis < 3; ++axis) {
+			__m128 o = _mm_set1_ps(rd.o[axis]), dRcp = _mm_set1_ps(rd.dRcp[axis]);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[rd.nearRow[axis]] + k), o), dRcp);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[rd.farRow[axis]] + k), o), dRcp);
+			tMin = _mm_max_ps(t0, tMin);
+			tMax = _mm_min_ps(t1, tMax);
+		}
+		_mm_storeu_ps(tNear + k, tMin);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << k;
+	}
+#else
+	for (int i = 0; i < Width; ++i) {
+		float tMin = mint, tMax = maxt;
+		for (int axis = 0; axis < 3; ++axis) {
+			float t0 = (bounds[rd.nearRow[axis]][i] - rd.o[axis]) * rd.dRcp[axis];
+			float t1 = (bounds[rd.farRow[axis]][i] - rd.o[axis]) * rd.dRcp[axis];
+			tMin = t0 > tMin ? t0 : tMin;
+			tMax = t1 < tMax ? t1 : tMax;
+		}
+		tNear[i] = tMin;
+		if (tMin <= tMax)
+			mask |= 1 << i;
+	}
+#endif
+
+	return mask;
+}
+
+template <int Width> bool WideBVH<Width>::rayIntersectPrimitive(const Ray3f &_ray, float &t,
+		MeshIntersectionQueryRecord &miqr, const Shape *&shape) const {
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	if (m_quantization == 8)
+		return intersectTree(m_quantizedNodes8, ray, t, miqr, shape);
+	else if (m_quantization == 16)
+		return intersectTree(m_quantizedNodes16, ray, t, miqr, shape);
+	return intersectTree(m_wideNodes, ray, t, miqr, shape);
+}
+
+template <int Width> template <typename Node> bool WideBVH<Width>::intersectTree(const std::vector<Node> &nodes,
+		Ray3f &ray, float &t, MeshIntersectionQueryRecord &miqr, const Shape *&shape) const {
+	/* Traversal stack entry: either an inner node (count == 0) or a leaf */
+	struct StackItem {
+		IndexType child;
+		IndexType count;
+		float t;
+	};
+	StackItem stack[64 * Width];
+	uint32_t stack_idx = 0;
+
+	if (nodes.empty() || ray.maxt < ray.mint)
+		return false;
+
+	RayData rd(ray);
+
+	bool foundIntersection = false;
+	miqr.f = (IndexType)-1;
+	t = std::numeric_limits<float>::infinity();
+
+	stack[stack_idx++] = StackItem{ 0u, 0u, ray.mint };
+
+	while (stack_idx > 0) {
+		const StackItem item = stack[--stack_idx];
+
+		/* Skip entries that lie behind the closest intersection found so far */
+		if (item.t > ray.maxt)
+			continue;
+
+		if (item.count > 0) {
+			if (intersectPrimitives(item.child, item.child + item.count, ray, t, miqr, shape))
+				foundIntersection = true;
+			continue;
+		}
+
+		const Node &node = nodes[item.child];
+		float tNear[Width];
+		int mask = intersectChildren(node, rd, ray.mint, ray.maxt, tNear);
+
+		/* Push the children which were hit far-to-near, so
+		   that the closest one is visited first */
+		StackItem hits[Width];
+		int hitCount = 0;
+		while (mask) {
+			int i = 0;
+			while (!(mask & (1 << i)))
+				++i;
+			mask &= mask - 1;
+
+			StackItem hit = StackItem{ node.child[i], node.count[i], tNear[i] };
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].t < hit.t) {
+				hits[j] = hits[j - 1];
+				--j;
+			}
+			hits[j] = hit;
+		}
+
+		for (int i = 0; i < hitCount; ++i)
+			stack[stack_idx++] = hits[i];
+		assert(stack_idx <= 64 * Width);
+	}
+
+	return foundIntersection;
+}
+
+template <int Width> bool WideBVH<Width>::rayOccluded(const Ray3f &_ray) const {
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	if (m_quantization == 8)
+		return occludedTree(m_quantizedNodes8, ray);
+	else if (m_quantization == 16)
+		return occludedTree(m_quantizedNodes16, ray);
+	return occludedTree(m_wideNodes, ray);
+}
+
+template <int Width> template <typename Node> bool WideBVH<Width>::occludedTree(
+		const std::vector<Node> &nodes, const Ray3f &ray) const {
+	/* Any hit terminates the traversal, so no ordering is needed here */
+	IndexType stack[64 * Width], counts[64 * Width];
+	uint32_t stack_idx = 0;
+
+	if (nodes.empty() || ray.maxt < ray.mint)
+		return false;
+
+	RayData rd(ray);
+	stack[stack_idx] = 0u;
+	counts[stack_idx++] = 0u;
+
+	while (stack_idx > 0) {
+		--stack_idx;
+		IndexType child = stack[stack_idx], count = counts[stack_idx];
+
+		if (count > 0) {
+			if (occludedPrimitives(child, child + count, ray))
+				return true;
+			continue;
+		}
+
+		const Node &node = nodes[child];
+		float tNear[Width];
+		int mask = intersectChildren(node, rd, ray.mint, ray.maxt, tNear);
+
+		while (mask) {
+			int i = 0;
+			while (!(mask & (1 << i)))
+				++i;
+			mask &= mask - 1;
+
+			stack[stack_idx] = node.child[i];
+			counts[stack_idx++] = node.count[i];
+		}
+		assert(stack_idx <= 64 * Width);
+	}
+
+	return false;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+
+NORI_NAMESPACE_END
@@ -0,0 +1,481 @@
+#include <nori/accelerators/bvh.h>
+#include <nori/cameras/camera.h>
+#include <nori/core/parser.h>
+#include <nori/core/scene.h>
+#include <nori/core/timer.h>
+#include <filesystem/resolver.h>
+#include <pcg32.h>
+#include <tbb/tbb.h>
+#include <Eigen/Geometry>
+#include <fstream>
+#include <map>
+
+/*
+ * BVH quality analyzer
+ *
+ * Loads a scene, builds a binary BVH over its shapes with every builder
+ * (or the one given by bvhBuilder=...), and writes a JSON report with the
+ * SAH cost, the end-point overlap, leaf size and depth histograms, the node
+ * memory and the traversal cost measured with two sampled ray sets: camera
+ * rays, and rays with uniformly distributed origins inside the scene bounds
+ * and uniformly distributed directions.
+ *
+ * Syntax: bvhanalyzer <scene.xml> <report.json> [rays=N] [property=value ...]
+ *
+ * All other name=value pairs are passed to the BVH like scene properties
+ * (e.g. bvhBinCount=32), which makes it easy to compare parameters.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Traversal counts and timing of a ray set
+struct TraversalStats {
+	size_t rays = 0;
+	size_t hits = 0;
+	double nodes = 0;       ///< Visited nodes, i.e. box tests
+	double leaves = 0;      ///< Visited leaves
+	double primitives = 0;  ///< Primitive tests
+	double milliseconds = 0; ///< Time of the regular traversal (single thread)
+};
+
+/**
+* \brief Computes quality metrics of a built (non-lazy) BVH
+*
+* The costs use the same unit weights as the builders, so that the SAH cost,
+* the end-point overlap and the measured traversal cost can be compared.
+*/
+class BVHAnalyzer {
+public:
+	/// Cost weights, the same as in the builders
+	enum {
+		/// Heuristic cost value for traversal operations
+		TRAVERSAL_COST = 1,
+
+		/// Heuristic cost value for intersection operations
+		INTERSECTION_COST = 1
+	};
+
+	BVHAnalyzer(const BVH &bvh) : bvh(bvh) {
+		if (bvh.m_lazyCount > 0)
+			throw NoriException("BVHAnalyzer: lazily built trees are not supported");
+	}
+
+	/// Return the SAH cost of the tree
+	float getSAHCost() const { return bvh.getSAHCost(); }
+
+	/// Return the memory used by the nodes, the leaf indices and the precomputed triangles
+	size_t getMemory() const {
+		return sizeof(BVH::BVHNode) * bvh.m_nodeCount + sizeof(IndexType) * bvh.m_indexCount
+			+ sizeof(BVH::PrecomputedTriangle) * bvh.m_triangles.size();
+	}
+
+	/// Count the nodes, and the leaves by size and by depth
+	void histograms(size_t &innerCount, std::map<IndexType, size_t> &leafSizes,
+			std::map<int, size_t> &leafDepths) const {
+		innerCount = 0;
+		std::vector<std::pair<IndexType, int>> stack(1, std::make_pair((IndexType) 0, 0));
+		while (!stack.empty()) {
+			IndexType idx = stack.back().first;
+			int depth = stack.back().second;
+			stack.pop_back();
+
+			const BVH::BVHNode &node = bvh.m_nodeData[idx];
+			if (node.isInner()) {
+				innerCount++;
+				stack.push_back(std::make_pair(node.inner.child, depth + 1));
+				stack.push_back(std::make_pair(node.inner.child + 1, depth + 1));
+			}
+			else {
+				leafSizes[node.leaf.size]++;
+				leafDepths[depth]++;
+			}
+		}
+	}
+
+	/**
+	* \brief Return the end-point overlap (EPO) of the tree
+	*
+	* For every node, this sums the surface area of all triangles that lie
+	* inside the node's bounds without being referenced from its subtree,
+	* weighted by the cost of visiting the node, and divides by the total
+	* triangle area. Rays ending on such surfaces still have to visit the
+	* node, so unlike the SAH this also accounts for overlap between
+	* siblings. See "On Quality Metrics of Bounding Volume Hierarchies" by
+	* Timo Aila, Tero Karras and Samuli Laine (Proc. HPG 2013).
+	*
+	* Other shapes than triangles are ignored. Relies on the builders
+	* placing the references of every subtree in a contiguous range of
+	* the index array.
+	*/
+	float getEPO() const {
+		IndexType nodeCount = bvh.m_nodeCount, primCount = bvh.getTriangleCount();
+
+		/* Range of index positions referenced from every subtree, children are always after their parent */
+		std::vector<IndexType> first(nodeCount, (IndexType) -1), last(nodeCount, 0);
+		for (int64_t i = (int64_t) nodeCount - 1; i >= 0; --i) {
+			const BVH::BVHNode &node = bvh.m_nodeData[i];
+			if (node.isInner()) {
+				first[i] = std::min(first[node.inner.child], first[node.inner.child + 1]);
+				last[i] = std::max(last[node.inner.child], last[node.inner.child + 1]);
+			}
+			else if (node.leaf.size > 0) {
+				first[i] = node.start();
+				last[i] = node.end();
+			}
+		}
+
+		/* Index positions of every primitive (several ones with spatial splits) */
+		std::vector<IndexType> offset(primCount + 1, 0), positions(bvh.m_indexCount);
+		for (IndexType i = 0; i < bvh.m_indexCount; ++i)
+			offset[bvh.m_indexData[i] + 1]++;
+		for (IndexType i = 0; i < primCount; ++i)
+			offset[i + 1] += offset[i];
+		std::vector<IndexType> fill(offset.begin(), offset.end() - 1);
+		for (IndexType i = 0; i < bvh.m_indexCount; ++i)
+			positions[fill[bvh.m_indexData[i]]++] = i;
+
+		auto inSubtree = [&](IndexType prim, IndexType idx) {
+			for (IndexType k = offset[prim]; k < offset[prim + 1]; ++k) {
+				if (positions[k] >= first[idx] && positions[k] < last[idx])
+					return true;
+			}
+			return false;
+		};
+
+		typedef std::pair<double, double> Sums; ///< Weighted overlap and total area
+		Sums sums = tbb::parallel_reduce(
+			tbb::blocked_range<IndexType>(0u, primCount, 1024),
+			Sums(0.0, 0.0),
+			[&](const tbb::blocked_range<IndexType> &range, Sums result) {
+			std::vector<IndexType> stack;
+			for (IndexType prim = range.begin(); prim != range.end(); ++prim) {
+				IndexType idx = prim;
+				const Shape *shape = bvh.m_shapes[bvh.findShape(idx)];
+				if (!shape->isMesh())
+					continue;
+
+				const Mesh *mesh = static_cast<const Mesh *>(shape);
+				const ConstIndexMatrixMap &F = mesh->getIndices();
+				const ConstMatrixXfMap &V = mesh->getVertexPositions();
+				Point3f tri[3] = { V.col(F(0, idx)), V.col(F(1, idx)), V.col(F(2, idx)) };
+				BoundingBox3f triBounds(tri[0]);
+				triBounds.expandBy(tri[1]);
+				triBounds.expandBy(tri[2]);
+
+				float area = clippedArea(tri, triBounds);
+				if (area <= 0.f)
+					continue;
+				result.second += area;
+
+				/* Children lie within their parent, so the descent stops at nodes missing the triangle */
+				stack.assign(1, 0u);
+				while (!stack.empty()) {
+					const BVH::BVHNode &node = bvh.m_nodeData[stack.back()];
+					IndexType nodeIdx = stack.back();
+					stack.pop_back();
+					if (!node.bbox.overlaps(triBounds))
+						continue;
+
+					if (!inSubtree(prim, nodeIdx)) {
+						float cost = node.isInner() ? (float) TRAVERSAL_COST : (float) INTERSECTION_COST * node.leaf.size;
+						result.first += cost * clippedArea(tri, node.bbox);
+					}
+					if (node.isInner()) {
+						stack.push_back(node.inner.child);
+						stack.push_back(node.inner.child + 1);
+					}
+				}
+			}
+			return result;
+		},
+			[](const Sums &s1, const Sums &s2) {
+			return Sums(s1.first + s2.first, s1.second + s2.second);
+		}
+		);
+
+		return sums.second > 0 ? (float) (sums.first / sums.second) : 0.f;
+	}
+
+	/// Trace the rays, counting the visited nodes and tested primitives, then time the regular traversal
+	TraversalStats trace(const std::vector<Ray3f> &rays) const {
+		TraversalStats stats;
+		stats.rays = rays.size();
+
+		for (const Ray3f &r : rays) {
+			Ray3f ray(r);
+			BVH::adaptEpsilon(ray);
+			if (bvh.m_nodeCount == 0 || ray.maxt < ray.mint)
+				continue;
+
+			float t = std::numeric_limits<float>::infinity();
+			MeshIntersectionQueryRecord miqr;
+			miqr.f = (IndexType) -1;
+			const Shape *shape = nullptr;
+			bool found = false;
+
+			/* Same visit order as BVH::intersectSubtree() */
+			IndexType node_idx = 0, stack_idx = 0, stack[64];
+			while (true) {
+				const BVH::BVHNode &node = bvh.m_nodeData[node_idx];
+				stats.nodes++;
+
+				if (node.bbox.rayIntersect(ray)) {
+					if (node.isInner()) {
+						if (ray.d[node.inner.axis] < 0) {
+							stack[stack_idx++] = node.inner.child;
+							node_idx = node.inner.child + 1;
+						}
+						else {
+							stack[stack_idx++] = node.inner.child + 1;
+							node_idx = node.inner.child;
+						}
+						continue;
+					}
+
+					stats.leaves++;
+					stats.primitives += node.leaf.size;
+					if (bvh.intersectLeaf(node, ray, t, miqr, shape))
+						found = true;
+				}
+
+				if (stack_idx == 0)
+					break;
+				node_idx = stack[--stack_idx];
+			}
+
+			if (found)
+				stats.hits++;
+		}
+
+		Timer timer;
+		for (const Ray3f &ray : rays) {
+			Intersection its;
+			bvh.rayIntersect(ray, its, false);
+		}
+		stats.milliseconds = timer.elapsed();
+		return stats;
+	}
+
+private:
+	/// Return the area of the part of a triangle inside a box
+	static float clippedArea(const Point3f *tri, const BoundingBox3f &bbox) {
+		/* Clip the polygon against the six box planes (Sutherland-Hodgman),
+		   every plane adds at most one vertex */
+		Point3f poly[9], clipped[9];
+		int count = 3;
+		for (int k = 0; k < 3; ++k)
+			poly[k] = tri[k];
+
+		for (int plane = 0; plane < 6 && count > 0; ++plane) {
+			int axis = plane / 2;
+			float sign = plane % 2 == 0 ? 1.f : -1.f;
+			float pos = plane % 2 == 0 ? bbox.min[axis] : bbox.max[axis];
+
+			int clippedCount = 0;
+			for (int k = 0; k < count; ++k) {
+				const Point3f &a = poly[k], &b = poly[(k + 1) % count];
+				float da = sign * (a[axis] - pos), db = sign * (b[axis] - pos);
+				if (da >= 0)
+					clipped[clippedCount++] = a;
+				if ((da >= 0) != (db >= 0))
+					clipped[clippedCount++] = a + (b - a) * (da / (da - db));
+			}
+			count = clippedCount;
+			std::copy(clipped, clipped + count, poly);
+		}
+
+		Vector3f sum = Vector3f::Zero();
+		for (int k = 1; k + 1 < count; ++k)
+			sum += (poly[k] - poly[0]).cross(poly[k + 1] - poly[0]);
+		return 0.5f * sum.norm();
+	}
+
+	const BVH &bvh;
+};
+
+NORI_NAMESPACE_END
+
+using namespace nori;
+
+/// Write a histogram as a JSON object
+template <typename Key> static std::string histogramJSON(const std::map<Key, size_t> &histogram) {
+	std::string result = "{";
+	for (auto it = histogram.begin(); it != histogram.end(); ++it)
+		result += tfm::format("%s\"%i\": %i", it == histogram.begin() ? "" : ", ", it->first, it->second);
+	return result + "}";
+}
+
+/// Write the traversal statistics of a ray set as a JSON object
+static std::string traversalJSON(const TraversalStats &stats) {
+	double rays = (double) std::max(stats.rays, (size_t) 1);
+	double cost = (BVHAnalyzer::TRAVERSAL_COST * stats.nodes + BVHAnalyzer::INTERSECTION_COST * stats.primitives) / rays;
+	return tfm::format("{\"rays\": %i, \"hits\": %i, \"nodesPerRay\": %.4f, \"leavesPerRay\": %.4f, "
+		"\"primitivesPerRay\": %.4f, \"costPerRay\": %.4f, \"milliseconds\": %.3f, \"mraysPerSecond\": %.4f}",
+		stats.rays, stats.hits, stats.nodes / rays, stats.leaves / rays, stats.primitives / rays, cost,
+		stats.milliseconds, stats.rays / (1000.0 * std::max(stats.milliseconds, 1e-3)));
+}
+
+/// Escape a string for JSON
+static std::string escapeJSON(const std::string &str) {
+	std::string result;
+	for (char c : str) {
+		if (c == '"' || c == '\\')
+			result += '\\';
+		result += c;
+	}
+	return result;
+}
+
+/// Set a property given as name=value on the command line, guessing its type
+static void setProperty(PropertyList &props, const std::string &name, const std::string &value) {
+	char *end = nullptr;
+	if (value == "true" || value == "false") {
+		props.setBoolean(name, value == "true");
+	}
+	else if (strtol(value.c_str(), &end, 10), *end == '\0') {
+		props.setInteger(name, (int) strtol(value.c_str(), nullptr, 10));
+	}
+	else if (strtof(value.c_str(), &end), *end == '\0') {
+		props.setFloat(name, strtof(value.c_str(), nullptr));
+	}
+	else {
+		props.setString(name, value);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		cerr << "Syntax: " << argv[0] << " <scene.xml> <report.json> [rays=N] [property=value ...]" << endl;
+		return -1;
+	}
+
+	try {
+		int rayCount = 100000;
+		std::vector<std::pair<std::string, std::string>> properties;
+		std::vector<std::string> builders = { "sah", "sbvh", "lbvh", "hlbvh" };
+
+		for (int i = 3; i < argc; ++i) {
+			std::string arg = argv[i];
+			size_t eq = arg.find('=');
+			if (eq == std::string::npos || eq == 0)
+				throw NoriException("Expected an argument of the form name=value (got \"%s\")", arg);
+			std::string name = arg.substr(0, eq), value = arg.substr(eq + 1);
+
+			if (name == "rays")
+				rayCount = std::atoi(value.c_str());
+			else if (name == "bvhBuilder")
+				builders.assign(1, value);
+			else
+				properties.push_back(std::make_pair(name, value));
+		}
+		if (rayCount < 1)
+			throw NoriException("The number of rays must be positive (got %i)", rayCount);
+
+		filesystem::path path(argv[1]);
+		getFileResolver()->prepend(path.parent_path());
+		std::unique_ptr<NoriObject> root(loadFromXML(argv[1]));
+		if (root->getClassType() != NoriObject::EClassType::EScene)
+			throw NoriException("\"%s\" does not contain a scene", argv[1]);
+		const Scene *scene = static_cast<const Scene *>(root.get());
+
+		/* The same rays are traced through all trees */
+		pcg32 random;
+		const BoundingBox3f &bbox = scene->getBoundingBox();
+		const Vector2i &outputSize = scene->getCamera()->getOutputSize();
+		std::vector<Ray3f> cameraRays(rayCount), randomRays(rayCount);
+		for (int i = 0; i < rayCount; ++i) {
+			Point2f pixel(random.nextFloat() * outputSize.x(), random.nextFloat() * outputSize.y());
+			Point2f aperture(random.nextFloat(), random.nextFloat());
+			scene->getCamera()->sampleRay(cameraRays[i], pixel, aperture);
+
+			Point3f origin = bbox.min + bbox.getExtents().cwiseProduct(
+				Vector3f(random.nextFloat(), random.nextFloat(), random.nextFloat()));
+			float z = 1.f - 2.f * random.nextFloat(), phi = 2.f * M_PI * random.nextFloat();
+			float r = std::sqrt(std::max(0.f, 1.f - z * z));
+			randomRays[i] = Ray3f(origin, Vector3f(r * std::cos(phi), r * std::sin(phi), z));
+		}
+
+		std::string report = tfm::format("{\n  \"scene\": \"%s\",\n  \"shapes\": %i,\n  \"trees\": [",
+			escapeJSON(argv[1]), scene->getShapes().size());
+
+		for (size_t b = 0; b < builders.size(); ++b) {
+			PropertyList props;
+			props.setString("bvhBuilder", builders[b]);
+			for (const auto &property : properties)
+				setProperty(props, property.first, property.second);
+
+			/* The shapes are owned by the scene, so the BVH has to release
+			   them before it is destroyed, also when the build or the
+			   analysis throws */
+			BVH bvh(props);
+			struct ShapeRelease {
+				BVH &bvh;
+				~ShapeRelease() { bvh.releaseShapes(); }
+			} release { bvh };
+			for (Shape *shape : scene->getShapes())
+				bvh.addShape(shape);
+
+			Timer timer;
+			bvh.build();
+			double buildTime = timer.elapsed();
+
+			BVHAnalyzer analyzer(bvh);
+			size_t innerCount;
+			std::map<IndexType, size_t> leafSizes;
+			std::map<int, size_t> leafDepths;
+			analyzer.histograms(innerCount, leafSizes, leafDepths);
+
+			size_t leafCount = 0, depthSum = 0;
+			for (const auto &depth : leafDepths) {
+				leafCount += depth.second;
+				depthSum += depth.first * depth.second;
+			}
+
+			float sahCost = analyzer.getSAHCost();
+			float epo = analyzer.getEPO();
+			TraversalStats camera = analyzer.trace(cameraRays);
+			TraversalStats uniform = analyzer.trace(randomRays);
+
+			cout << tfm::format("%s: SAH cost %.2f, EPO %.2f, %i inner nodes, %i leaves, "
+				"%.1f nodes and %.1f primitives per camera ray",
+				builders[b], sahCost, epo, innerCount, leafCount,
+				camera.nodes / camera.rays, camera.primitives / camera.rays) << endl;
+
+			report += tfm::format("%s\n    {\n"
+				"      \"builder\": \"%s\",\n"
+				"      \"primitives\": %i,\n"
+				"      \"buildMilliseconds\": %.3f,\n"
+				"      \"sahCost\": %.6f,\n"
+				"      \"epo\": %.6f,\n"
+				"      \"innerNodes\": %i,\n"
+				"      \"leaves\": %i,\n"
+				"      \"memoryBytes\": %i,\n"
+				"      \"maxDepth\": %i,\n"
+				"      \"averageLeafDepth\": %.4f,\n"
+				"      \"leafSizes\": %s,\n"
+				"      \"leafDepths\": %s,\n"
+				"      \"traversal\": {\n"
+				"        \"camera\": %s,\n"
+				"        \"uniform\": %s\n"
+				"      }\n"
+				"    }",
+				b == 0 ? "" : ",", escapeJSON(builders[b]), bvh.getTriangleCount(), buildTime, sahCost, epo,
+				innerCount, leafCount, analyzer.getMemory(),
+				leafDepths.empty() ? 0 : leafDepths.rbegin()->first,
+				(double) depthSum / std::max(leafCount, (size_t) 1),
+				histogramJSON(leafSizes), histogramJSON(leafDepths),
+				traversalJSON(camera), traversalJSON(uniform));
+		}
+		report += "\n  ]\n}\n";
+
+		std::ofstream file(argv[2]);
+		file << report;
+		if (!file)
+			throw NoriException("Could not write \"%s\"", argv[2]);
+	}
+	catch (const std::exception &e) {
+		cerr << "Fatal error: " << e.what() << endl;
+		return -1;
+	}
+	return 0;
+}
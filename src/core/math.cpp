@@ -71,40 +71,6 @@ float fresnel(float cosThetaI, float extIOR, float intIOR) {
 	return (Rs * Rs + Rp * Rp) / 2.0f;
 }
 
-bool quadratic(double a, double b, double c, double& t0, double& t1) {
-	// Linear case
-	if (a == 0) {
-		if (b != 0) {
-			t0 = t1 = -c / b;
-			return true;
-		}
-	}
-
-	// Find quadratic discriminant
-	double discrim = b*b - 4.0f * a*c;
-
-	if (discrim < 0.0)
-		return false;
-
-	double rootDiscrim = sqrt(discrim);
-
-	// Compute quadratic t values
-	double q;
-	if (b < 0.0)
-		q = -0.5 * (b - rootDiscrim);
-
-	else
-		q = -0.5 * (b + rootDiscrim);
-
-	t0 = q / a;
-	t1 = c / q;
-
-	if (t0 > t1)
-		std::swap(t0, t1);
-
-	return true;
-}
-
 float distSquared(Point3f p, Point3f q){
 	float x = (q.x() - p.x());
 	float y = (q.y() - p.y());
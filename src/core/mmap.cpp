@@ -0,0 +1,91 @@
+#include <nori/core/mmap.h>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+#if defined(PLATFORM_WINDOWS)
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename)
+	: m_filename(filename) {
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw NoriException("Unable to open \"%s\" for memory mapping!", filename);
+	m_file = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		throw NoriException("Unable to determine the size of \"%s\"!", filename);
+	}
+	m_size = (size_t) size.QuadPart;
+	if (m_size == 0)
+		return;
+
+	m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!m_mapping) {
+		CloseHandle(file);
+		throw NoriException("Unable to memory map \"%s\"!", filename);
+	}
+
+	m_data = (const uint8_t *) MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_data) {
+		CloseHandle(m_mapping);
+		CloseHandle(file);
+		throw NoriException("Unable to memory map \"%s\"!", filename);
+	}
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file)
+		CloseHandle(m_file);
+}
+
+#else
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename)
+	: m_filename(filename) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw NoriException("Unable to open \"%s\" for memory mapping!", filename);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw NoriException("Unable to determine the size of \"%s\"!", filename);
+	}
+	m_size = (size_t) st.st_size;
+
+	if (m_size > 0) {
+		void *ptr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			close(fd);
+			throw NoriException("Unable to memory map \"%s\"!", filename);
+		}
+		m_data = (const uint8_t *) ptr;
+	}
+
+	/* The mapping remains valid after the descriptor is closed */
+	close(fd);
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+	if (m_data)
+		munmap((void *) m_data, m_size);
+}
+
+#endif
+
+NORI_NAMESPACE_END
@@ -18,6 +18,8 @@
 
 #include <nori/accelerators/accel.h>
 #include <nori/accelerators/bvh.h>
+#include <nori/accelerators/kdtree.h>
+#include <nori/accelerators/widebvh.h>
 #include <nori/core/scene.h>
 #include <nori/core/bitmap.h>
 #include <nori/integrators/integrator.h>
@@ -34,9 +36,23 @@ Scene::Scene(const PropertyList & propList) {
 	std::string accel = propList.getString("accelerator", "bvh");
 
 	if (accel == "bvh")
-		m_accel = new BVH();
+		m_accel = new BVH(propList);
+	else if (accel == "bvh4")
+		m_accel = new BVH4(propList);
+	else if (accel == "bvh8")
+		m_accel = new BVH8(propList);
+	else if (accel == "kdtree")
+		m_accel = new KDTree(propList);
 	else
 		m_accel = new Accel(); 
+
+	/* Packets pay off for integrators which shade the traced first hit in
+	   LiPrimary(), integrators without it would trace every ray twice */
+	m_packetSize = propList.getInteger("packetSize", 1);
+	if (m_packetSize != 1 && m_packetSize != 4 && m_packetSize != 8 && m_packetSize != 16)
+		throw NoriException("Scene: packetSize must be 1, 4, 8 or 16 (got %i)", m_packetSize);
+
+	m_rayStreams = propList.getBoolean("rayStreams", false);
 }
 
 Scene::~Scene() {
@@ -50,15 +66,29 @@ bool Scene::rayIntersect(const Ray3f &ray, Intersection &its) const {
 	return m_accel->rayIntersect(ray, its, false);
 }
 
+void Scene::rayIntersectPacket(int count, const Ray3f *rays, Intersection *its, bool *hit) const {
+	m_accel->rayIntersectPacket(count, rays, its, hit);
+}
+
+void Scene::rayIntersectBatch(int count, const Ray3f *rays, Intersection *its, bool *hit) const {
+	m_accel->rayIntersectBatch(count, rays, its, hit);
+}
+
 bool Scene::rayIntersect(const Ray3f &ray) const {
-	Intersection its; // Unused
-	return m_accel->rayIntersect(ray, its, true);
+	return m_accel->rayOccluded(ray);
 }
 
 const BoundingBox3f& Scene::getBoundingBox() const {
 	return m_accel->getBoundingBox();
 }
 
+void Scene::updateGeometry() {
+	for (auto shape : m_shapes)
+		shape->calculateBoundingBox();
+
+	m_accel->refit();
+}
+
 void Scene::activate() {
     m_accel->build();
 
@@ -16,6 +16,8 @@
 #include <glviewer/viewer.h>
 #include <glviewer/camera.h>
 
+#include <nori/accelerators/accel.h>
+#include <nori/accelerators/raystream.h>
 #include <nori/bsdfs/bsdf.h>
 #include <nori/bsdfs/phong.h>
 #include <nori/bsdfs/diffuse.h>
@@ -27,6 +29,7 @@
 #include <nori/core/scene.h>
 #include <nori/shapes/shape.h>
 #include <nori/shapes/mesh.h>
+#include <nori/shapes/instance.h>
 #include <nori/core/timer.h>
 #include <nori/integrators/integrator.h>
 #include <nori/samplers/sampler.h>
@@ -124,6 +127,14 @@ void Viewer::key_callback_impl(GLFWwindow* window, int key, int scancode, int ac
 	{
 		launchFinalRender();
 	}
+
+	// Instance selection
+	if (key == GLFW_KEY_TAB && action == GLFW_PRESS && !m_instances.empty())
+	{
+		m_selectedInstance = (m_selectedInstance + 1) % m_instances.size();
+		std::cout << "Selected instance " << m_selectedInstance << " of \""
+			<< m_instances[m_selectedInstance]->getName() << "\"" << std::endl;
+	}
 	
 	// Realtime (key held) interaction management
 	if (key >= 0 && key < 1024)
@@ -259,6 +270,12 @@ void Viewer::initialize(nori::Scene* scene)
 		if (obj->isMesh())
 			obj->initializeBuffers();
 	}
+
+	// Instances can be moved before the final render
+	for (auto obj : m_scene->getShapes()) {
+		if (auto instance = dynamic_cast<nori::Instance*>(obj))
+			m_instances.push_back(instance);
+	}
 }
 
 void Viewer::setCamera(const nori::Transform& transform, const nori::PerspectiveCamera& camera) {
@@ -302,6 +319,34 @@ void Viewer::interaction()
 		m_camera->zoom(0.001);
 	if (m_keys[GLFW_KEY_X])
 		m_camera->zoom(-0.001);
+
+	// Move the selected instance
+	if (m_instances.empty())
+		return;
+
+	nori::Vector3f offset(0.f);
+	if (m_keys[GLFW_KEY_LEFT])
+		offset.x() -= 1.f;
+	if (m_keys[GLFW_KEY_RIGHT])
+		offset.x() += 1.f;
+	if (m_keys[GLFW_KEY_PAGE_UP])
+		offset.y() += 1.f;
+	if (m_keys[GLFW_KEY_PAGE_DOWN])
+		offset.y() -= 1.f;
+	if (m_keys[GLFW_KEY_UP])
+		offset.z() -= 1.f;
+	if (m_keys[GLFW_KEY_DOWN])
+		offset.z() += 1.f;
+
+	if (offset.isZero())
+		return;
+
+	// Cross a tenth of the scene per second
+	float speed = 0.1f * m_scene->getBoundingBox().getExtents().norm();
+	nori::Instance* instance = m_instances[m_selectedInstance];
+	Eigen::Affine3f translation(Eigen::Translation3f(offset * speed * m_deltaTime));
+	instance->setToWorld(nori::Transform(translation.matrix() * instance->toWorld().getMatrix()));
+	m_geometryChanged = true;
 }
 
 Viewer& Viewer::getInstance()
@@ -321,6 +366,8 @@ Viewer::Viewer()
 	, m_wireFrameEnabled(false)
 	, m_mouseIsClicked(false)
 	, m_isRuntime(true)
+	, m_selectedInstance(0)
+	, m_geometryChanged(false)
 {
 	// GLFW initialization
 	if (!glfwInit())
@@ -359,22 +406,77 @@ void Viewer::renderOfflineBlock(nori::ImageBlock& block, nori::Sampler* sampler)
 	/* Clear the block contents */
 	block.clear();
 
-	/* For each pixel and pixel sample sample */
-	for (int y = 0; y < size.y(); ++y) {
-		for (int x = 0; x < size.x(); ++x) {
-			for (uint32_t i = 0; i < sampler->getSampleCount(); ++i) {
-				nori::Point2f pixelSample = nori::Point2f((float)(x + offset.x()), (float)(y + offset.y())) + sampler->next2D();
-				nori::Point2f apertureSample = sampler->next2D();
+	if (m_scene->useRayStreams()) {
+		/* Shade one sample of every pixel of the block as a single batch,
+		   so that the integrator can sort and trace its secondary rays together */
+		int count = size.x() * size.y();
+		std::vector<nori::Ray3f> rays(count);
+		std::vector<nori::Color3f> values(count), Li(count);
+		std::vector<nori::Point2f> pixelSamples(count);
+
+		for (uint32_t i = 0; i < sampler->getSampleCount(); ++i) {
+			for (int y = 0; y < size.y(); ++y) {
+				for (int x = 0; x < size.x(); ++x) {
+					int k = y * size.x() + x;
+					pixelSamples[k] = nori::Point2f((float)(x + offset.x()), (float)(y + offset.y())) + sampler->next2D();
+					nori::Point2f apertureSample = sampler->next2D();
+					values[k] = camera->sampleRay(rays[k], pixelSamples[k], apertureSample);
+				}
+			}
 
-				/* Sample a ray from the camera */
-				nori::Ray3f ray;
-				nori::Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+			integrator->LiStream(m_scene, sampler, (uint32_t) count, rays.data(), Li.data());
 
-				/* Compute the incident radiance */
-				value *= integrator->Li(m_scene, sampler, ray);
+			for (int k = 0; k < count; ++k)
+				block.put(pixelSamples[k], values[k] * Li[k]);
+		}
+		return;
+	}
+
+	/* Camera rays of neighbouring pixels are traced together as a packet
+	   of up to 'packetSize' rays, covering a small tile of the block */
+	int packetSize = m_scene->getPacketSize();
+	int tileWidth = packetSize >= 8 ? 4 : (packetSize == 4 ? 2 : 1);
+	int tileHeight = packetSize / tileWidth;
+
+	nori::Ray3f rays[nori::Accel::MAX_PACKET_SIZE];
+	nori::Color3f values[nori::Accel::MAX_PACKET_SIZE];
+	nori::Point2f pixelSamples[nori::Accel::MAX_PACKET_SIZE];
+	nori::Intersection its[nori::Accel::MAX_PACKET_SIZE];
+	bool hit[nori::Accel::MAX_PACKET_SIZE];
+
+	/* For each tile and pixel sample */
+	for (int ty = 0; ty < size.y(); ty += tileHeight) {
+		for (int tx = 0; tx < size.x(); tx += tileWidth) {
+			int yEnd = std::min(ty + tileHeight, size.y());
+			int xEnd = std::min(tx + tileWidth, size.x());
 
-				/* Store in the image block */
-				block.put(pixelSample, value);
+			for (uint32_t i = 0; i < sampler->getSampleCount(); ++i) {
+				/* Sample a ray from the camera for each pixel of the tile */
+				int count = 0;
+				for (int y = ty; y < yEnd; ++y) {
+					for (int x = tx; x < xEnd; ++x) {
+						pixelSamples[count] = nori::Point2f((float)(x + offset.x()), (float)(y + offset.y())) + sampler->next2D();
+						nori::Point2f apertureSample = sampler->next2D();
+						values[count] = camera->sampleRay(rays[count], pixelSamples[count], apertureSample);
+						++count;
+					}
+				}
+
+				/* Find the first intersections of the whole packet at once.
+				   Without packets, the integrator traces the ray itself */
+				if (packetSize > 1)
+					m_scene->rayIntersectPacket(count, rays, its, hit);
+
+				for (int k = 0; k < count; ++k) {
+					/* Compute the incident radiance */
+					if (packetSize > 1)
+						values[k] *= integrator->LiPrimary(m_scene, sampler, rays[k], hit[k] ? &its[k] : nullptr);
+					else
+						values[k] *= integrator->Li(m_scene, sampler, rays[k]);
+
+					/* Store in the image block */
+					block.put(pixelSamples[k], values[k]);
+				}
 			}
 		}
 	}
@@ -385,6 +487,7 @@ void Viewer::renderOffline() {
 
 	/* Do the following in parallel and asynchronously */
 	std::thread render_thread([&] {
+		nori::RayStream::resetStatistics();
 		std::cout << "Rendering .. ";
 		std::cout.flush();
 		nori::Timer timer;
@@ -423,6 +526,11 @@ void Viewer::renderOffline() {
 		tbb::parallel_for(range, map);
 
 		std::cout << "done. (took " << timer.elapsedString() << ")" << std::endl;
+		if (m_scene->useRayStreams())
+			std::cout << nori::RayStream::getStatistics() << std::endl;
+		std::string accelStatistics = m_scene->getAccel()->getStatistics();
+		if (!accelStatistics.empty())
+			std::cout << accelStatistics << std::endl;
 	});
 
 	/* Enter the application main loop */
@@ -477,6 +585,14 @@ void Viewer::launchFinalRender()
 {
 	m_isRuntime = false; 
 	m_screen->clear(); 
+
+	// Refit the acceleration structure to the moved instances
+	if (m_geometryChanged)
+	{
+		m_scene->updateGeometry();
+		m_scene->getIntegrator()->preprocess(m_scene);
+		m_geometryChanged = false;
+	}
 	
 	renderOffline(); 
 }
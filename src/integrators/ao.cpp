@@ -13,12 +13,18 @@ AmbientOcclusion::AmbientOcclusion(const PropertyList &props)
 }
 
 Color3f AmbientOcclusion::Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
-	Color3f Li(0.f);
-
 	// Query if the ray intersects an object
 	Intersection its;
-	if (!scene->rayIntersect(ray, its))
+	bool hit = scene->rayIntersect(ray, its);
+	return LiPrimary(scene, sampler, ray, hit ? &its : nullptr);
+}
+
+Color3f AmbientOcclusion::LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *_its) const {
+	Color3f Li(0.f);
+
+	if (!_its)
 		return Li;
+	const Intersection &its = *_its;
 
 	// Find the corresponding normal and BSDF where the ray intersects
 	Vector3f n = its.shFrame.n;
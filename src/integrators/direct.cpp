@@ -5,6 +5,8 @@
 #include <nori/warp/warp.h>
 #include <nori/bsdfs/bsdf.h>
 #include <nori/warp/mis.h>
+#include <nori/accelerators/raystream.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -36,17 +38,89 @@ DirectIntegrator::DirectIntegrator(EMeasure measure, Warp::EWarpType warpType, c
 }
 
 Color3f DirectIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
-	Color3f Li(0.f);
-
 	// Find if the surface is visible from camera
 	Intersection its;
-	if (!scene->rayIntersect(ray, its))
+	bool hit = scene->rayIntersect(ray, its);
+	return LiPrimary(scene, sampler, ray, hit ? &its : nullptr);
+}
+
+Color3f DirectIntegrator::LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *_its) const {
+	Color3f Li(0.f);
+
+	if (!_its)
 		return Color3f(0.f);
+	const Intersection &its = *_its;
 
 	// If the intersection hits the light, return the radiance
 	if (its.shape->isEmitter())
 		return its.shape->getEmitter()->getRadiance();
 
+	std::vector<ShadowQuery> queries;
+	if (!sampleEmitters(scene, sampler, ray, its, queries))
+		return Color3f(0.0f);
+
+	for (const ShadowQuery &query : queries) {
+		if (isVisible(scene, query))
+			Li += query.value;
+	}
+
+	return Li / m_nSamples;
+}
+
+void DirectIntegrator::LiStream(const Scene *scene, Sampler *sampler, uint32_t count, const Ray3f *rays, Color3f *Li) const {
+	// Camera rays are coherent already and traced in order
+	RayStream stream;
+	for (uint32_t i = 0; i < count; ++i)
+		stream.add(rays[i]);
+
+	std::vector<Intersection> its(count);
+	std::unique_ptr<bool[]> hit(new bool[count]);
+	stream.intersect(scene, its.data(), hit.get());
+
+	// Sample the emitters at all shading points, remembering the path of each shadow ray
+	std::vector<ShadowQuery> queries;
+	std::vector<uint32_t> paths;
+	RayStream shadowStream;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		Li[i] = Color3f(0.f);
+		if (!hit[i])
+			continue;
+
+		if (its[i].shape->isEmitter()) {
+			Li[i] = its[i].shape->getEmitter()->getRadiance();
+			continue;
+		}
+
+		size_t first = queries.size();
+		if (!sampleEmitters(scene, sampler, rays[i], its[i], queries)) {
+			queries.resize(first);
+			continue;
+		}
+
+		for (size_t k = first; k < queries.size(); ++k) {
+			shadowStream.add(queries[k].ray);
+			paths.push_back(i);
+		}
+	}
+
+	// Trace all shadow rays as one sorted stream
+	shadowStream.sort(scene->getBoundingBox());
+
+	std::unique_ptr<bool[]> visible(new bool[queries.size()]);
+	std::vector<Intersection> itsLight(queries.size());
+	shadowStream.intersect(scene, itsLight.data(), visible.get());
+	for (size_t k = 0; k < queries.size(); ++k)
+		visible[k] = visible[k] && queries[k].emitter == itsLight[k].shape->getEmitter();
+
+	for (size_t k = 0; k < queries.size(); ++k) {
+		if (visible[k])
+			Li[paths[k]] += queries[k].value / m_nSamples;
+	}
+}
+
+bool DirectIntegrator::sampleEmitters(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+		const Intersection &its, std::vector<ShadowQuery> &queries) const {
 	// Get the extents of the scene
 	float maxt = scene->getBoundingBox().getExtents().norm();
 
@@ -78,7 +152,7 @@ Color3f DirectIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray3f &
 			
 			// Check Pdf validity
 			if (sqr.pdf == 0 /* && !deltaPDF*/) // TODO: code Delta pdf concept (have isDelta in bsdf)
-				return Color3f(0.0f); 
+				return false; 
 	
 			// Query Emitter's radiance and wi. If solid-angle, wi is the sample directly
 			EmitterQueryRecord eqr;
@@ -88,56 +162,60 @@ Color3f DirectIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray3f &
 			if(m_measure == EMeasure::EArea) // Update sampled direction if Area Sampling
 				wi = eqr.wi;
 
-			// Visibility test
-			Ray3f lightRay = Ray3f(its.p, wi, Epsilon, maxt); 
-			Intersection itsLight; 
-			bool intersects = scene->rayIntersect(lightRay, itsLight);
-
-			// If point is visible, calculate final color
-			if (intersects && emitter == itsLight.shape->getEmitter()) {
-
-				// Calculate Local Coordinates
-				Vector3f woLocal(its.toLocal(-ray.d));
-				Vector3f wiLocal(its.toLocal(wi));
-
-				// Calculate the weight of the light
-				float weight = 0;
-				switch (m_measure)
-				{
-				case EMeasure::EArea: {
-					// Weight by geometry term
-					float d2 = (sqr.sample.p - its.p).squaredNorm();
-					float cosThetaO = zeroClamp(wi.dot(sqr.n));
-					float cosThetaI = zeroClamp(wi.dot(its.shFrame.n));
-					weight = (cosThetaI * cosThetaO) / d2;
-					break;
-				}
-				case EMeasure::EHemisphere:
-				case EMeasure::ESolidAngle:
-				case EMeasure::EBSDF:
-					weight = zeroClamp(wi.dot(its.shFrame.n)); 
-					break;
-				}
-				
-				// Evaluate rendering equation
-				if (m_measure != EMeasure::EBSDF) {
-					BSDFQueryRecord bsr(wiLocal, woLocal, EMeasure::ESolidAngle);
-					f = its.shape->getBSDF()->eval(bsr);
-				}
-
-				// If used for MIS, calculate heuristic
-				if (m_mis) {
-
-					float pdf2 = m_mis->getPdf(sqr.sample.v, its, woLocal, emitter, !m_isFirst);
-					f *= m_mis->eval(sqr.pdf, pdf2); 
-				}
-
-				Li += weight * eqr.Le * f / sqr.pdf;
+			// Shadow ray. Its closest hit must be the sampled emitter itself, as an
+			// occlusion query towards the sampled point would be blocked by the near
+			// side of the emitter's own surface
+			ShadowQuery query;
+			query.emitter = emitter;
+			query.ray = Ray3f(its.p, wi, Epsilon, maxt);
+
+			// Calculate Local Coordinates
+			Vector3f woLocal(its.toLocal(-ray.d));
+			Vector3f wiLocal(its.toLocal(wi));
+
+			// Calculate the weight of the light
+			float weight = 0;
+			switch (m_measure)
+			{
+			case EMeasure::EArea: {
+				// Weight by geometry term
+				float d2 = (sqr.sample.p - its.p).squaredNorm();
+				float cosThetaO = zeroClamp(wi.dot(sqr.n));
+				float cosThetaI = zeroClamp(wi.dot(its.shFrame.n));
+				weight = (cosThetaI * cosThetaO) / d2;
+				break;
 			}
+			case EMeasure::EHemisphere:
+			case EMeasure::ESolidAngle:
+			case EMeasure::EBSDF:
+				weight = zeroClamp(wi.dot(its.shFrame.n)); 
+				break;
+			}
+			
+			// Evaluate rendering equation
+			if (m_measure != EMeasure::EBSDF) {
+				BSDFQueryRecord bsr(wiLocal, woLocal, EMeasure::ESolidAngle);
+				f = its.shape->getBSDF()->eval(bsr);
+			}
+
+			// If used for MIS, calculate heuristic
+			if (m_mis) {
+
+				float pdf2 = m_mis->getPdf(sqr.sample.v, its, woLocal, emitter, !m_isFirst);
+				f *= m_mis->eval(sqr.pdf, pdf2); 
+			}
+
+			query.value = weight * eqr.Le * f / sqr.pdf;
+			queries.push_back(query);
 		}
 	}
 
-	return Li / m_nSamples;
+	return true;
+}
+
+bool DirectIntegrator::isVisible(const Scene *scene, const ShadowQuery &query) const {
+	Intersection itsLight;
+	return scene->rayIntersect(query.ray, itsLight) && query.emitter == itsLight.shape->getEmitter();
 }
 
 std::string DirectIntegrator::toString() const {
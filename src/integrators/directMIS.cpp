@@ -29,9 +29,16 @@ DirectMISIntegrator::DirectMISIntegrator(const PropertyList &props){
 }
 
 Color3f DirectMISIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+	// Both strategies shade the same first intersection, so it is only traced once
+	Intersection its;
+	bool hit = scene->rayIntersect(ray, its);
+	return LiPrimary(scene, sampler, ray, hit ? &its : nullptr);
+}
+
+Color3f DirectMISIntegrator::LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const {
 
-	Color3f weightedColor1 = m_integrator1->Li(scene, sampler, ray);
-	Color3f weightedColor2 = m_integrator2->Li(scene, sampler, ray);
+	Color3f weightedColor1 = m_integrator1->LiPrimary(scene, sampler, ray, its);
+	Color3f weightedColor2 = m_integrator2->LiPrimary(scene, sampler, ray, its);
 
 	Color3f res = weightedColor1 + weightedColor2; 
 
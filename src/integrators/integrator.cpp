@@ -4,6 +4,12 @@
 
 NORI_NAMESPACE_BEGIN
 
+void Integrator::LiStream(const Scene *scene, Sampler *sampler, uint32_t count,
+		const Ray3f *rays, Color3f *Li) const {
+	for (uint32_t i = 0; i < count; ++i)
+		Li[i] = this->Li(scene, sampler, rays[i]);
+}
+
 const nori::Emitter* Integrator::chooseOneLight(const Scene &scene, Sampler *sampler) {
 	int nLights = scene.getEmitters().size();
 	if (nLights == 0)
@@ -10,8 +10,14 @@ NormalIntegrator::NormalIntegrator(const PropertyList &props) {
 Color3f NormalIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
 	// Find the surface that is visible in the requested direction
 	Intersection its;
-	if (!scene->rayIntersect(ray, its))
+	bool hit = scene->rayIntersect(ray, its);
+	return LiPrimary(scene, sampler, ray, hit ? &its : nullptr);
+}
+
+Color3f NormalIntegrator::LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *_its) const {
+	if (!_its)
 		return Color3f(0.0f);
+	const Intersection &its = *_its;
 
 	// Return the component-wise absolute value of the shading normal as a color
 	Normal3f n = its.shFrame.n.cwiseAbs();
@@ -5,6 +5,8 @@
 #include <nori/warp/warp.h>
 #include <nori/samplers/sampler.h>
 #include <nori/emitters/emitter.h>
+#include <nori/accelerators/raystream.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -25,7 +27,8 @@ PathIntegrator::PathIntegrator(const PropertyList &props)
 	m_directWarpType = Warp::getWarpType(m_directMeasure, props.getString("direct-warp", "none"));
 	m_indirectWarpType = Warp::getWarpType(m_indirectMeasure, props.getString("indirect-warp"));
 
-	if (props.getBoolean("isExplicit", false))
+	m_isExplicit = props.getBoolean("isExplicit", false);
+	if (m_isExplicit)
 		m_Li = &PathIntegrator::explicitLi;
 	else
 		m_Li = &PathIntegrator::implicitLi;
@@ -33,15 +36,24 @@ PathIntegrator::PathIntegrator(const PropertyList &props)
 
 // Implicit Path tracing
 Color3f PathIntegrator::implicitLi(const Scene* scene, Sampler* sampler, const Ray3f &ray) const {
+	Intersection its;
+	bool hit = scene->rayIntersect(ray, its);
+	return implicitLiPrimary(scene, sampler, ray, hit ? &its : nullptr);
+}
+
+Color3f PathIntegrator::implicitLiPrimary(const Scene* scene, Sampler* sampler, const Ray3f &ray, const Intersection *primaryIts) const {
 	Color3f Lacc(1.f); 
 	Ray3f _ray(ray);
+
+	// The first intersection was found by the caller
+	Intersection its;
+	bool hit = primaryIts != nullptr;
+	if (hit)
+		its = *primaryIts;
 	
 	// Loop until the path escapes, hits a light or is forced to terminate
 	for (uint32_t nDepth = 0; ;) {
 
-		Intersection its;
-		bool hit = scene->rayIntersect(_ray, its);
-		
 		if (hit) {
 			// If the ray hit the light, get Le's contribution and terminate path
 			if (its.shape->isEmitter()) {
@@ -75,8 +87,9 @@ Color3f PathIntegrator::implicitLi(const Scene* scene, Sampler* sampler, const R
 				// Accumulate L (L = Le + \int fr*L*cosTheta)
 				Lacc *= (fr * cosTheta) / wRec.pdf;
 
-				// Build next ray
+				// Build and trace next ray
 				_ray = Ray3f(its.p, wi); 
+				hit = scene->rayIntersect(_ray, its);
 			}
 		}
 
@@ -88,15 +101,89 @@ Color3f PathIntegrator::implicitLi(const Scene* scene, Sampler* sampler, const R
 	return Lacc; 
 }
 
+void PathIntegrator::LiStream(const Scene *scene, Sampler *sampler, uint32_t count, const Ray3f *rays, Color3f *Li) const {
+	if (m_isExplicit) {
+		Integrator::LiStream(scene, sampler, count, rays, Li);
+		return;
+	}
+
+	// Same as implicitLi(), but every bounce of all paths is traced as one stream
+	std::vector<Color3f> Lacc(count, Color3f(1.f));
+	std::vector<uint32_t> paths(count), nextPaths;
+	std::vector<Intersection> its;
+	std::unique_ptr<bool[]> hit(new bool[count]);
+	RayStream stream, nextStream;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		Li[i] = Color3f(0.f);
+		paths[i] = i;
+		stream.add(rays[i]);
+	}
+
+	for (uint32_t nDepth = 0; stream.size() > 0; ) {
+		// Camera rays are coherent already, only the bounces are sorted
+		if (nDepth > 0)
+			stream.sort(scene->getBoundingBox());
+
+		its.resize(stream.size());
+		stream.intersect(scene, its.data(), hit.get());
+
+		++nDepth;
+		nextStream.clear();
+		nextPaths.clear();
+
+		for (uint32_t k = 0; k < stream.size(); ++k) {
+			uint32_t path = paths[k];
+
+			// The path escapes the scene
+			if (!hit[k])
+				continue;
+
+			// If the ray hit the light, get Le's contribution and terminate path
+			if (its[k].shape->isEmitter()) {
+				Li[path] = Lacc[path] * its[k].shape->getEmitter()->getRadiance();
+				continue;
+			}
+
+			// Check termination condition
+			if (stopPath(nDepth))
+				continue;
+
+			// Calculate next Ray
+			Warp::WarpQueryRecord wRec;
+			Warp::warp(wRec, Warp::EWarpType::ECosineHemisphere, sampler->next2D());
+			Vector3f wi = its[k].toWorld(wRec.warpedPoint);
+
+			// Calculate BSDF + cosine factor
+			BSDFQueryRecord bRec(its[k].toLocal(wi), its[k].toLocal(-stream[k].d), EMeasure::ESolidAngle);
+			Color3f fr = its[k].shape->getBSDF()->eval(bRec);
+			float cosTheta = zeroClamp(wi.dot(its[k].shFrame.n));
+
+			Lacc[path] *= (fr * cosTheta) / wRec.pdf;
+
+			nextStream.add(Ray3f(its[k].p, wi));
+			nextPaths.push_back(path);
+		}
+
+		std::swap(stream, nextStream);
+		std::swap(paths, nextPaths);
+	}
+}
+
 // Explicit Path Tracing
 Color3f PathIntegrator::explicitLi(const Scene* scene, Sampler* sampler, const Ray3f &ray) const {
+	Intersection its;
+	bool hit = scene->rayIntersect(ray, its);
+	return explicitLiPrimary(scene, sampler, ray, hit ? &its : nullptr);
+}
+
+Color3f PathIntegrator::explicitLiPrimary(const Scene* scene, Sampler* sampler, const Ray3f &ray, const Intersection *primaryIts) const {
 	Color3f Lacc(1.f);
 	Ray3f _ray(ray);
 
-	Intersection its;
-	bool hit = scene->rayIntersect(_ray, its);
+	if (primaryIts) {
+		const Intersection &its = *primaryIts;
 
-	if (hit) {
 		// If the ray hit the light, get Le's contribution and terminate path
 		if (its.shape->isEmitter()) {
 			return its.shape->getEmitter()->getRadiance();
@@ -107,6 +194,7 @@ Color3f PathIntegrator::explicitLi(const Scene* scene, Sampler* sampler, const R
 			// TODO;
 		}
 	}
+	return Color3f(0.f);
 }
 
 Color3f PathIntegrator::simplifiedDirect(const Scene* scene, Sampler* sampler, const Ray3f &ray, const Intersection& its) const {
@@ -139,13 +227,15 @@ Color3f PathIntegrator::simplifiedDirect(const Scene* scene, Sampler* sampler, c
 		if (m_directMeasure == EMeasure::EArea) // Update sampled direction if Area Sampling
 			wi = eqr.wi;
 
-		// Visibility test
+		// Visibility test. The closest hit must be the sampled emitter itself, as
+		// an occlusion query towards the sampled point would be blocked by the near
+		// side of the emitter's own surface
 		Ray3f lightRay = Ray3f(its.p, wi, Epsilon, maxt);
 		Intersection itsLight;
-		bool intersects = scene->rayIntersect(lightRay, itsLight);
+		bool visible = scene->rayIntersect(lightRay, itsLight) && emitter == itsLight.shape->getEmitter();
 
 		// If point is visible, calculate final color
-		if (intersects && emitter == itsLight.shape->getEmitter()) {
+		if (visible) {
 
 			// Calculate Local Coordinates
 			Vector3f woLocal(its.toLocal(-ray.d));
@@ -183,6 +273,12 @@ Color3f PathIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray3f &ra
 	return m_Li(this, scene, sampler, ray);
 }
 
+Color3f PathIntegrator::LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *its) const {
+	if (m_isExplicit)
+		return explicitLiPrimary(scene, sampler, ray, its);
+	return implicitLiPrimary(scene, sampler, ray, its);
+}
+
 bool PathIntegrator::stopPath(uint32_t currentDepth) const {
 	bool stop = false;
 	
@@ -14,13 +14,17 @@ VolumePathIntegrator::VolumePathIntegrator(const PropertyList &props)
 }
 
 Color3f VolumePathIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
-	Ray3f _ray(ray); 
-	
 	Intersection its;
-	bool intersects = scene->rayIntersect(_ray, its);
+	bool hit = scene->rayIntersect(ray, its);
+	return LiPrimary(scene, sampler, ray, hit ? &its : nullptr);
+}
 
+Color3f VolumePathIntegrator::LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *_its) const {
+	Ray3f _ray(ray); 
+	
+	bool intersects = _its != nullptr;
 	if (intersects) {
-		_ray.maxt = its.t;
+		_ray.maxt = _its->t;
 	}
 
 	// Sample the participating medium, if present (901)
@@ -32,8 +36,8 @@ Color3f VolumePathIntegrator::Li(const Scene *scene, Sampler *sampler, const Ray
 	if (t > _ray.maxt && intersects) {
 		// Surface rendering
 
-		if (its.shape->isEmitter()) {
-			Color3f Le = its.shape->getEmitter()->getRadiance();
+		if (_its->shape->isEmitter()) {
+			Color3f Le = _its->shape->getEmitter()->getRadiance();
 			return tr_ot * Le;
 		}
 
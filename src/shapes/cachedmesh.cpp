@@ -0,0 +1,318 @@
+#include <nori/shapes/cachedmesh.h>
+#include <filesystem/resolver.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <fstream>
+#include <cstdio>
+
+NORI_NAMESPACE_BEGIN
+
+/// Version of the mesh cache file format. Increase this whenever the layout
+/// changes, so that stale caches are parsed again
+static const uint32_t MESH_CACHE_VERSION = 2;
+
+static const char MESH_CACHE_MAGIC[8] = { 'N', 'O', 'R', 'I', 'M', 'S', 'H', '\0' };
+
+/// Alignment of the arrays in uncompressed cache files
+static const size_t MESH_CACHE_ALIGNMENT = 64;
+
+/// Largest number of bytes passed to zlib at once (its counters are 32 bit)
+static const size_t ZLIB_CHUNK_SIZE = 1 << 30;
+
+enum EMeshCacheFlags {
+	EHasNormals   = 1,
+	EHasTexCoords = 2,
+	ECompressed   = 4,
+	EReordered    = 8
+};
+
+/// Header of a mesh cache file, followed by the vertex positions, normals,
+/// texture coordinates and faces. Without compression, every array starts
+/// at a multiple of \ref MESH_CACHE_ALIGNMENT. With compression, the arrays
+/// form a single zlib stream without padding.
+struct MeshCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t indexSize;
+	uint32_t reserved;
+	uint64_t vertexCount;
+	uint64_t triangleCount;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	float toWorld[16];
+	float bboxMin[3];
+	float bboxMax[3];
+	uint8_t padding[48];
+};
+
+static_assert(sizeof(MeshCacheHeader) % MESH_CACHE_ALIGNMENT == 0,
+	"The mesh cache header must keep the arrays aligned");
+
+/// One of the arrays stored in a cache file
+struct MeshCacheArray {
+	void *data;
+	size_t size;
+};
+
+static size_t alignCacheOffset(size_t offset) {
+	return (offset + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT * MESH_CACHE_ALIGNMENT;
+}
+
+/// Compress the arrays into a single zlib stream
+static bool deflateArrays(std::ostream &os, const MeshCacheArray *arrays, int count) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(z_stream));
+	if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+		return false;
+
+	std::vector<uint8_t> buffer(1 << 20);
+	auto drain = [&](int flush) {
+		int ret;
+		do {
+			stream.next_out = buffer.data();
+			stream.avail_out = (uInt) buffer.size();
+			ret = deflate(&stream, flush);
+			os.write((const char *) buffer.data(), buffer.size() - stream.avail_out);
+		} while (stream.avail_out == 0 && ret == Z_OK);
+		return ret;
+	};
+
+	bool success = true;
+	for (int i = 0; i < count && success; ++i) {
+		const uint8_t *ptr = (const uint8_t *) arrays[i].data;
+		for (size_t left = arrays[i].size; left > 0 && success; ) {
+			size_t chunk = std::min(left, ZLIB_CHUNK_SIZE);
+			stream.next_in = (Bytef *) ptr;
+			stream.avail_in = (uInt) chunk;
+			int ret = drain(Z_NO_FLUSH);
+			success = ret == Z_OK || ret == Z_BUF_ERROR; /* Z_BUF_ERROR: no output was pending */
+			ptr += chunk;
+			left -= chunk;
+		}
+	}
+	if (success)
+		success = drain(Z_FINISH) == Z_STREAM_END;
+
+	deflateEnd(&stream);
+	return success && (bool) os;
+}
+
+/// Decompress a zlib stream into the given arrays, which must match it exactly
+static bool inflateArrays(const uint8_t *data, size_t size, MeshCacheArray *arrays, int count) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(z_stream));
+	if (inflateInit(&stream) != Z_OK)
+		return false;
+
+	auto feed = [&]() {
+		size_t chunk = std::min(size, ZLIB_CHUNK_SIZE);
+		stream.next_in = (Bytef *) data;
+		stream.avail_in = (uInt) chunk;
+		data += chunk;
+		size -= chunk;
+	};
+
+	int ret = Z_OK;
+	bool success = true;
+	for (int i = 0; i < count && success; ++i) {
+		stream.next_out = (Bytef *) arrays[i].data;
+		size_t left = arrays[i].size;
+		while (left > 0 && ret == Z_OK) {
+			if (stream.avail_in == 0)
+				feed();
+			uInt chunk = (uInt) std::min(left, ZLIB_CHUNK_SIZE);
+			stream.avail_out = chunk;
+			ret = inflate(&stream, Z_NO_FLUSH);
+			left -= chunk - stream.avail_out;
+		}
+		success = left == 0;
+	}
+
+	/* The stream has to end right after the last array */
+	if (success && ret == Z_OK) {
+		uint8_t extra;
+		stream.next_out = &extra;
+		stream.avail_out = 1;
+		if (stream.avail_in == 0)
+			feed();
+		ret = inflate(&stream, Z_NO_FLUSH);
+		success = stream.avail_out == 1;
+	}
+	success = success && ret == Z_STREAM_END;
+
+	inflateEnd(&stream);
+	return success;
+}
+
+std::string CachedMesh::getCacheFilename(const std::string &source, const Transform &trafo) const {
+	/* 64-bit FNV-1a hash of the transform matrix and the layout */
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const uint8_t *bytes = (const uint8_t *) trafo.getMatrix().data();
+	for (size_t i = 0; i < sizeof(float) * 16; ++i)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	hash = (hash ^ (m_reorder ? 1u : 0u)) * 0x100000001b3ull;
+	return tfm::format("%s.%016x.nmesh", source, hash);
+}
+
+bool CachedMesh::getSourceInfo(const std::string &source, uint64_t &size, int64_t &time) {
+#if defined(PLATFORM_WINDOWS)
+	struct _stat64 st;
+	if (_stat64(source.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(source.c_str(), &st) != 0)
+		return false;
+#endif
+	/* Nanosecond modification times, so that a source rewritten within the
+	   same second with the same size is still told apart */
+	size = (uint64_t) st.st_size;
+#if defined(PLATFORM_WINDOWS)
+	time = (int64_t) st.st_mtime * 1000000000;
+#elif defined(PLATFORM_MACOS)
+	time = (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	time = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+bool CachedMesh::loadCache(const std::string &source, const Transform &trafo) {
+	std::string filename = getCacheFilename(source, trafo);
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if (!m_cache || !filesystem::path(filename).exists() ||
+		!getSourceInfo(source, sourceSize, sourceTime))
+		return false;
+
+	std::unique_ptr<MemoryMappedFile> file;
+	try {
+		file.reset(new MemoryMappedFile(filename));
+	}
+	catch (const NoriException &) {
+		return false;
+	}
+
+	/* Reject files from other versions, or of another version of the source */
+	MeshCacheHeader header;
+	if (file->size() < sizeof(MeshCacheHeader))
+		return false;
+	memcpy(&header, file->data(), sizeof(MeshCacheHeader));
+	if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) != 0 ||
+		header.version != MESH_CACHE_VERSION || header.indexSize != sizeof(IndexType) ||
+		header.sourceSize != sourceSize || header.sourceTime != sourceTime ||
+		memcmp(header.toWorld, trafo.getMatrix().data(), sizeof(header.toWorld)) != 0)
+		return false;
+
+	/* Reordered and file order caches are kept apart */
+	bool reordered = (header.flags & EReordered) != 0;
+	if (reordered != m_reorder)
+		return false;
+
+	bool hasNormals = (header.flags & EHasNormals) != 0;
+	bool hasTexCoords = (header.flags & EHasTexCoords) != 0;
+	IndexType vertexCount = (IndexType) header.vertexCount;
+	IndexType triangleCount = (IndexType) header.triangleCount;
+
+	if (header.flags & ECompressed) {
+		MatrixXf V(3, vertexCount), N(3, hasNormals ? vertexCount : 0), UV(2, hasTexCoords ? vertexCount : 0);
+		IndexMatrix F(3, triangleCount);
+		MeshCacheArray arrays[4] = {
+			{ V.data(), sizeof(float) * V.size() },
+			{ N.data(), sizeof(float) * N.size() },
+			{ UV.data(), sizeof(float) * UV.size() },
+			{ F.data(), sizeof(IndexType) * F.size() }
+		};
+		if (!inflateArrays(file->data() + sizeof(MeshCacheHeader),
+				file->size() - sizeof(MeshCacheHeader), arrays, 4))
+			return false;
+		setData(std::move(V), std::move(N), std::move(UV), std::move(F));
+	}
+	else {
+		/* Use the mapped arrays in place */
+		size_t offsets[5];
+		offsets[0] = sizeof(MeshCacheHeader);
+		offsets[1] = alignCacheOffset(offsets[0] + sizeof(float) * 3 * (size_t) vertexCount);
+		offsets[2] = alignCacheOffset(offsets[1] + (hasNormals ? sizeof(float) * 3 * (size_t) vertexCount : 0));
+		offsets[3] = alignCacheOffset(offsets[2] + (hasTexCoords ? sizeof(float) * 2 * (size_t) vertexCount : 0));
+		offsets[4] = offsets[3] + sizeof(IndexType) * 3 * (size_t) triangleCount;
+		if (file->size() != offsets[4])
+			return false;
+
+		const uint8_t *data = file->data();
+		setData((const float *) (data + offsets[0]),
+			hasNormals ? (const float *) (data + offsets[1]) : nullptr,
+			hasTexCoords ? (const float *) (data + offsets[2]) : nullptr,
+			(const IndexType *) (data + offsets[3]),
+			vertexCount, triangleCount);
+		m_cacheFile = std::move(file);
+	}
+
+	m_reordered = reordered;
+	m_bbox = BoundingBox3f(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+		Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+	return true;
+}
+
+void CachedMesh::writeCache(const std::string &source, const Transform &trafo) const {
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if (!m_cache || !getSourceInfo(source, sourceSize, sourceTime))
+		return;
+
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(MeshCacheHeader));
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+	header.version = MESH_CACHE_VERSION;
+	header.flags = (m_N.size() > 0 ? EHasNormals : 0) | (m_UV.size() > 0 ? EHasTexCoords : 0) |
+		(m_compressCache ? ECompressed : 0) | (m_reordered ? EReordered : 0);
+	header.indexSize = (uint32_t) sizeof(IndexType);
+	header.vertexCount = getVertexCount();
+	header.triangleCount = getTriangleCount();
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+	memcpy(header.toWorld, trafo.getMatrix().data(), sizeof(header.toWorld));
+	for (int axis = 0; axis < 3; ++axis) {
+		header.bboxMin[axis] = m_bbox.min[axis];
+		header.bboxMax[axis] = m_bbox.max[axis];
+	}
+
+	MeshCacheArray arrays[4] = {
+		{ (void *) m_V.data(), sizeof(float) * m_V.size() },
+		{ (void *) m_N.data(), sizeof(float) * m_N.size() },
+		{ (void *) m_UV.data(), sizeof(float) * m_UV.size() },
+		{ (void *) m_F.data(), sizeof(IndexType) * m_F.size() }
+	};
+
+	/* Write to a temporary file first, so that an interrupted
+	   run never leaves a truncated cache file behind */
+	std::string filename = getCacheFilename(source, trafo);
+	std::string tempFilename = filename + ".tmp";
+	std::ofstream os(tempFilename, std::ios::binary);
+	os.write((const char *) &header, sizeof(MeshCacheHeader));
+
+	bool success = true;
+	if (m_compressCache) {
+		success = deflateArrays(os, arrays, 4);
+	}
+	else {
+		const char zeros[MESH_CACHE_ALIGNMENT] = { 0 };
+		size_t offset = sizeof(MeshCacheHeader);
+		for (const MeshCacheArray &array : arrays) {
+			size_t aligned = alignCacheOffset(offset);
+			os.write(zeros, aligned - offset);
+			os.write((const char *) array.data, array.size);
+			offset = aligned + array.size;
+		}
+	}
+	os.close();
+
+	std::remove(filename.c_str());
+	if (!success || !os || std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+		std::remove(tempFilename.c_str());
+		cerr << "Unable to write the mesh cache file \"" << filename << "\"!" << endl;
+	}
+}
+
+NORI_NAMESPACE_END
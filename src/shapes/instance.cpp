@@ -0,0 +1,177 @@
+#include <nori/shapes/instance.h>
+#include <nori/accelerators/bvh.h>
+#include <nori/bsdfs/bsdf.h>
+#include <nori/emitters/emitter.h>
+#include <filesystem/resolver.h>
+#include <Eigen/LU>
+#include <unordered_map>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList)
+	: Shape(propList)
+	, m_toLocal(m_toWorld.inverse()) {
+	filesystem::path filename =
+		getFileResolver()->resolve(propList.getString("filename"));
+
+	m_name = filename.str();
+	m_prototype = loadPrototype(m_name, propList);
+	m_mesh = static_cast<const Mesh *>(m_prototype->getShape(0));
+	m_orientation = m_toWorld.getMatrix().topLeftCorner<3, 3>().determinant() < 0 ? -1.f : 1.f;
+}
+
+void Instance::setToWorld(const Transform &toWorld) {
+	m_toWorld = toWorld;
+	m_toLocal = toWorld.inverse();
+	m_orientation = m_toWorld.getMatrix().topLeftCorner<3, 3>().determinant() < 0 ? -1.f : 1.f;
+	calculateBoundingBox();
+}
+
+std::shared_ptr<BVH> Instance::loadPrototype(const std::string &filename, const PropertyList &propList) {
+	/* The prototypes are only referenced weakly here, so that the geometry
+	   is released together with the last instance using it */
+	static std::mutex mutex;
+	static std::unordered_map<std::string, std::weak_ptr<BVH>> prototypes;
+
+	/* Load the mesh in object space, i.e. without any toWorld transform,
+	   but with the mesh options of the instance */
+	static const struct { const char *name; bool defaultValue; } meshOptions[] = {
+		{ "cache", true }, { "compressCache", false }, { "compactAttributes", false }, { "reorder", false }
+	};
+	PropertyList meshProps;
+	meshProps.setString("filename", filename);
+	std::string key = filename;
+	for (const auto &option : meshOptions) {
+		bool value = propList.getBoolean(option.name, option.defaultValue);
+		meshProps.setBoolean(option.name, value);
+		key += value ? '1' : '0';
+	}
+
+	/* The bottom-level BVH is built with the BVH options of the instance */
+	enum EOptionType { EBoolean, EInteger, EFloat, EString };
+	static const struct { const char *name; EOptionType type; } bvhOptions[] = {
+		{ "bvhBuilder", EString }, { "spatialSplits", EBoolean }, { "bvhBinCount", EInteger },
+		{ "spatialSplitBudget", EFloat }, { "spatialSplitAlpha", EFloat },
+		{ "precomputeTriangles", EBoolean }, { "bvhCache", EString },
+		{ "bvhLazy", EBoolean }, { "bvhLazySize", EInteger }
+	};
+	PropertyList bvhProps;
+	for (const auto &option : bvhOptions) {
+		if (!propList.has(option.name))
+			continue;
+		switch (option.type) {
+		case EBoolean:
+			bvhProps.setBoolean(option.name, propList.getBoolean(option.name));
+			key += tfm::format(";%s=%i", option.name, (int) propList.getBoolean(option.name));
+			break;
+		case EInteger:
+			bvhProps.setInteger(option.name, propList.getInteger(option.name));
+			key += tfm::format(";%s=%i", option.name, propList.getInteger(option.name));
+			break;
+		case EFloat:
+			bvhProps.setFloat(option.name, propList.getFloat(option.name));
+			key += tfm::format(";%s=%.9g", option.name, propList.getFloat(option.name));
+			break;
+		case EString:
+			bvhProps.setString(option.name, propList.getString(option.name));
+			key += tfm::format(";%s=%s", option.name, propList.getString(option.name));
+			break;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<BVH> prototype = prototypes[key].lock();
+	if (prototype)
+		return prototype;
+
+	Shape *mesh = static_cast<Shape *>(
+		NoriObjectFactory::createInstance("obj", meshProps));
+	mesh->activate();
+
+	prototype = std::make_shared<BVH>(bvhProps);
+	prototype->addShape(mesh);
+	prototype->build();
+
+	prototypes[key] = prototype;
+	return prototype;
+}
+
+void Instance::calculateBoundingBox() {
+	const BoundingBox3f &bbox = m_mesh->getBoundingBox();
+
+	m_bbox.reset();
+	for (int i = 0; i < 8; ++i)
+		m_bbox.expandBy(m_toWorld * bbox.getCorner(i));
+}
+
+bool Instance::rayIntersect(const Ray3f &ray_, float &outT, IntersectionQueryRecord* IQR /*= nullptr*/) const {
+	if (!IQR)
+		throw NoriException("No IntersectionQueryRecord found");
+
+	/* The direction is not renormalized, so distances along the
+	   ray are the same in world and in object space */
+	Ray3f ray = m_toLocal * ray_;
+
+	float t;
+	MeshIntersectionQueryRecord localMiqr;
+	const Shape *shape;
+	if (!m_prototype->rayIntersectPrimitive(ray, t, localMiqr, shape))
+		return false;
+
+	MeshIntersectionQueryRecord* miqr = static_cast<MeshIntersectionQueryRecord*>(IQR);
+	miqr->idx = localMiqr.f;
+	miqr->uv = localMiqr.uv;
+	outT = t;
+	return true;
+}
+
+void Instance::updateIntersection(const Ray3f &ray, Intersection &its, const IntersectionQueryRecord* IQR /*= nullptr*/) const {
+	m_mesh->updateIntersection(m_toLocal * ray, its, IQR);
+
+	its.p = m_toWorld * its.p;
+	its.geoFrame = Frame(m_orientation * Vector3f((m_toWorld * its.geoFrame.n).normalized()));
+	if (m_mesh->hasVertexNormals())
+		its.shFrame = Frame(Vector3f((m_toWorld * its.shFrame.n).normalized()));
+	else
+		its.shFrame = its.geoFrame;
+	its.shape = this;
+}
+
+void Instance::sampleArea(SampleQueryRecord& outSQR, const Point2f &sample) const {
+	throw NoriException("Instance::sampleArea is not yet implemented");
+}
+
+void Instance::sampleSolidAngle(SampleQueryRecord& outSQR, const Point2f &sample, const Point3f& x) const {
+	throw NoriException("Instance::sampleSolidAngle is not yet implemented");
+}
+
+float Instance::pdfArea(const Point3f &sample) const {
+	throw NoriException("Instance::pdfArea is not yet implemented");
+	return 0.f;
+}
+
+float Instance::pdfSolidAngle(const Point3f &sample, const Point3f& x) const {
+	throw NoriException("Instance::pdfSolidAngle is not yet implemented");
+	return 0.f;
+}
+
+std::string Instance::toString() const {
+	return tfm::format(
+		"Instance[\n"
+		"  filename = \"%s\",\n"
+		"  toWorld = %s,\n"
+		"  triangleCount = %i,\n"
+		"  bsdf = %s,\n"
+		"  emitter = %s\n"
+		"]",
+		m_name,
+		indent(m_toWorld.toString(), 12),
+		m_mesh->getTriangleCount(),
+		m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
+		m_emitter ? indent(m_emitter->toString()) : std::string("null")
+	);
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
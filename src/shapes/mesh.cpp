@@ -21,18 +21,350 @@ along with this program. If not, see <http://www.gnu.org/licenses/>.
 #include <nori/core/bbox.h>
 #include <nori/bsdfs/bsdf.h>
 #include <nori/warp/warp.h>
+#include <nori/core/timer.h>
 #include <Eigen/Geometry>
+#include <tbb/tbb.h>
+#include <atomic>
+#include <cstring>
+#include <new>
 
 NORI_NAMESPACE_BEGIN
 
-float Mesh::surfaceArea(uint32_t index) const {
-	uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+/// Largest magnitude of the 16 bit components of an octahedral normal
+static const float OCTAHEDRAL_SCALE = 32767.f;
+
+/// Decode a normal from its octahedral encoding
+static Normal3f decodeOctahedral(uint32_t packed) {
+	float x = std::max((int16_t) (packed & 0xFFFF) / OCTAHEDRAL_SCALE, -1.f);
+	float y = std::max((int16_t) (packed >> 16) / OCTAHEDRAL_SCALE, -1.f);
+	float z = 1.f - std::abs(x) - std::abs(y);
+
+	/* The lower hemisphere is folded over the diagonals */
+	if (z < 0.f) {
+		float fx = x;
+		x = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+		y = (1.f - std::abs(fx)) * (y >= 0.f ? 1.f : -1.f);
+	}
+	return Normal3f(Vector3f(x, y, z).normalized());
+}
+
+/**
+* \brief Encode a normal in 32 bits by projecting it onto an octahedron
+*
+* Of the four roundings of the projected coordinates, the one which
+* decodes closest to the normal is stored, which bounds the error by
+* about 0.0025 degrees.
+*/
+static uint32_t encodeOctahedral(const Vector3f &n) {
+	float sum = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+	if (!(sum > 0.f))
+		return 0; /* Decodes to (0, 0, 1) */
+
+	float x = n.x() / sum, y = n.y() / sum;
+	if (n.z() < 0.f) {
+		float fx = x;
+		x = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+		y = (1.f - std::abs(fx)) * (y >= 0.f ? 1.f : -1.f);
+	}
+
+	Vector3f direction = n / n.norm();
+	float qx = std::floor(x * OCTAHEDRAL_SCALE), qy = std::floor(y * OCTAHEDRAL_SCALE);
+	float bestError = std::numeric_limits<float>::infinity();
+	uint32_t best = 0;
+	for (int i = 0; i < 4; ++i) {
+		int ix = clamp((int) qx + (i & 1), -32767, 32767);
+		int iy = clamp((int) qy + (i >> 1), -32767, 32767);
+		uint32_t packed = (uint32_t) (uint16_t) ix | ((uint32_t) (uint16_t) iy << 16);
+		/* Unlike a dot product, this distance is accurate for tiny angles */
+		float error = (decodeOctahedral(packed) - direction).squaredNorm();
+		if (error < bestError) {
+			bestError = error;
+			best = packed;
+		}
+	}
+	return best;
+}
+
+/// Convert to a half precision float, rounding to the nearest value
+static uint16_t floatToHalf(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(float));
+	uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000);
+	uint32_t magnitude = bits & 0x7FFFFFFF;
+
+	if (magnitude >= 0x7F800000) /* Infinity and NaN */
+		return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+	if (magnitude >= 0x477FF000) /* Rounds to more than 65504 */
+		return sign | 0x7C00;
+	if (magnitude < 0x38800000) { /* Subnormal, in steps of 2^-24 */
+		float abs;
+		memcpy(&abs, &magnitude, sizeof(float));
+		return sign | (uint16_t) std::lrint(abs * 16777216.f);
+	}
+
+	/* Round the mantissa to nearest even, and rebias the exponent */
+	magnitude += 0xFFF + ((magnitude >> 13) & 1);
+	return sign | (uint16_t) ((magnitude - (112u << 23)) >> 13);
+}
+
+static float halfToFloat(uint16_t half) {
+	uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1F, mantissa = half & 0x3FF;
+	if (exponent == 0) {
+		float value = mantissa * (1.f / 16777216.f);
+		return sign ? -value : value;
+	}
+
+	uint32_t bits = sign | (mantissa << 13) |
+		(exponent == 0x1F ? 0x7F800000 : (exponent + 112) << 23);
+	float value;
+	memcpy(&value, &bits, sizeof(float));
+	return value;
+}
+
+void Mesh::setData(MatrixXf &&V, MatrixXf &&N, MatrixXf &&UV, IndexMatrix &&F) {
+	m_VData = std::move(V);
+	m_NData = std::move(N);
+	m_UVData = std::move(UV);
+	m_FData = std::move(F);
+	m_compactN.clear();
+	m_compactUV.clear();
+	m_reordered = false;
+
+	/* Maps can not be assigned, so they are constructed again in place */
+	new (&m_V) ConstMatrixXfMap(m_VData.data(), 3, m_VData.cols());
+	new (&m_N) ConstMatrixXfMap(m_NData.data(), 3, m_NData.cols());
+	new (&m_UV) ConstMatrixXfMap(m_UVData.data(), 2, m_UVData.cols());
+	new (&m_F) ConstIndexMatrixMap(m_FData.data(), 3, m_FData.cols());
+}
+
+void Mesh::setData(const float *V, const float *N, const float *UV, const IndexType *F,
+	IndexType vertexCount, IndexType triangleCount) {
+	m_VData = MatrixXf();
+	m_NData = MatrixXf();
+	m_UVData = MatrixXf();
+	m_FData = IndexMatrix();
+	m_compactN.clear();
+	m_compactUV.clear();
+	m_reordered = false;
+
+	new (&m_V) ConstMatrixXfMap(V, 3, vertexCount);
+	new (&m_N) ConstMatrixXfMap(N, 3, N ? vertexCount : 0);
+	new (&m_UV) ConstMatrixXfMap(UV, 2, UV ? vertexCount : 0);
+	new (&m_F) ConstIndexMatrixMap(F, 3, triangleCount);
+}
+
+void Mesh::compactAttributes() {
+	IndexType vertexCount = getVertexCount();
+	if (m_N.size() > 0) {
+		m_compactN.resize(vertexCount);
+		tbb::parallel_for(tbb::blocked_range<IndexType>(0, vertexCount),
+			[&](const tbb::blocked_range<IndexType> &range) {
+			for (IndexType i = range.begin(); i != range.end(); ++i)
+				m_compactN[i] = encodeOctahedral(m_N.col(i));
+		});
+		m_NData = MatrixXf();
+		new (&m_N) ConstMatrixXfMap(nullptr, 3, 0);
+	}
+
+	if (m_UV.size() > 0) {
+		m_compactUV.resize(vertexCount);
+		tbb::parallel_for(tbb::blocked_range<IndexType>(0, vertexCount),
+			[&](const tbb::blocked_range<IndexType> &range) {
+			for (IndexType i = range.begin(); i != range.end(); ++i)
+				m_compactUV[i] = (uint32_t) floatToHalf(m_UV(0, i)) |
+					((uint32_t) floatToHalf(m_UV(1, i)) << 16);
+		});
+		m_UVData = MatrixXf();
+		new (&m_UV) ConstMatrixXfMap(nullptr, 2, 0);
+	}
+}
+
+/**
+* \brief Measure how far apart related vertex indices are
+*
+* \param within
+*    Average distance between the indices of the vertices of a triangle
+* \param between
+*    Average distance between the closest vertex indices of consecutive triangles
+*/
+static void averageIndexDistances(const ConstIndexMatrixMap &F, double &within, double &between) {
+	IndexType triangleCount = (IndexType) F.cols();
+	auto distance = [](IndexType a, IndexType b) { return (double) (a > b ? a - b : b - a); };
+	std::pair<double, double> sums = tbb::parallel_reduce(
+		tbb::blocked_range<IndexType>(0, triangleCount),
+		std::make_pair(0.0, 0.0),
+		[&](const tbb::blocked_range<IndexType> &range, std::pair<double, double> result) {
+		for (IndexType i = range.begin(); i != range.end(); ++i) {
+			for (int k = 0; k < 3; ++k)
+				result.first += distance(F(k, i), F((k + 1) % 3, i));
+			if (i == 0)
+				continue;
+			double closest = std::numeric_limits<double>::infinity();
+			for (int k = 0; k < 3; ++k)
+				for (int j = 0; j < 3; ++j)
+					closest = std::min(closest, distance(F(k, i), F(j, i - 1)));
+			result.second += closest;
+		}
+		return result;
+	},
+		[](const std::pair<double, double> &a, const std::pair<double, double> &b) {
+		return std::make_pair(a.first + b.first, a.second + b.second);
+	}
+	);
+	within = triangleCount > 0 ? sums.first / (3.0 * triangleCount) : 0.0;
+	between = triangleCount > 1 ? sums.second / (triangleCount - 1) : 0.0;
+}
+
+void Mesh::reorder() {
+	IndexType vertexCount = getVertexCount(), triangleCount = getTriangleCount();
+	if (triangleCount == 0)
+		return;
+
+	cout << "Reordering \"" << m_name << "\" .. ";
+	cout.flush();
+	Timer timer;
+	double withinBefore, betweenBefore;
+	averageIndexDistances(m_F, withinBefore, betweenBefore);
+
+	/* Sort the triangles by the Morton codes of their centroids on a 1024^3
+	   grid. The grid spans the vertices, which are read in order, unlike the
+	   centroids of the triangles in the order of the file */
+	BoundingBox3f bounds = tbb::parallel_reduce(
+		tbb::blocked_range<IndexType>(0, vertexCount),
+		BoundingBox3f(),
+		[&](const tbb::blocked_range<IndexType> &range, BoundingBox3f result) {
+		for (IndexType i = range.begin(); i != range.end(); ++i)
+			result.expandBy(m_V.col(i));
+		return result;
+	},
+		[](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+		return BoundingBox3f::merge(b1, b2);
+	}
+	);
+
+	Vector3f extents = bounds.getExtents();
+	std::vector<std::pair<uint32_t, IndexType>> triangles(triangleCount);
+	tbb::parallel_for(tbb::blocked_range<IndexType>(0, triangleCount),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i) {
+			Point3f c = getCentroid(i);
+			uint32_t cell[3];
+			for (int axis = 0; axis < 3; ++axis) {
+				float rel = extents[axis] > 0 ? (c[axis] - bounds.min[axis]) / extents[axis] : 0.f;
+				cell[axis] = (uint32_t) clamp((int) (rel * 1024.f), 0, 1023);
+			}
+			triangles[i] = std::make_pair(mortonCode3D(cell[0], cell[1], cell[2]), i);
+		}
+	});
+
+	/* Ties are broken by the old index, so that the order is deterministic */
+	tbb::parallel_sort(triangles.begin(), triangles.end());
+
+	/* Find the first corner of the sorted triangles which uses each vertex */
+	std::unique_ptr<std::atomic<uint64_t>[]> firstUse(new std::atomic<uint64_t>[vertexCount]);
+	tbb::parallel_for(tbb::blocked_range<IndexType>(0, vertexCount),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i)
+			firstUse[i].store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+	});
+	tbb::parallel_for(tbb::blocked_range<IndexType>(0, triangleCount),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i) {
+			for (int k = 0; k < 3; ++k) {
+				std::atomic<uint64_t> &use = firstUse[m_F(k, triangles[i].second)];
+				uint64_t corner = 3 * (uint64_t) i + k;
+				uint64_t current = use.load(std::memory_order_relaxed);
+				while (corner < current && !use.compare_exchange_weak(current, corner, std::memory_order_relaxed))
+					;
+			}
+		}
+	});
+
+	/* Number the vertices in the order of their first use. Unused vertices go last */
+	std::vector<std::pair<uint64_t, IndexType>> vertices(vertexCount);
+	tbb::parallel_for(tbb::blocked_range<IndexType>(0, vertexCount),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i)
+			vertices[i] = std::make_pair(firstUse[i].load(std::memory_order_relaxed), i);
+	});
+	firstUse.reset();
+	tbb::parallel_sort(vertices.begin(), vertices.end());
+
+	/* Gather the attributes and remap the indices */
+	std::vector<IndexType> newIndex(vertexCount);
+	MatrixXf V(3, vertexCount), N(3, m_N.cols()), UV(2, m_UV.cols());
+	tbb::parallel_for(tbb::blocked_range<IndexType>(0, vertexCount),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i) {
+			IndexType old = vertices[i].second;
+			newIndex[old] = i;
+			V.col(i) = m_V.col(old);
+			if (N.size() > 0)
+				N.col(i) = m_N.col(old);
+			if (UV.size() > 0)
+				UV.col(i) = m_UV.col(old);
+		}
+	});
+
+	IndexMatrix F(3, triangleCount);
+	tbb::parallel_for(tbb::blocked_range<IndexType>(0, triangleCount),
+		[&](const tbb::blocked_range<IndexType> &range) {
+		for (IndexType i = range.begin(); i != range.end(); ++i) {
+			for (int k = 0; k < 3; ++k)
+				F(k, i) = newIndex[m_F(k, triangles[i].second)];
+		}
+	});
+
+	setData(std::move(V), std::move(N), std::move(UV), std::move(F));
+	m_reordered = true;
+
+	double withinAfter, betweenAfter;
+	averageIndexDistances(m_F, withinAfter, betweenAfter);
+	cout << "done. (average index distance within triangles " << withinBefore << " -> " << withinAfter
+		<< ", between consecutive triangles " << betweenBefore << " -> " << betweenAfter
+		<< ", took " << timer.elapsedString() << ")" << endl;
+}
+
+void Mesh::activate() {
+	/* Reorder first, the compact attributes are not gathered. Cached
+	   meshes may have been loaded in the reordered layout already */
+	if (m_reorder && !m_reordered)
+		reorder();
+	if (m_compactAttributes)
+		compactAttributes();
+
+	Shape::activate();
+}
+
+Normal3f Mesh::getVertexNormal(IndexType index) const {
+	if (!m_compactN.empty())
+		return decodeOctahedral(m_compactN[index]);
+	return Normal3f(m_N.col(index));
+}
+
+Point2f Mesh::getVertexTexCoord(IndexType index) const {
+	if (!m_compactUV.empty()) {
+		uint32_t packed = m_compactUV[index];
+		return Point2f(halfToFloat((uint16_t) (packed & 0xFFFF)), halfToFloat((uint16_t) (packed >> 16)));
+	}
+	return Point2f(m_UV.col(index));
+}
+
+float Mesh::surfaceArea(IndexType index) const {
+	IndexType i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
 	const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
 	return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
+void Mesh::calculateBoundingBox() {
+	m_bbox.reset();
+	for (IndexType i = 0; i < getVertexCount(); ++i)
+		m_bbox.expandBy(m_V.col(i));
+}
+
 bool Mesh::rayIntersect(const Ray3f &ray, float &outT, IntersectionQueryRecord* IQR /*= nullptr*/) const{
 	if (!IQR)
 		throw NoriException("No IntersectionQueryRecord found");
@@ -49,48 +381,9 @@ bool Mesh::rayIntersect(const Ray3f &ray, float &outT, IntersectionQueryRecord*
 	return false;
 }
 
-bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-	uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-	const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
-
-	/* Find vectors for two edges sharing v[0] */
-	Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
-
-	/* Begin calculating determinant - also used to calculate U parameter */
-	Vector3f pvec = ray.d.cross(edge2);
-
-	/* If determinant is near zero, ray lies in plane of triangle */
-	float det = edge1.dot(pvec);
-
-	if (det > -1e-8f && det < 1e-8f)
-		return false;
-	float inv_det = 1.0f / det;
-
-	/* Calculate distance from v[0] to ray origin */
-	Vector3f tvec = ray.o - p0;
-
-	/* Calculate U parameter and test bounds */
-	u = tvec.dot(pvec) * inv_det;
-	if (u < 0.0 || u > 1.0)
-		return false;
-
-	/* Prepare to test V parameter */
-	Vector3f qvec = tvec.cross(edge1);
-
-	/* Calculate V parameter and test bounds */
-	v = ray.d.dot(qvec) * inv_det;
-	if (v < 0.0 || u + v > 1.0)
-		return false;
-
-	/* Ray intersects triangle -> compute t */
-	t = edge2.dot(qvec) * inv_det;
-
-	return t >= ray.mint && t <= ray.maxt;
-}
-
 void Mesh::updateIntersection(const Ray3f &ray, Intersection &its, const IntersectionQueryRecord* IQR /*= nullptr*/) const {
 	const MeshIntersectionQueryRecord* miqr = static_cast<const MeshIntersectionQueryRecord*>(IQR);
-	uint32_t f = miqr->f;
+	IndexType f = miqr->f;
 
 	its.t = ray.maxt;
 	its.uv = miqr->uv; 
@@ -107,7 +400,7 @@ void Mesh::updateIntersection(const Ray3f &ray, Intersection &its, const Interse
 	bary << 1 - its.uv.sum(), its.uv;
 
 	/* Vertex indices of the triangle */
-	uint32_t idx0 = m_F(0, f), idx1 = m_F(1, f), idx2 = m_F(2, f);
+	IndexType idx0 = m_F(0, f), idx1 = m_F(1, f), idx2 = m_F(2, f);
 
 	Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
 
@@ -116,15 +409,15 @@ void Mesh::updateIntersection(const Ray3f &ray, Intersection &its, const Interse
 	its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
 
 	/* Compute proper texture coordinates if provided by the mesh */
-	if (m_UV.size() > 0)
-		its.uv = bary.x() * m_UV.col(idx0) +
-		bary.y() * m_UV.col(idx1) +
-		bary.z() * m_UV.col(idx2);
+	if (hasVertexTexCoords())
+		its.uv = bary.x() * getVertexTexCoord(idx0) +
+		bary.y() * getVertexTexCoord(idx1) +
+		bary.z() * getVertexTexCoord(idx2);
 
 	/* Compute the geometry frame */
 	its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
 
-	if (m_N.size() > 0) {
+	if (hasVertexNormals()) {
 		/* Compute the shading frame. Note that for simplicity,
 		the current implementation doesn't attempt to provide
 		tangents that are continuous across the surface. That
@@ -132,9 +425,9 @@ void Mesh::updateIntersection(const Ray3f &ray, Intersection &its, const Interse
 		use anisotropic BRDFs, which need tangent continuity */
 
 		its.shFrame = Frame(
-			(bary.x() * m_N.col(idx0) +
-				bary.y() * m_N.col(idx1) +
-				bary.z() * m_N.col(idx2)).normalized());
+			(bary.x() * getVertexNormal(idx0) +
+				bary.y() * getVertexNormal(idx1) +
+				bary.z() * getVertexNormal(idx2)).normalized());
 	}
 	else {
 		its.shFrame = its.geoFrame;
@@ -159,20 +452,67 @@ float Mesh::pdfSolidAngle(const Point3f &sample, const Point3f& x) const {
 	return 0.f;
 }
 
-BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
+BoundingBox3f Mesh::getBoundingBox(IndexType index) const {
 	BoundingBox3f result(m_V.col(m_F(0, index)));
 	result.expandBy(m_V.col(m_F(1, index)));
 	result.expandBy(m_V.col(m_F(2, index)));
 	return result;
 }
 
-Point3f Mesh::getCentroid(uint32_t index) const {
+Point3f Mesh::getCentroid(IndexType index) const {
 	return (1.0f / 3.0f) *
 		(m_V.col(m_F(0, index)) +
 			m_V.col(m_F(1, index)) +
 			m_V.col(m_F(2, index)));
 }
 
+void Mesh::initializeBuffers() {
+	/* Interleave position, normal and texture coordinates of every vertex */
+	IndexType vertexCount = getVertexCount();
+	std::vector<GLfloat> vertices(8 * (size_t) vertexCount, 0.f);
+	for (IndexType i = 0; i < vertexCount; ++i) {
+		GLfloat *vertex = &vertices[8 * (size_t) i];
+		for (int k = 0; k < 3; ++k)
+			vertex[k] = m_V(k, i);
+		if (hasVertexNormals()) {
+			Normal3f n = getVertexNormal(i);
+			for (int k = 0; k < 3; ++k)
+				vertex[3 + k] = n[k];
+		}
+		if (hasVertexTexCoords()) {
+			Point2f uv = getVertexTexCoord(i);
+			for (int k = 0; k < 2; ++k)
+				vertex[6 + k] = uv[k];
+		}
+	}
+
+	/* OpenGL only takes 32 bit indices */
+	std::vector<GLuint> indices(m_F.data(), m_F.data() + m_F.size());
+
+	glGenBuffers(1, &m_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, m_VBO);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+
+	glGenBuffers(1, &m_EBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_EBO);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+	glGenVertexArrays(1, &m_VAO);
+	glBindVertexArray(m_VAO);
+
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+
+	m_nIndices = (GLuint) indices.size();
+}
+
 std::string Mesh::toString() const {
 	return tfm::format(
 		"Mesh[\n"
@@ -16,29 +16,35 @@
     along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <gl/glew.h>
-#include <nori/shapes/mesh.h>
+#include <nori/shapes/cachedmesh.h>
 #include <nori/core/timer.h>
 #include <filesystem/resolver.h>
+#include <tbb/tbb.h>
 #include <unordered_map>
-#include <fstream>
+#include <cstdlib>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory mapped and split into chunks of whole lines, which
+ * are parsed in parallel. Every chunk deduplicates the face vertices it
+ * references on its own, and the chunks are then merged in file order, so
+ * that the vertices and indices come out exactly as if the file had been
+ * read line by line.
+ *
+ * The parsed mesh is cached in a binary file next to the OBJ file, which is
+ * mapped on later runs, see \ref CachedMesh.
  */
-class WavefrontOBJ : public Mesh {
+class WavefrontOBJ : public CachedMesh {
 public:
     WavefrontOBJ(const PropertyList &propList)
-	 : Mesh(propList){
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
+	 : CachedMesh(propList){
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
-        std::ifstream is(filename.str());
-        if (is.fail())
+        if (!filename.exists())
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
 
@@ -46,92 +52,134 @@ public:
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
+        bool cached = loadCache(filename.str(), trafo);
+        if (!cached)
+            parse(filename, trafo);
 
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
+        m_name = filename.str();
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and "
+             << memString(m_F.size() * sizeof(IndexType) +
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+             << (cached ? ", cached" : "") << ")" << endl;
 
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
+        if (!cached) {
+            /* Cache the reordered data, so that later runs can map it */
+            if (m_reorder)
+                reorder();
+            writeCache(filename.str(), trafo);
+        }
+    }
 
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) m_vertices.size();
-                        m_indices.push_back((uint32_t) m_vertices.size());
-                        m_vertices.push_back(v);
-                    } else {
-                        m_indices.push_back(it->second);
-                    }
-                }
-            }
+protected:
+    /// Parse the OBJ file and make its contents the mesh data
+    void parse(const filesystem::path &filename, const Transform &trafo) {
+        MemoryMappedFile file(filename.str());
+        const char *data = (const char *) file.data();
+        size_t size = file.size();
+
+        /* Split the file into chunks of whole lines */
+        size_t chunkSize = std::max(size / (size_t) (4 * tbb::this_task_arena::max_concurrency()), (size_t) MIN_CHUNK_SIZE);
+        size_t chunkCount = (size + chunkSize - 1) / chunkSize;
+        std::vector<size_t> bounds(chunkCount + 1);
+        for (size_t chunk = 0; chunk <= chunkCount; ++chunk) {
+            size_t pos = std::min(chunk * chunkSize, size);
+            while (pos > 0 && pos < size && data[pos - 1] != '\n')
+                pos++;
+            bounds[chunk] = pos;
         }
 
-        m_F.resize(3, m_indices.size()/3);
-        memcpy(m_F.data(), m_indices.data(), sizeof(uint32_t)*m_indices.size());
+        std::vector<OBJChunk> chunks(chunkCount);
+        tbb::parallel_for((size_t) 0, chunkCount, [&](size_t chunk) {
+            try {
+                parseChunk(data + bounds[chunk], data + bounds[chunk + 1], trafo, chunks[chunk]);
+            } catch (const NoriException &e) {
+                chunks[chunk].error = e.what();
+            }
+        });
 
-        m_V.resize(3, m_vertices.size());
-        for (uint32_t i=0; i<m_vertices.size(); ++i)
-            m_V.col(i) = positions.at(m_vertices[i].p-1);
+        /* Report the error in the first broken chunk, like a sequential parser would */
+        for (const OBJChunk &chunk : chunks) {
+            if (!chunk.error.empty())
+                throw NoriException("Error while loading OBJ file \"%s\": %s", filename, chunk.error);
+        }
 
-        if (!normals.empty()) {
-            m_N.resize(3, m_vertices.size());
-            for (uint32_t i=0; i<m_vertices.size(); ++i)
-                m_N.col(i) = normals.at(m_vertices[i].n-1);
+        /* Concatenate the vertex attributes in file order */
+        std::vector<Vector3f>   positions;
+        std::vector<Vector2f>   texcoords;
+        std::vector<Vector3f>   normals;
+        size_t indexCount = 0;
+        for (OBJChunk &chunk : chunks) {
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            m_bbox.expandBy(chunk.bbox);
+            chunk.positions = std::vector<Vector3f>();
+            chunk.texcoords = std::vector<Vector2f>();
+            chunk.normals = std::vector<Vector3f>();
+            indexCount += chunk.indices.size();
         }
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, m_vertices.size());
-            for (uint32_t i=0; i<m_vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(m_vertices[i].uv-1);
+        /* Merge the vertices of the chunks. A vertex gets its index when it
+           is first referenced, so visiting the chunks in order, and their
+           vertices in order of first reference, reproduces the numbering of
+           a single pass over the file */
+        VertexMap vertexMap;
+        std::vector<OBJVertex> vertices;
+        std::vector<size_t> indexOffsets(chunkCount);
+        for (size_t c = 0; c < chunkCount; ++c) {
+            OBJChunk &chunk = chunks[c];
+            indexOffsets[c] = c == 0 ? 0 : indexOffsets[c - 1] + chunks[c - 1].indices.size();
+            chunk.remap.resize(chunk.vertices.size());
+            for (size_t i = 0; i < chunk.vertices.size(); ++i) {
+                const OBJVertex &v = chunk.vertices[i];
+                if (v.p - 1 >= positions.size() ||
+                    (!texcoords.empty() && v.uv - 1 >= texcoords.size()) ||
+                    (!normals.empty() && v.n - 1 >= normals.size()))
+                    throw NoriException("Error while loading OBJ file \"%s\": vertex index out of range", filename);
+
+                auto result = vertexMap.emplace(v, (IndexType) vertices.size());
+                if (result.second)
+                    vertices.push_back(v);
+                chunk.remap[i] = result.first->second;
+            }
         }
 
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+        IndexMatrix F(3, indexCount / 3);
+        tbb::parallel_for((size_t) 0, chunkCount, [&](size_t c) {
+            const OBJChunk &chunk = chunks[c];
+            IndexType *target = F.data() + indexOffsets[c];
+            for (size_t i = 0; i < chunk.indices.size(); ++i)
+                target[i] = chunk.remap[chunk.indices[i]];
+        });
+        chunks.clear();
+
+        IndexType vertexCount = (IndexType) vertices.size();
+        MatrixXf V(3, vertexCount);
+        MatrixXf N(3, normals.empty() ? 0 : vertexCount);
+        MatrixXf UV(2, texcoords.empty() ? 0 : vertexCount);
+
+        tbb::parallel_for(tbb::blocked_range<IndexType>(0u, vertexCount, GRAIN_SIZE),
+            [&](const tbb::blocked_range<IndexType> &range) {
+                for (IndexType i = range.begin(); i != range.end(); ++i) {
+                    const OBJVertex &v = vertices[i];
+                    V.col(i) = positions[v.p - 1];
+                    if (!normals.empty())
+                        N.col(i) = normals[v.n - 1];
+                    if (!texcoords.empty())
+                        UV.col(i) = texcoords[v.uv - 1];
+                }
+            });
+
+        setData(std::move(V), std::move(N), std::move(UV), std::move(F));
     }
 
-protected:
+    /// Lower bound on the number of bytes parsed by one task
+    static const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+    /// Number of vertices copied into the mesh matrices by one task
+    static const IndexType GRAIN_SIZE = 1 << 14;
+
     /// Vertex indices used by the OBJ format
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
@@ -140,24 +188,44 @@ protected:
 
         inline OBJVertex() { }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
-
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+        /// Parse a face vertex of the form <tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>
+        inline OBJVertex(const char *start, const char *end) {
+            const char *tokens[3], *tokenEnds[3];
+            int count = 0;
+            for (const char *ptr = start; ; ptr = tokenEnds[count - 1] + 1) {
+                if (count == 3)
+                    throw NoriException("Invalid vertex data: \"%s\"", std::string(start, end));
+                const char *tokenEnd = (const char *) memchr(ptr, '/', (size_t) (end - ptr));
+                tokens[count] = ptr;
+                tokenEnds[count++] = tokenEnd ? tokenEnd : end;
+                if (!tokenEnd)
+                    break;
+            }
 
-            p = toUInt(tokens[0]);
+            p = parseIndex(tokens[0], tokenEnds[0], start, end);
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+            if (count >= 2 && tokens[1] != tokenEnds[1])
+                uv = parseIndex(tokens[1], tokenEnds[1], start, end);
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+            if (count >= 3 && tokens[2] != tokenEnds[2])
+                n = parseIndex(tokens[2], tokenEnds[2], start, end);
         }
 
         inline bool operator==(const OBJVertex &v) const {
             return v.p == p && v.n == n && v.uv == uv;
         }
+
+    private:
+        /// Parse an unsigned decimal index, which is zero when empty (and hence out of range)
+        static uint32_t parseIndex(const char *ptr, const char *end, const char *vertexStart, const char *vertexEnd) {
+            uint32_t result = 0;
+            for (; ptr != end; ++ptr) {
+                if (*ptr < '0' || *ptr > '9')
+                    throw NoriException("Invalid vertex data: \"%s\"", std::string(vertexStart, vertexEnd));
+                result = result * 10 + (uint32_t) (*ptr - '0');
+            }
+            return result;
+        }
     };
 
     /// Hash function for OBJVertex
@@ -170,35 +238,131 @@ protected:
         }
     };
 
-	void initializeBuffers() override {
-		glGenBuffers(1, &m_VBO);
-		glBindBuffer(GL_ARRAY_BUFFER, m_VBO);
-		glBufferData(GL_ARRAY_BUFFER, m_vertices.size() * sizeof(GLfloat), &m_vertices[0], GL_STATIC_DRAW);
+    typedef std::unordered_map<OBJVertex, IndexType, OBJVertexHash> VertexMap;
+
+    /// Contents of a range of lines, parsed independently of the rest of the file
+    struct OBJChunk {
+        std::vector<Vector3f>   positions;  ///< Transformed vertex positions
+        std::vector<Vector2f>   texcoords;
+        std::vector<Vector3f>   normals;    ///< Transformed and normalized vertex normals
+        BoundingBox3f           bbox;       ///< Bounds of \ref positions
+        std::vector<OBJVertex>  vertices;   ///< Face vertices in order of their first reference within the chunk
+        std::vector<IndexType>  indices;    ///< Triangle corners, indexing \ref vertices
+        std::vector<IndexType>  remap;      ///< Mesh vertex index of every entry of \ref vertices
+        std::string             error;      ///< Message of a parse error, if any
+    };
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    /// Advance \c ptr to the start of the next whitespace separated token, and return its end
+    static const char *nextToken(const char *&ptr, const char *end) {
+        while (ptr != end && isSpace(*ptr))
+            ++ptr;
+        const char *tokenEnd = ptr;
+        while (tokenEnd != end && !isSpace(*tokenEnd))
+            ++tokenEnd;
+        return tokenEnd;
+    }
+
+    /**
+     * \brief Parse the next token of a line as a floating point value
+     *
+     * The token is converted with \c strtof, which rounds exactly like
+     * the stream extraction used before. It is copied first, since the
+     * mapped file is not null terminated.
+     *
+     * \return \c false if the line has no more tokens
+     */
+    static bool parseFloat(const char *&ptr, const char *end, float &value) {
+        const char *tokenEnd = nextToken(ptr, end);
+        size_t length = (size_t) (tokenEnd - ptr);
+        if (length == 0)
+            return false;
+
+        char buffer[64];
+        if (length >= sizeof(buffer))
+            throw NoriException("Invalid number \"%s\"", std::string(ptr, tokenEnd));
+        memcpy(buffer, ptr, length);
+        buffer[length] = '\0';
+
+        char *bufferEnd = nullptr;
+        value = std::strtof(buffer, &bufferEnd);
+        if (bufferEnd != buffer + length)
+            throw NoriException("Invalid number \"%s\"", std::string(ptr, tokenEnd));
+        ptr = tokenEnd;
+        return true;
+    }
+
+    /// Parse the lines within <tt>[start, end)</tt>
+    static void parseChunk(const char *start, const char *end, const Transform &trafo, OBJChunk &chunk) {
+        VertexMap vertexMap;
 
-		glGenBuffers(1, &m_EBO);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(GLuint), &m_indices[0], GL_STATIC_DRAW);
+        while (start != end) {
+            const char *lineEnd = (const char *) memchr(start, '\n', (size_t) (end - start));
+            if (!lineEnd)
+                lineEnd = end;
 
-		glGenVertexArrays(1, &m_VAO);
-		glBindVertexArray(m_VAO);
+            const char *ptr = start;
+            const char *prefixEnd = nextToken(ptr, lineEnd);
+            std::string prefix(ptr, prefixEnd);
+            ptr = prefixEnd;
 
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
+            if (prefix == "v") {
+                Point3f p;
+                if (!parseFloat(ptr, lineEnd, p.x()) || !parseFloat(ptr, lineEnd, p.y()) ||
+                    !parseFloat(ptr, lineEnd, p.z()))
+                    throw NoriException("Invalid vertex position: \"%s\"", std::string(start, lineEnd));
+                p = trafo * p;
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+            } else if (prefix == "vt") {
+                Point2f tc = Point2f::Zero();
+                if (!parseFloat(ptr, lineEnd, tc.x()))
+                    throw NoriException("Invalid texture coordinate: \"%s\"", std::string(start, lineEnd));
+                parseFloat(ptr, lineEnd, tc.y());
+                chunk.texcoords.push_back(tc);
+            } else if (prefix == "vn") {
+                Normal3f n;
+                if (!parseFloat(ptr, lineEnd, n.x()) || !parseFloat(ptr, lineEnd, n.y()) ||
+                    !parseFloat(ptr, lineEnd, n.z()))
+                    throw NoriException("Invalid vertex normal: \"%s\"", std::string(start, lineEnd));
+                chunk.normals.push_back((trafo * n).normalized());
+            } else if (prefix == "f") {
+                /* Only the first four vertices of a polygon are used */
+                OBJVertex verts[6];
+                int nVertices = 0;
+                for (; nVertices < 4; ++nVertices) {
+                    const char *vertexEnd = nextToken(ptr, lineEnd);
+                    if (ptr == vertexEnd)
+                        break;
+                    verts[nVertices] = OBJVertex(ptr, vertexEnd);
+                    ptr = vertexEnd;
+                }
 
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0); 
-		glBindVertexArray(0);
+                if (nVertices < 3)
+                    throw NoriException("Invalid face: \"%s\"", std::string(start, lineEnd));
 
-		m_nIndices = m_indices.size();
-		m_indices.clear();
-		m_vertices.clear();
-	}
+                if (nVertices == 4) {
+                    /* This is a quad, split into two triangles */
+                    verts[4] = verts[0];
+                    verts[5] = verts[2];
+                    nVertices = 6;
+                }
+                /* Convert to an indexed vertex list */
+                for (int i=0; i<nVertices; ++i) {
+                    const OBJVertex &v = verts[i];
+                    auto result = vertexMap.emplace(v, (IndexType) chunk.vertices.size());
+                    if (result.second)
+                        chunk.vertices.push_back(v);
+                    chunk.indices.push_back(result.first->second);
+                }
+            }
 
-	std::vector<uint32_t>   m_indices;
-	std::vector<OBJVertex>  m_vertices;
+            start = lineEnd == end ? end : lineEnd + 1;
+        }
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -0,0 +1,451 @@
+#include <nori/shapes/mesh.h>
+#include <nori/core/mmap.h>
+#include <nori/core/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/tbb.h>
+#include <atomic>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+* \brief Loader for binary PLY triangle meshes
+*
+* Little and big endian files are supported, ASCII files are not. The file
+* is memory mapped. Vertex records all have the same size, so they are
+* converted into the mesh matrices in parallel. Face records are lists of
+* varying length. A first pass over the faces finds the start of every
+* block of faces and its first triangle. The blocks are then split into
+* triangle fans in parallel.
+*
+* Besides the positions (\c x, \c y, \c z), vertex normals (\c nx, \c ny,
+* \c nz) and texture coordinates (\c u, \c v or \c s, \c t) are loaded. All
+* other properties and elements are skipped.
+*/
+class PLYMesh : public Mesh {
+public:
+	PLYMesh(const PropertyList &propList)
+		: Mesh(propList) {
+		filesystem::path filename =
+			getFileResolver()->resolve(propList.getString("filename"));
+
+		if (!filename.exists())
+			throw NoriException("Unable to open PLY file \"%s\"!", filename);
+		Transform trafo = propList.getTransform("toWorld", Transform());
+
+		cout << "Loading \"" << filename << "\" .. ";
+		cout.flush();
+		Timer timer;
+
+		MemoryMappedFile file(filename.str());
+
+		const uint8_t *ptr = file.data(), *end = file.data() + file.size();
+		std::vector<Element> elements;
+		bool swap = false, hasVertices = false;
+		try {
+			ptr = parseHeader(ptr, end, elements, swap);
+
+			MatrixXf V, N, UV;
+			IndexMatrix F;
+			for (const Element &element : elements) {
+				if (element.name == "vertex") {
+					ptr = readVertices(ptr, end, element, swap, trafo, V, N, UV);
+					hasVertices = true;
+				}
+				else if (element.name == "face") {
+					if (!hasVertices)
+						throw NoriException("The faces must follow the vertices");
+					ptr = readFaces(ptr, end, element, swap, (IndexType) V.cols(), F);
+				}
+				else
+					ptr = skipElement(ptr, end, element, swap);
+			}
+			setData(std::move(V), std::move(N), std::move(UV), std::move(F));
+		}
+		catch (const NoriException &e) {
+			throw NoriException("Error while loading PLY file \"%s\": %s", filename, e.what());
+		}
+
+		m_name = filename.str();
+		cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+			<< timer.elapsedString() << " and "
+			<< memString(m_F.size() * sizeof(IndexType) +
+				sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+			<< ")" << endl;
+	}
+
+protected:
+	/// Number of faces which are triangulated by one task
+	static const size_t FACE_BLOCK_SIZE = 1 << 16;
+
+	/// Number of vertices which are converted by one task
+	static const IndexType GRAIN_SIZE = 1 << 14;
+
+	/// Scalar types of PLY properties
+	enum EType {
+		EInt8 = 0, EUInt8, EInt16, EUInt16, EInt32, EUInt32, EFloat32, EFloat64
+	};
+
+	/// Property of an element, either a scalar or a list of scalars
+	struct Property {
+		std::string name;
+		EType type;          ///< Type of the scalar, or of the list items
+		bool isList = false;
+		EType countType;     ///< Type of the item count of a list
+	};
+
+	/// Element declared in the header, i.e. a block of records with the same properties
+	struct Element {
+		std::string name;
+		size_t count;
+		std::vector<Property> properties;
+
+		/// Size of a record, or 0 if it contains lists
+		size_t recordSize() const {
+			size_t size = 0;
+			for (const Property &property : properties) {
+				if (property.isList)
+					return 0;
+				size += typeSize(property.type);
+			}
+			return size;
+		}
+
+		/// Byte offset of a scalar property within a record without lists, or -1 if missing
+		ptrdiff_t offset(const std::string &name, EType &type) const {
+			ptrdiff_t offset = 0;
+			for (const Property &property : properties) {
+				if (property.name == name) {
+					type = property.type;
+					return offset;
+				}
+				offset += (ptrdiff_t) typeSize(property.type);
+			}
+			return -1;
+		}
+	};
+
+	static size_t typeSize(EType type) {
+		static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+		return sizes[type];
+	}
+
+	static EType parseType(const std::string &name) {
+		if (name == "char" || name == "int8") return EInt8;
+		if (name == "uchar" || name == "uint8") return EUInt8;
+		if (name == "short" || name == "int16") return EInt16;
+		if (name == "ushort" || name == "uint16") return EUInt16;
+		if (name == "int" || name == "int32") return EInt32;
+		if (name == "uint" || name == "uint32") return EUInt32;
+		if (name == "float" || name == "float32") return EFloat32;
+		if (name == "double" || name == "float64") return EFloat64;
+		throw NoriException("Unknown property type \"%s\"", name);
+	}
+
+	/// Load a value in the byte order of the file
+	template <typename T> static T load(const uint8_t *ptr, bool swap) {
+		T value;
+		if (swap) {
+			uint8_t bytes[sizeof(T)];
+			for (size_t i = 0; i < sizeof(T); ++i)
+				bytes[i] = ptr[sizeof(T) - 1 - i];
+			memcpy(&value, bytes, sizeof(T));
+		}
+		else {
+			memcpy(&value, ptr, sizeof(T));
+		}
+		return value;
+	}
+
+	static double readScalar(const uint8_t *ptr, EType type, bool swap) {
+		switch (type) {
+			case EInt8: return (double) load<int8_t>(ptr, swap);
+			case EUInt8: return (double) load<uint8_t>(ptr, swap);
+			case EInt16: return (double) load<int16_t>(ptr, swap);
+			case EUInt16: return (double) load<uint16_t>(ptr, swap);
+			case EInt32: return (double) load<int32_t>(ptr, swap);
+			case EUInt32: return (double) load<uint32_t>(ptr, swap);
+			case EFloat32: return (double) load<float>(ptr, swap);
+			default: return load<double>(ptr, swap);
+		}
+	}
+
+	/// Read an integer scalar (list counts and vertex indices)
+	static int64_t readInteger(const uint8_t *ptr, EType type, bool swap) {
+		switch (type) {
+			case EInt8: return load<int8_t>(ptr, swap);
+			case EUInt8: return load<uint8_t>(ptr, swap);
+			case EInt16: return load<int16_t>(ptr, swap);
+			case EUInt16: return load<uint16_t>(ptr, swap);
+			case EInt32: return load<int32_t>(ptr, swap);
+			default: return load<uint32_t>(ptr, swap);
+		}
+	}
+
+	static void checkSize(const uint8_t *ptr, const uint8_t *end, size_t size) {
+		if ((size_t) (end - ptr) < size)
+			throw NoriException("Unexpected end of file");
+	}
+
+	/// Parse the header, returns a pointer to the start of the binary data
+	static const uint8_t *parseHeader(const uint8_t *ptr, const uint8_t *end,
+		std::vector<Element> &elements, bool &swap) {
+		bool first = true, hasFormat = false;
+		while (true) {
+			const uint8_t *lineEnd = (const uint8_t *) memchr(ptr, '\n', (size_t) (end - ptr));
+			if (!lineEnd)
+				throw NoriException("Unexpected end of the header");
+			std::vector<std::string> tokens = tokenize(std::string((const char *) ptr, (const char *) lineEnd), " \t\r");
+			ptr = lineEnd + 1;
+
+			if (first) {
+				if (tokens.size() != 1 || tokens[0] != "ply")
+					throw NoriException("Not a PLY file");
+				first = false;
+			}
+			else if (tokens.empty() || tokens[0] == "comment" || tokens[0] == "obj_info") {
+				continue;
+			}
+			else if (tokens[0] == "format" && tokens.size() == 3) {
+				/* Swap bytes if the file and the machine disagree on the byte order */
+				const uint16_t one = 1;
+				bool littleEndianHost = *(const uint8_t *) &one == 1;
+				if (tokens[1] == "binary_little_endian")
+					swap = !littleEndianHost;
+				else if (tokens[1] == "binary_big_endian")
+					swap = littleEndianHost;
+				else if (tokens[1] == "ascii")
+					throw NoriException("ASCII PLY files are not supported, only binary ones");
+				else
+					throw NoriException("Unknown format \"%s\"", tokens[1]);
+				hasFormat = true;
+			}
+			else if (tokens[0] == "element" && tokens.size() == 3) {
+				Element element;
+				element.name = tokens[1];
+				element.count = (size_t) std::stoull(tokens[2]);
+				elements.push_back(element);
+			}
+			else if (tokens[0] == "property" && !elements.empty()) {
+				Property property;
+				if (tokens.size() == 5 && tokens[1] == "list") {
+					property.isList = true;
+					property.countType = parseType(tokens[2]);
+					property.type = parseType(tokens[3]);
+					property.name = tokens[4];
+					if (property.countType >= EFloat32)
+						throw NoriException("List counts must be integers (property \"%s\")", property.name);
+				}
+				else if (tokens.size() == 3) {
+					property.type = parseType(tokens[1]);
+					property.name = tokens[2];
+				}
+				else {
+					throw NoriException("Invalid property declaration");
+				}
+				elements.back().properties.push_back(property);
+			}
+			else if (tokens[0] == "end_header" && tokens.size() == 1) {
+				break;
+			}
+			else {
+				throw NoriException("Invalid header line \"%s\"", tokens[0]);
+			}
+		}
+
+		if (!hasFormat)
+			throw NoriException("The header does not specify the format");
+		return ptr;
+	}
+
+	/// Skip over the records of an element which is not needed
+	static const uint8_t *skipElement(const uint8_t *ptr, const uint8_t *end, const Element &element, bool swap) {
+		size_t recordSize = element.recordSize();
+		if (recordSize > 0 || element.properties.empty()) {
+			checkSize(ptr, end, recordSize * element.count);
+			return ptr + recordSize * element.count;
+		}
+
+		for (size_t i = 0; i < element.count; ++i) {
+			for (const Property &property : element.properties) {
+				if (property.isList) {
+					checkSize(ptr, end, typeSize(property.countType));
+					int64_t count = readInteger(ptr, property.countType, swap);
+					ptr += typeSize(property.countType);
+					if (count < 0)
+						throw NoriException("Negative list length");
+					checkSize(ptr, end, (size_t) count * typeSize(property.type));
+					ptr += (size_t) count * typeSize(property.type);
+				}
+				else {
+					checkSize(ptr, end, typeSize(property.type));
+					ptr += typeSize(property.type);
+				}
+			}
+		}
+		return ptr;
+	}
+
+	/// Convert the vertex records into positions, normals and texture coordinates, and compute the bounds
+	const uint8_t *readVertices(const uint8_t *ptr, const uint8_t *end, const Element &element,
+		bool swap, const Transform &trafo, MatrixXf &V, MatrixXf &N, MatrixXf &UV) {
+		size_t recordSize = element.recordSize();
+		if (recordSize == 0)
+			throw NoriException("Vertices with list properties are not supported");
+		if (element.count > (size_t) std::numeric_limits<IndexType>::max())
+			throw NoriException("Too many vertices (%i), consider the wide index mode", element.count);
+		checkSize(ptr, end, recordSize * element.count);
+
+		/* Find the offsets of the loaded properties */
+		const char *names[8] = { "x", "y", "z", "nx", "ny", "nz", "u", "v" };
+		ptrdiff_t offsets[8];
+		EType types[8];
+		for (int i = 0; i < 8; ++i)
+			offsets[i] = element.offset(names[i], types[i]);
+		if (offsets[6] < 0 || offsets[7] < 0) {
+			offsets[6] = element.offset("s", types[6]);
+			offsets[7] = element.offset("t", types[7]);
+		}
+
+		if (offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0)
+			throw NoriException("The vertices have no x, y and z properties");
+		bool hasNormals = offsets[3] >= 0 && offsets[4] >= 0 && offsets[5] >= 0;
+		bool hasTexCoords = offsets[6] >= 0 && offsets[7] >= 0;
+
+		IndexType vertexCount = (IndexType) element.count;
+		V.resize(3, vertexCount);
+		N.resize(3, hasNormals ? vertexCount : 0);
+		UV.resize(2, hasTexCoords ? vertexCount : 0);
+
+		auto read = [&](const uint8_t *record, int i) {
+			return (float) readScalar(record + offsets[i], types[i], swap);
+		};
+
+		m_bbox = tbb::parallel_reduce(
+			tbb::blocked_range<IndexType>(0u, vertexCount, GRAIN_SIZE),
+			BoundingBox3f(),
+			[&](const tbb::blocked_range<IndexType> &range, BoundingBox3f result) {
+				for (IndexType i = range.begin(); i != range.end(); ++i) {
+					const uint8_t *record = ptr + recordSize * (size_t) i;
+					Point3f p = trafo * Point3f(read(record, 0), read(record, 1), read(record, 2));
+					V.col(i) = p;
+					result.expandBy(p);
+					if (hasNormals)
+						N.col(i) = (trafo * Normal3f(read(record, 3), read(record, 4), read(record, 5))).normalized();
+					if (hasTexCoords)
+						UV.col(i) = Point2f(read(record, 6), read(record, 7));
+				}
+				return result;
+			},
+			[](const BoundingBox3f &a, const BoundingBox3f &b) {
+				return BoundingBox3f::merge(a, b);
+			});
+		return ptr + recordSize * element.count;
+	}
+
+	/// Advance over a face record, returns the number of vertices and their indices
+	static const uint8_t *readFace(const uint8_t *ptr, const uint8_t *end, const Element &element,
+		size_t listIndex, bool swap, size_t &count, const uint8_t *&indices) {
+		for (size_t k = 0; k < element.properties.size(); ++k) {
+			const Property &property = element.properties[k];
+			if (property.isList) {
+				checkSize(ptr, end, typeSize(property.countType));
+				int64_t length = readInteger(ptr, property.countType, swap);
+				ptr += typeSize(property.countType);
+				if (length < 0)
+					throw NoriException("Negative list length");
+				checkSize(ptr, end, (size_t) length * typeSize(property.type));
+				if (k == listIndex) {
+					count = (size_t) length;
+					indices = ptr;
+				}
+				ptr += (size_t) length * typeSize(property.type);
+			}
+			else {
+				checkSize(ptr, end, typeSize(property.type));
+				ptr += typeSize(property.type);
+			}
+		}
+		return ptr;
+	}
+
+	/// Split the polygons of the face records into triangle fans
+	static const uint8_t *readFaces(const uint8_t *ptr, const uint8_t *end, const Element &element,
+		bool swap, IndexType vertexCount, IndexMatrix &F) {
+		size_t listIndex = element.properties.size();
+		for (size_t k = 0; k < element.properties.size(); ++k) {
+			const Property &property = element.properties[k];
+			if (property.isList && (property.name == "vertex_indices" || property.name == "vertex_index"))
+				listIndex = k;
+		}
+		if (listIndex == element.properties.size())
+			throw NoriException("The faces have no vertex_indices property");
+		EType indexType = element.properties[listIndex].type;
+		if (indexType >= EFloat32)
+			throw NoriException("Vertex indices must be integers");
+		size_t indexSize = typeSize(indexType);
+
+		/* Find the start of every block of faces and its first triangle */
+		size_t blockCount = (element.count + FACE_BLOCK_SIZE - 1) / FACE_BLOCK_SIZE;
+		std::vector<const uint8_t *> blockStarts(blockCount + 1);
+		std::vector<size_t> triangleOffsets(blockCount + 1);
+		size_t triangleCount = 0;
+		for (size_t i = 0; i < element.count; ++i) {
+			if (i % FACE_BLOCK_SIZE == 0) {
+				blockStarts[i / FACE_BLOCK_SIZE] = ptr;
+				triangleOffsets[i / FACE_BLOCK_SIZE] = triangleCount;
+			}
+			size_t count = 0;
+			const uint8_t *indices = nullptr;
+			ptr = readFace(ptr, end, element, listIndex, swap, count, indices);
+			if (count >= 3)
+				triangleCount += count - 2;
+		}
+		blockStarts[blockCount] = ptr;
+		triangleOffsets[blockCount] = triangleCount;
+
+		if (triangleCount > (size_t) std::numeric_limits<IndexType>::max())
+			throw NoriException("Too many triangles (%i), consider the wide index mode", triangleCount);
+		F.resize(3, (IndexType) triangleCount);
+
+		/* Triangulate the blocks in parallel. Polygons with fewer than three vertices are dropped */
+		std::atomic<bool> invalidIndex(false);
+		tbb::parallel_for((size_t) 0, blockCount, [&](size_t block) {
+			const uint8_t *face = blockStarts[block];
+			IndexType *target = F.data() + 3 * triangleOffsets[block];
+			size_t faceCount = std::min((size_t) FACE_BLOCK_SIZE, element.count - block * FACE_BLOCK_SIZE);
+			for (size_t i = 0; i < faceCount; ++i) {
+				size_t count = 0;
+				const uint8_t *indices = nullptr;
+				face = readFace(face, end, element, listIndex, swap, count, indices);
+				if (count < 3)
+					continue;
+
+				int64_t first = readInteger(indices, indexType, swap);
+				int64_t previous = readInteger(indices + indexSize, indexType, swap);
+				if (first < 0 || first >= (int64_t) vertexCount ||
+					previous < 0 || previous >= (int64_t) vertexCount) {
+					invalidIndex = true;
+					return;
+				}
+				for (size_t k = 2; k < count; ++k) {
+					int64_t current = readInteger(indices + k * indexSize, indexType, swap);
+					if (current < 0 || current >= (int64_t) vertexCount) {
+						invalidIndex = true;
+						return;
+					}
+					*target++ = (IndexType) first;
+					*target++ = (IndexType) previous;
+					*target++ = (IndexType) current;
+					previous = current;
+				}
+			}
+		});
+
+		if (invalidIndex)
+			throw NoriException("Vertex index out of range");
+		return ptr;
+	}
+};
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
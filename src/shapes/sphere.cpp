@@ -26,36 +26,7 @@ void Sphere::calculateBoundingBox(){
 }
 
 bool Sphere::rayIntersect(const Ray3f &ray_, float &outT, IntersectionQueryRecord* IQR /*= nullptr*/) const{
-	Ray3f ray = ray_;
-
-	// Calculate quadratic coefficients
-	double a = ray.d.dot(ray.d);
-	double b = 2.f * (ray.d.dot(ray.o - m_center));
-	double c = (ray.o - m_center).dot(ray.o - m_center) - m_radius*m_radius;
-
-	double t0, t1;
-
-	// Check for a quadratic solution. If none, no intersection
-	if (!quadratic(a, b, c, t0, t1))
-		return false;
-
-	// If the intersection is outside the ray's min and max, no intersection
-	if (t0 > ray.maxt || t1 < ray.mint)
-		return false;
-
-	// try to get a solution inside the ray's min and max 
-	float tHit = (float)t0;
-	if (t0 < ray.mint)
-	{
-		tHit = (float)t1;
-		if (tHit > ray.maxt)
-			return false;
-	}
-
-	// Intersection found
-	outT = tHit;
-	
-	return true;
+	return intersect(ray_, outT);
 }
 
 void Sphere::updateIntersection(const Ray3f &ray, Intersection &its, const IntersectionQueryRecord* IQR /*= nullptr*/) const {